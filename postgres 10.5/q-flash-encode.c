@@ -0,0 +1,583 @@
+/*
+ * q-flash-encode.c
+ *		Binary plan encoding of qflash.log_format = 'binary' and its decoder
+ */
+#include "postgres.h"
+#include "q-flash.h"
+
+// Plan node types of the binary encoding. The stored id is the position in
+// this table plus one, zero for other nodes. Entries are only ever appended,
+// NodeTag values differ between PostgreSQL versions.
+static const struct
+{
+	NodeTag		tag;
+	const char *name;			// as EXPLAIN names it
+} qflash_node_types[] = {
+	{T_Result, "Result"},
+	{T_ProjectSet, "ProjectSet"},
+	{T_ModifyTable, "ModifyTable"},
+	{T_Append, "Append"},
+	{T_MergeAppend, "Merge Append"},
+	{T_RecursiveUnion, "Recursive Union"},
+	{T_BitmapAnd, "BitmapAnd"},
+	{T_BitmapOr, "BitmapOr"},
+	{T_NestLoop, "Nested Loop"},
+	{T_MergeJoin, "Merge Join"},
+	{T_HashJoin, "Hash Join"},
+	{T_SeqScan, "Seq Scan"},
+	{T_SampleScan, "Sample Scan"},
+	{T_Gather, "Gather"},
+	{T_GatherMerge, "Gather Merge"},
+	{T_IndexScan, "Index Scan"},
+	{T_IndexOnlyScan, "Index Only Scan"},
+	{T_BitmapIndexScan, "Bitmap Index Scan"},
+	{T_BitmapHeapScan, "Bitmap Heap Scan"},
+	{T_TidScan, "Tid Scan"},
+	{T_SubqueryScan, "Subquery Scan"},
+	{T_FunctionScan, "Function Scan"},
+	{T_TableFuncScan, "Table Function Scan"},
+	{T_ValuesScan, "Values Scan"},
+	{T_CteScan, "CTE Scan"},
+	{T_NamedTuplestoreScan, "Named Tuplestore Scan"},
+	{T_WorkTableScan, "WorkTable Scan"},
+	{T_ForeignScan, "Foreign Scan"},
+	{T_CustomScan, "Custom Scan"},
+	{T_Material, "Materialize"},
+	{T_Sort, "Sort"},
+	{T_Group, "Group"},
+	{T_Agg, "Aggregate"},
+	{T_WindowAgg, "WindowAgg"},
+	{T_Unique, "Unique"},
+	{T_SetOp, "SetOp"},
+	{T_LockRows, "LockRows"},
+	{T_Limit, "Limit"},
+	{T_Hash, "Hash"}
+};
+
+PG_FUNCTION_INFO_V1(qflash_decode_plan);
+
+/*
+ * Node type as EXPLAIN names it.
+ */
+const char *
+qflash_node_type_name(NodeTag tag)
+{
+	int			id = qflash_node_type_id(tag);
+
+	return id > 0 ? qflash_node_types[id - 1].name : "???";
+}
+
+/*
+ * Id of a node type in the binary encoding, zero for types not in
+ * qflash_node_types.
+ */
+int
+qflash_node_type_id(NodeTag tag)
+{
+	int			i;
+
+	for (i = 0; i < lengthof(qflash_node_types); i++)
+	{
+		if (qflash_node_types[i].tag == tag) return i + 1;
+	}
+
+	return 0;
+}
+
+void
+qflash_varint_append(StringInfo str, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		appendStringInfoChar(str, (char) ((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	appendStringInfoChar(str, (char) value);
+}
+
+uint64
+qflash_varint_read(QFlashPlanDecoder *dec)
+{
+	uint64		value = 0;
+	int			shift;
+
+	for (shift = 0; shift < 64; shift += 7)
+	{
+		uint8		byte;
+
+		if (dec->off >= dec->len) break;
+
+		byte = dec->data[dec->off++];
+		value |= (uint64) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) return value;
+	}
+
+	ereport(ERROR,
+		(errcode(ERRCODE_DATA_CORRUPTED),
+		 errmsg("invalid q-flash plan encoding")));
+	return 0;
+}
+
+/*
+ * Counters are stored as varints, rounded to the precision EXPLAIN shows:
+ * costs in hundredths, times in usec.
+ */
+static inline uint64
+qflash_plan_uint(double value)
+{
+	return value > 0 ? (uint64) rint(value) : 0;
+}
+
+/*
+ * Reference to a relation or index in the encoded plan, 0 for none. Each OID
+ * is stored once.
+ */
+uint64
+qflash_plan_intern(QFlashPlanEncoder *enc, Oid relid)
+{
+	int			i;
+
+	if (!OidIsValid(relid)) return 0;
+
+	for (i = 0; i < enc->nrels; i++)
+	{
+		if (enc->rels[i] == relid) return i + 1;
+	}
+
+	if (enc->nrels == enc->caprels)
+	{
+		enc->caprels = enc->caprels ? enc->caprels * 2 : 8;
+		enc->rels = enc->rels
+			? repalloc(enc->rels, enc->caprels * sizeof(Oid))
+			: palloc(enc->caprels * sizeof(Oid));
+	}
+	enc->rels[enc->nrels++] = relid;
+
+	return enc->nrels;
+}
+
+bool
+qflash_count_children_walker(PlanState *planstate, int *nchildren)
+{
+	(*nchildren)++;
+	return false;
+}
+
+/*
+ * Compact form of the instrumented plan tree: magic, version, flags, the
+ * interned OIDs and the nodes in EXPLAIN order, each with its node tag,
+ * number of children, relation and index reference, estimates and, as the
+ * flags say, actuals, buffer counters and profile samples. The encoding
+ * starts after VARHDRSZ reserved bytes, so it can be stored as a bytea in
+ * place.
+ */
+void
+qflash_plan_encode(QueryDesc *queryDesc, QFlashQueryState *state, StringInfo buf)
+{
+	QFlashPlanEncoder enc;
+	int			i;
+
+	memset(&enc, 0, sizeof(enc));
+	enc.stmt	= queryDesc->plannedstmt;
+	enc.state	= state;
+	initStringInfo(&enc.nodes);
+
+	if (state->full)
+	{
+		enc.flags |= QFLASH_PLAN_ANALYZE;
+		if (state->instrument_options & INSTRUMENT_TIMER)
+			enc.flags |= QFLASH_PLAN_TIMING;
+		if (state->instrument_options & INSTRUMENT_BUFFERS)
+			enc.flags |= QFLASH_PLAN_BUFFERS;
+	}
+	if (state->profile_samples != NULL)
+		enc.flags |= QFLASH_PLAN_PROFILE;
+
+	qflash_plan_encode_node(queryDesc->planstate, &enc);
+
+	initStringInfo(buf);
+	appendStringInfoSpaces(buf, VARHDRSZ);
+	appendStringInfoChar(buf, QFLASH_PLAN_MAGIC);
+	appendStringInfoChar(buf, QFLASH_PLAN_VERSION);
+	qflash_varint_append(buf, enc.flags);
+	qflash_varint_append(buf, enc.nrels);
+	for (i = 0; i < enc.nrels; i++)
+		qflash_varint_append(buf, enc.rels[i]);
+	appendBinaryStringInfo(buf, enc.nodes.data, enc.nodes.len);
+
+	pfree(enc.nodes.data);
+	if (enc.rels)
+		pfree(enc.rels);
+}
+
+bool
+qflash_plan_encode_node(PlanState *planstate, QFlashPlanEncoder *enc)
+{
+	Plan	   *plan = planstate->plan;
+	StringInfo	str = &enc->nodes;
+	int			nchildren = 0;
+
+	planstate_tree_walker(planstate, qflash_count_children_walker, &nchildren);
+
+	qflash_varint_append(str, qflash_node_type_id(nodeTag(plan)));
+	qflash_varint_append(str, nchildren);
+	qflash_varint_append(str, qflash_plan_intern(enc, qflash_node_relid(plan, enc->stmt)));
+	qflash_varint_append(str, qflash_plan_intern(enc, qflash_node_indexid(plan)));
+	qflash_varint_append(str, qflash_plan_uint(plan->startup_cost * 100.0));
+	qflash_varint_append(str, qflash_plan_uint(plan->total_cost * 100.0));
+	qflash_varint_append(str, qflash_plan_uint(plan->plan_rows));
+	qflash_varint_append(str, plan->plan_width > 0 ? plan->plan_width : 0);
+
+	if (enc->flags & QFLASH_PLAN_ANALYZE)
+	{
+		Instrumentation *instr = planstate->instrument;
+		Instrumentation empty;
+
+		if (instr != NULL)
+			InstrEndLoop(instr);
+		else
+		{
+			memset(&empty, 0, sizeof(empty));
+			instr = &empty;
+		}
+
+		qflash_varint_append(str, qflash_plan_uint(instr->nloops));
+		qflash_varint_append(str, qflash_plan_uint(instr->ntuples));
+
+		if (enc->flags & QFLASH_PLAN_TIMING)
+		{
+			qflash_varint_append(str, qflash_plan_uint(instr->startup * 1000000.0));
+			qflash_varint_append(str, qflash_plan_uint(instr->total * 1000000.0));
+		}
+
+		if (enc->flags & QFLASH_PLAN_BUFFERS)
+		{
+			qflash_varint_append(str, instr->bufusage.shared_blks_hit);
+			qflash_varint_append(str, instr->bufusage.shared_blks_read);
+			qflash_varint_append(str, instr->bufusage.shared_blks_dirtied);
+			qflash_varint_append(str, instr->bufusage.shared_blks_written);
+			qflash_varint_append(str, instr->bufusage.temp_blks_read);
+			qflash_varint_append(str, instr->bufusage.temp_blks_written);
+		}
+	}
+
+	if (enc->flags & QFLASH_PLAN_PROFILE)
+	{
+		int			id = plan->plan_node_id;
+
+		qflash_varint_append(str, id < enc->state->nnodes ? enc->state->profile_samples[id] : 0);
+	}
+
+	return planstate_tree_walker(planstate, qflash_plan_encode_node, enc);
+}
+
+/*
+ * Render an encoded plan as text, in the layout of EXPLAIN, or as JSON with
+ * the keys of EXPLAIN (FORMAT JSON). Relations are named as they are now.
+ *
+ * CREATE FUNCTION qflash_decode_plan(bytea, text DEFAULT 'text') RETURNS text
+ * AS 'q-flash', 'qflash_decode_plan' LANGUAGE C STRICT STABLE;
+ */
+Datum
+qflash_decode_plan(PG_FUNCTION_ARGS)
+{
+	bytea	   *plan = PG_GETARG_BYTEA_PP(0);
+	char	   *format = PG_NARGS() > 1 ? text_to_cstring(PG_GETARG_TEXT_PP(1)) : "text";
+	QFlashPlanDecoder dec;
+	StringInfoData str;
+
+	memset(&dec, 0, sizeof(dec));
+
+	if (pg_strcasecmp(format, "text") == 0)
+		dec.format = EXPLAIN_FORMAT_TEXT;
+	else if (pg_strcasecmp(format, "json") == 0)
+		dec.format = EXPLAIN_FORMAT_JSON;
+	else
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unrecognized plan format \"%s\"", format),
+			 errhint("Valid formats are \"text\" and \"json\".")));
+
+	qflash_plan_decoder_init(&dec, plan);
+
+	initStringInfo(&str);
+	dec.str = &str;
+
+	if (dec.format == EXPLAIN_FORMAT_JSON)
+		appendStringInfoString(&str, "{\"Plan\": ");
+	qflash_plan_decode_node(&dec, 0);
+	if (dec.format == EXPLAIN_FORMAT_JSON)
+		appendStringInfoChar(&str, '}');
+
+	if (dec.off != dec.len)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("invalid q-flash plan encoding")));
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(str.data, str.len));
+}
+
+/*
+ * Parse the header of an encoded plan, up to its first node.
+ */
+void
+qflash_plan_decoder_init(QFlashPlanDecoder *dec, bytea *plan)
+{
+	uint64		nrels;
+	int			i;
+
+	dec->data	= (const uint8 *) VARDATA_ANY(plan);
+	dec->len	= VARSIZE_ANY_EXHDR(plan);
+
+	if (dec->len < 2 || dec->data[0] != QFLASH_PLAN_MAGIC || dec->data[1] != QFLASH_PLAN_VERSION)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("invalid q-flash plan encoding")));
+	dec->off = 2;
+
+	dec->flags = (int) qflash_varint_read(dec);
+	nrels = qflash_varint_read(dec);
+
+	// Every OID takes at least one byte
+	if (nrels > dec->len - dec->off)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("invalid q-flash plan encoding")));
+
+	dec->nrels = (int) nrels;
+	dec->rels = (Oid *) palloc((dec->nrels + 1) * sizeof(Oid));
+	for (i = 0; i < dec->nrels; i++)
+		dec->rels[i] = (Oid) qflash_varint_read(dec);
+}
+
+/*
+ * OID of an interned relation or index, InvalidOid for none.
+ */
+Oid
+qflash_plan_rel_ref(QFlashPlanDecoder *dec, uint64 ref)
+{
+	if (ref == 0) return InvalidOid;
+
+	if (ref > (uint64) dec->nrels)
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("invalid q-flash plan encoding")));
+
+	return dec->rels[ref - 1];
+}
+
+/*
+ * Name of a relation or index, NULL for none.
+ */
+char *
+qflash_plan_rel_name(Oid relid)
+{
+	char	   *name;
+
+	if (!OidIsValid(relid)) return NULL;
+
+	name = get_rel_name(relid);
+
+	// Dropped since the plan was captured
+	return name != NULL ? name : psprintf("%u", relid);
+}
+
+/*
+ * Next node of an encoded plan, actuals per loop as EXPLAIN shows them.
+ */
+void
+qflash_plan_read_node(QFlashPlanDecoder *dec, QFlashPlanNode *node)
+{
+	uint64		type_id;
+	int			i;
+
+	memset(node, 0, sizeof(QFlashPlanNode));
+
+	// Ids of a newer q-flash are not guessed at
+	type_id = qflash_varint_read(dec);
+	if (type_id > lengthof(qflash_node_types))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("invalid q-flash plan encoding"),
+			 errdetail("Unknown plan node type %u.", (unsigned int) type_id)));
+
+	node->type			= type_id > 0 ? qflash_node_types[type_id - 1].name : "???";
+	node->nchildren		= qflash_varint_read(dec);
+	node->relid			= qflash_plan_rel_ref(dec, qflash_varint_read(dec));
+	node->indexid		= qflash_plan_rel_ref(dec, qflash_varint_read(dec));
+	node->startup_cost	= qflash_varint_read(dec) / 100.0;
+	node->total_cost	= qflash_varint_read(dec) / 100.0;
+	node->plan_rows		= qflash_varint_read(dec);
+	node->plan_width	= qflash_varint_read(dec);
+
+	if (dec->flags & QFLASH_PLAN_ANALYZE)
+	{
+		node->loops	= qflash_varint_read(dec);
+		node->rows	= qflash_varint_read(dec);
+
+		if (dec->flags & QFLASH_PLAN_TIMING)
+		{
+			node->startup_time	= qflash_varint_read(dec) / 1000.0;
+			node->total_time	= qflash_varint_read(dec) / 1000.0;
+		}
+
+		if (dec->flags & QFLASH_PLAN_BUFFERS)
+		{
+			for (i = 0; i < lengthof(node->buffers); i++)
+				node->buffers[i] = qflash_varint_read(dec);
+		}
+
+		if (node->loops > 0)
+		{
+			node->rows			/= node->loops;
+			node->startup_time	/= node->loops;
+			node->total_time	/= node->loops;
+		}
+	}
+
+	if (dec->flags & QFLASH_PLAN_PROFILE)
+		node->samples = qflash_varint_read(dec);
+}
+
+void
+qflash_plan_decode_node(QFlashPlanDecoder *dec, int depth)
+{
+	StringInfo	str = dec->str;
+	QFlashPlanNode node;
+	char	   *relname;
+	char	   *indexname;
+	uint64	   *buffers = node.buffers;
+	uint64		i;
+
+	check_stack_depth();
+
+	qflash_plan_read_node(dec, &node);
+	relname		= qflash_plan_rel_name(node.relid);
+	indexname	= qflash_plan_rel_name(node.indexid);
+
+	if (dec->format == EXPLAIN_FORMAT_JSON)
+	{
+		appendStringInfoString(str, "{\"Node Type\": ");
+		escape_json(str, node.type);
+		if (relname != NULL)
+		{
+			appendStringInfoString(str, ", \"Relation Name\": ");
+			escape_json(str, relname);
+		}
+		if (indexname != NULL)
+		{
+			appendStringInfoString(str, ", \"Index Name\": ");
+			escape_json(str, indexname);
+		}
+		appendStringInfo(str, ", \"Startup Cost\": %.2f, \"Total Cost\": %.2f, \"Plan Rows\": %.0f, \"Plan Width\": " UINT64_FORMAT,
+			node.startup_cost, node.total_cost, node.plan_rows, node.plan_width);
+
+		if (dec->flags & QFLASH_PLAN_ANALYZE)
+		{
+			if (dec->flags & QFLASH_PLAN_TIMING)
+				appendStringInfo(str, ", \"Actual Startup Time\": %.3f, \"Actual Total Time\": %.3f", node.startup_time, node.total_time);
+			appendStringInfo(str, ", \"Actual Rows\": %.0f, \"Actual Loops\": %.0f", node.rows, node.loops);
+		}
+		if (dec->flags & QFLASH_PLAN_BUFFERS)
+			appendStringInfo(str, ", \"Shared Hit Blocks\": " UINT64_FORMAT ", \"Shared Read Blocks\": " UINT64_FORMAT
+				", \"Shared Dirtied Blocks\": " UINT64_FORMAT ", \"Shared Written Blocks\": " UINT64_FORMAT
+				", \"Temp Read Blocks\": " UINT64_FORMAT ", \"Temp Written Blocks\": " UINT64_FORMAT,
+				buffers[0], buffers[1], buffers[2], buffers[3], buffers[4], buffers[5]);
+		if (dec->flags & QFLASH_PLAN_PROFILE)
+			appendStringInfo(str, ", \"Profile Samples\": " UINT64_FORMAT, node.samples);
+
+		if (node.nchildren > 0)
+		{
+			appendStringInfoString(str, ", \"Plans\": [");
+			for (i = 0; i < node.nchildren; i++)
+			{
+				if (i > 0)
+					appendStringInfoString(str, ", ");
+				qflash_plan_decode_node(dec, depth + 1);
+			}
+			appendStringInfoChar(str, ']');
+		}
+		appendStringInfoChar(str, '}');
+		return;
+	}
+
+	if (depth > 0)
+	{
+		appendStringInfoChar(str, '\n');
+		appendStringInfoSpaces(str, depth * 6 - 4);
+		appendStringInfoString(str, "->  ");
+	}
+
+	appendStringInfoString(str, node.type);
+	if (indexname != NULL && relname != NULL)
+		appendStringInfo(str, " using %s on %s", indexname, relname);
+	else if (indexname != NULL || relname != NULL)
+		appendStringInfo(str, " on %s", indexname != NULL ? indexname : relname);
+
+	appendStringInfo(str, "  (cost=%.2f..%.2f rows=%.0f width=" UINT64_FORMAT ")",
+		node.startup_cost, node.total_cost, node.plan_rows, node.plan_width);
+
+	if (dec->flags & QFLASH_PLAN_ANALYZE)
+	{
+		if (node.loops == 0)
+			appendStringInfoString(str, " (never executed)");
+		else if (dec->flags & QFLASH_PLAN_TIMING)
+			appendStringInfo(str, " (actual time=%.3f..%.3f rows=%.0f loops=%.0f)",
+				node.startup_time, node.total_time, node.rows, node.loops);
+		else
+			appendStringInfo(str, " (actual rows=%.0f loops=%.0f)", node.rows, node.loops);
+	}
+
+	if ((dec->flags & QFLASH_PLAN_BUFFERS) && (buffers[0] || buffers[1] || buffers[2] || buffers[3] || buffers[4] || buffers[5]))
+	{
+		appendStringInfoChar(str, '\n');
+		appendStringInfoSpaces(str, depth * 6 + 2);
+		appendStringInfo(str, "Buffers: shared hit=" UINT64_FORMAT " read=" UINT64_FORMAT " dirtied=" UINT64_FORMAT
+			" written=" UINT64_FORMAT ", temp read=" UINT64_FORMAT " written=" UINT64_FORMAT,
+			buffers[0], buffers[1], buffers[2], buffers[3], buffers[4], buffers[5]);
+	}
+
+	if (dec->flags & QFLASH_PLAN_PROFILE)
+	{
+		appendStringInfoChar(str, '\n');
+		appendStringInfoSpaces(str, depth * 6 + 2);
+		appendStringInfo(str, "Profile: " UINT64_FORMAT " samples", node.samples);
+	}
+
+	for (i = 0; i < node.nchildren; i++)
+		qflash_plan_decode_node(dec, depth + 1);
+}
+
+/*
+ * Nodes of an encoded plan in EXPLAIN order, numbered from 1.
+ */
+void
+qflash_plan_collect_nodes(QFlashPlanDecoder *dec, int parent_id, QFlashPlanNodes *nodes)
+{
+	QFlashPlanNode *node;
+	uint64		nchildren;
+	int			id;
+	uint64		i;
+
+	check_stack_depth();
+
+	if (nodes->len == nodes->cap)
+	{
+		nodes->cap = nodes->cap ? nodes->cap * 2 : 16;
+		nodes->nodes = nodes->nodes
+			? repalloc(nodes->nodes, nodes->cap * sizeof(QFlashPlanNode))
+			: palloc(nodes->cap * sizeof(QFlashPlanNode));
+	}
+
+	node = &nodes->nodes[nodes->len++];
+	qflash_plan_read_node(dec, node);
+	node->id		= nodes->len;
+	node->parent_id	= parent_id;
+
+	// node moves when the children grow the array
+	id			= node->id;
+	nchildren	= node->nchildren;
+
+	for (i = 0; i < nchildren; i++)
+		qflash_plan_collect_nodes(dec, id, nodes);
+}
@@ -0,0 +1,485 @@
+/*
+ * q-flash-partition.c
+ *		Daily partitions of the log relations: created ahead of time, dropped once
+ *		expired, and records of days without partition skipped
+ */
+#include "postgres.h"
+#include "q-flash.h"
+
+static TimestampTz qflash_partition_warned = 0;	// last message about records without a partition
+
+PG_FUNCTION_INFO_V1(qflash_rotate);
+
+/*
+ * Create partitions of a partitioned log relation ahead of time and drop the
+ * expired ones, for setups without the background worker.
+ */
+Datum
+qflash_rotate(PG_FUNCTION_ARGS)
+{
+	char  *namespace_name	= text_to_cstring(PG_GETARG_TEXT_P(0));
+	char  *relname_name		= text_to_cstring(PG_GETARG_TEXT_P(1));
+	Oid		relid			= get_relname_relid(relname_name, get_namespace_oid(namespace_name, false));
+
+	if (!OidIsValid(relid))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_TABLE),
+			 errmsg("relation \"%s.%s\" does not exist", namespace_name, relname_name)));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+	{
+		elog(ERROR, "SPI_connect failed");
+		PG_RETURN_BOOL(false);
+	}
+
+	qflash_rotate_partitions(relid);
+
+	if (SPI_finish() != SPI_OK_FINISH)
+	{
+		elog(ERROR, "SPI_finish failed");
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Create the daily partitions up to QFLASH_PARTITION_PREMAKE days ahead and
+ * drop those that ended more than qflash.retention days ago, of the log
+ * relation and of its nodes relation when that is partitioned as well.
+ * Partitions are named <relname>_pYYYYMMDD and cover one UTC day. Relations
+ * that are not partitioned are left alone. Caller is connected to SPI.
+ */
+void
+qflash_rotate_partitions(Oid relid)
+{
+	char	   *relname = get_rel_name(relid);
+	Oid			nspid;
+	char	   *nspname;
+	int64		today;
+	Oid			nodes_func = InvalidOid;
+	Oid			nodes_relid;
+	char	   *nodes_name;
+	bool		nodes_partitioned;
+	int			i;
+
+	if (relname == NULL) return;
+
+	if (get_rel_relkind(relid) != RELKIND_PARTITIONED_TABLE) return;
+
+	nspid	= get_rel_namespace(relid);
+	nspname	= get_namespace_name(nspid);
+	today	= GetCurrentTimestamp() / USECS_PER_DAY;
+
+	nodes_name			= psprintf("%s%s", relname, QFLASH_NODES_SUFFIX);
+	nodes_relid			= get_relname_relid(nodes_name, nspid);
+	nodes_partitioned	= OidIsValid(nodes_relid) && get_rel_relkind(nodes_relid) == RELKIND_PARTITIONED_TABLE;
+
+	// JSON logs of qflash_init index the node labels of every partition
+	if (get_atttype(relid, get_attnum(relid, "plan")) == JSONBOID)
+	{
+		Oid			argtype = JSONBOID;
+
+		nodes_func = LookupFuncName(list_make2(makeString(nspname), makeString(psprintf("%s_plan_nodes", relname))),
+			1, &argtype, true);
+	}
+
+	for (i = 0; i <= QFLASH_PARTITION_PREMAKE; i++)
+	{
+		char		part_name[NAMEDATALEN];
+
+		if (nodes_partitioned)
+			qflash_partition_create(nspid, nspname, nodes_name, "log_id, node_id", today + i);
+
+		if (!qflash_partition_create(nspid, nspname, relname, "id", today + i)) continue;
+
+		if (OidIsValid(nodes_func))
+		{
+			qflash_partition_name(part_name, relname, today + i);
+			qflash_execute_ddl(psprintf("CREATE INDEX IF NOT EXISTS %s ON %s USING GIN (%s(plan))",
+				quote_identifier(psprintf("%s_plan_nodes_idx", part_name)), quote_qualified_identifier(nspname, part_name),
+				quote_qualified_identifier(nspname, psprintf("%s_plan_nodes", relname))));
+		}
+	}
+
+	if (qflash_retention <= 0) return;
+
+	qflash_partitions_drop(relid, nspname, relname, today);
+
+	// Node rows of the dropped log rows
+	if (nodes_partitioned)
+		qflash_partitions_drop(nodes_relid, nspname, nodes_name, today);
+	else if (OidIsValid(nodes_relid))
+	{
+		char		cutoff[16];
+		char	   *query;
+
+		// Nodes relations of log tables created before it was partitioned
+		qflash_partition_bound(cutoff, today - qflash_retention);
+		query = psprintf("DELETE FROM %s WHERE added < '%s 00:00:00+00'",
+			quote_qualified_identifier(nspname, nodes_name), cutoff);
+
+		if (SPI_execute(query, false, 0) != SPI_OK_DELETE)
+		{
+			elog(ERROR, "SPI_execute failed for \"%s\"", query);
+		}
+	}
+}
+
+/*
+ * Create the partition of one day with its primary key, false when it
+ * exists already. Caller is connected to SPI.
+ */
+bool
+qflash_partition_create(Oid nspid, const char *nspname, const char *relname, const char *pkey, int64 day)
+{
+	char		part_name[NAMEDATALEN];
+	char		from[16];
+	char		to[16];
+
+	qflash_partition_name(part_name, relname, day);
+	if (OidIsValid(get_relname_relid(part_name, nspid))) return false;
+
+	qflash_partition_bound(from, day);
+	qflash_partition_bound(to, day + 1);
+
+	qflash_execute_ddl(psprintf(
+		"CREATE TABLE IF NOT EXISTS %s PARTITION OF %s (CONSTRAINT %s PRIMARY KEY (%s)) "
+		"FOR VALUES FROM ('%s 00:00:00+00') TO ('%s 00:00:00+00')",
+		quote_qualified_identifier(nspname, part_name), quote_qualified_identifier(nspname, relname),
+		quote_identifier(psprintf("%s_pkey", part_name)), pkey, from, to));
+
+	return true;
+}
+
+/*
+ * Drop the partitions that ended more than qflash.retention days ago.
+ * Caller is connected to SPI.
+ */
+void
+qflash_partitions_drop(Oid relid, const char *nspname, const char *relname, int64 today)
+{
+	List	   *children;
+	ListCell   *lc;
+
+	children = find_inheritance_children(relid, NoLock);
+	foreach(lc, children)
+	{
+		char	   *child_name = get_rel_name(lfirst_oid(lc));
+		int64		day;
+
+		if (child_name == NULL || !qflash_partition_day(relname, child_name, &day)) continue;
+
+		// Still has rows younger than the retention
+		if (day + 1 + qflash_retention > today) continue;
+
+		qflash_execute_ddl(psprintf("DROP TABLE IF EXISTS %s", quote_qualified_identifier(nspname, child_name)));
+	}
+}
+
+void
+qflash_partition_name(char *name, const char *relname, int64 day)
+{
+	int			year;
+	int			month;
+	int			mday;
+
+	j2date((int) (day + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+	snprintf(name, NAMEDATALEN, "%s_p%04d%02d%02d", relname, year, month, mday);
+}
+
+void
+qflash_partition_bound(char *bound, int64 day)
+{
+	int			year;
+	int			month;
+	int			mday;
+
+	j2date((int) (day + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+	snprintf(bound, 16, "%04d-%02d-%02d", year, month, mday);
+}
+
+/*
+ * Day of a partition from its name, false for relations not named by
+ * qflash_partition_name.
+ */
+bool
+qflash_partition_day(const char *relname, const char *child_name, int64 *day)
+{
+	Size		prefix_len = strlen(relname);
+	int			year;
+	int			month;
+	int			mday;
+
+	if (strncmp(child_name, relname, prefix_len) != 0 || strncmp(child_name + prefix_len, "_p", 2) != 0) return false;
+
+	child_name += prefix_len + 2;
+	if (strlen(child_name) != 8 || strspn(child_name, "0123456789") != 8) return false;
+	if (sscanf(child_name, "%4d%2d%2d", &year, &month, &mday) != 3) return false;
+
+	*day = date2j(year, month, mday) - POSTGRES_EPOCH_JDATE;
+	return true;
+}
+
+void
+qflash_execute_ddl(const char *query)
+{
+	if (SPI_execute(query, false, 0) != SPI_OK_UTILITY)
+	{
+		elog(ERROR, "SPI_execute failed for \"%s\"", query);
+	}
+}
+
+/*
+ * Keep the records of a partitioned log relation whose day has a partition at
+ * the front of recs and return their number. The others are dropped instead
+ * of failing the capturing statement, counted and reported in the server log
+ * at most once per QFLASH_PARTITION_WARN_INTERVAL: the client of the captured
+ * statement cannot do anything about it. The relation
+ * is registered with the flush worker, which creates its partitions from then
+ * on; without worker they need qflash_rotate.
+ */
+int
+qflash_partition_filter(QFlashRecord *recs, int nrecs)
+{
+	Oid			relid = recs[0].relid;
+	char	   *relname;
+	char	   *nodes_name;
+	Oid			nspid;
+	Oid			nodes_relid;
+	bool		nodes_partitioned;
+	int64		day = -1;
+	bool		exists = false;
+	int			n = 0;
+	int			i;
+
+	if (get_rel_relkind(relid) != RELKIND_PARTITIONED_TABLE) return nrecs;
+
+	qflash_rotated_rel_add(relid);
+
+	relname		= get_rel_name(relid);
+	nspid		= get_rel_namespace(relid);
+	nodes_name	= psprintf("%s%s", relname, QFLASH_NODES_SUFFIX);
+	nodes_relid	= get_relname_relid(nodes_name, nspid);
+	nodes_partitioned = OidIsValid(nodes_relid) && get_rel_relkind(nodes_relid) == RELKIND_PARTITIONED_TABLE;
+
+	for (i = 0; i < nrecs; i++)
+	{
+		if (recs[i].added / USECS_PER_DAY != day)
+		{
+			char		part_name[NAMEDATALEN];
+
+			day = recs[i].added / USECS_PER_DAY;
+			qflash_partition_name(part_name, relname, day);
+			exists = OidIsValid(get_relname_relid(part_name, nspid));
+
+			// Both are rotated together, the nodes rows need theirs too
+			if (exists && nodes_partitioned)
+			{
+				qflash_partition_name(part_name, nodes_name, day);
+				exists = OidIsValid(get_relname_relid(part_name, nspid));
+			}
+		}
+
+		if (exists)
+			recs[n++] = recs[i];
+	}
+
+	if (n < nrecs)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		if (qflash_shared != NULL)
+			pg_atomic_fetch_add_u64(&qflash_shared->partition_skipped, nrecs - n);
+
+		if (qflash_partition_warned == 0 || TimestampDifferenceExceeds(qflash_partition_warned, now, QFLASH_PARTITION_WARN_INTERVAL))
+		{
+			qflash_partition_warned = now;
+			ereport(LOG_SERVER_ONLY,
+					(errmsg("q-flash: skipped %d records of log relation \"%s\" without a partition for their day",
+							nrecs - n, relname),
+					 errdetail("Later ones are reported at most once a minute, qflash_stats() counts them in partition_skipped."),
+					 errhint("Create the partitions with qflash_rotate().")));
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Rotate the partitions of the log relation configured for the server,
+ * qflash.log_namespace_name and qflash.log_relname, and of the partitioned
+ * log relations sessions of this database wrote to. Errors, e.g. a lock
+ * timeout or a missing privilege, are reported as a warning and false is
+ * returned, so that they neither end the worker nor hold up the flushes.
+ */
+bool
+qflash_worker_rotate(void)
+{
+	MemoryContext oldcxt = CurrentMemoryContext;
+	Oid			relids[QFLASH_MAX_ROTATED_RELS + 1];
+	int			nrelids = 0;
+	bool		rotated = true;
+	Oid			nspid;
+	Oid			relid = InvalidOid;
+	int			i;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "q-flash: rotating partitions");
+
+	PG_TRY();
+	{
+		nspid = get_namespace_oid(qflash_log_namespace_name, true);
+		if (OidIsValid(nspid))
+			relid = get_relname_relid(qflash_log_rel_name, nspid);
+
+		if (OidIsValid(relid))
+			relids[nrelids++] = relid;
+
+		LWLockAcquire(qflash_shared->lock, LW_SHARED);
+		for (i = 0; i < qflash_shared->nrotated; i++)
+		{
+			if (qflash_shared->rotated[i].dbid == MyDatabaseId && qflash_shared->rotated[i].relid != relid)
+				relids[nrelids++] = qflash_shared->rotated[i].relid;
+		}
+		LWLockRelease(qflash_shared->lock);
+
+		for (i = 0; i < nrelids; i++)
+		{
+			// Dropped since, or recreated unpartitioned
+			if (!qflash_log_rel_usable(relids[i]) || get_rel_relkind(relids[i]) != RELKIND_PARTITIONED_TABLE)
+			{
+				qflash_rotated_rel_remove(relids[i]);
+				continue;
+			}
+
+			if (!qflash_worker_rotate_rel(relids[i]))
+				rotated = false;
+		}
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		AbortCurrentTransaction();
+		MemoryContextSwitchTo(oldcxt);
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		ereport(WARNING,
+				(errmsg("q-flash: could not rotate partitions"),
+				 errdetail_internal("%s", edata->message)));
+		FreeErrorData(edata);
+		return false;
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	pgstat_report_activity(STATE_IDLE, NULL);
+	return rotated;
+}
+
+/*
+ * Rotate the partitions of one log relation in a subtransaction, so that a
+ * failing one does not hold up the others.
+ */
+bool
+qflash_worker_rotate_rel(Oid relid)
+{
+	MemoryContext cxt = CurrentMemoryContext;
+	ResourceOwner owner = CurrentResourceOwner;
+	bool		rotated = true;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(cxt);
+
+	PG_TRY();
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		qflash_rotate_partitions(relid);
+
+		if (SPI_finish() != SPI_OK_FINISH)
+			elog(ERROR, "SPI_finish failed");
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(cxt);
+		CurrentResourceOwner = owner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(cxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(cxt);
+		CurrentResourceOwner = owner;
+
+		ereport(WARNING,
+				(errmsg("q-flash: could not rotate the partitions of log relation %u", relid),
+				 errdetail_internal("%s", edata->message)));
+		FreeErrorData(edata);
+		rotated = false;
+	}
+	PG_END_TRY();
+
+	return rotated;
+}
+
+/*
+ * Register a partitioned log relation with the flush worker. Sessions may
+ * log into other relations than the server's, their partitions need to be
+ * created ahead as well. Without shared state there is no worker.
+ */
+void
+qflash_rotated_rel_add(Oid relid)
+{
+	static Oid	last_relid = InvalidOid;
+	int			i;
+
+	if (qflash_shared == NULL || relid == last_relid) return;
+
+	LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < qflash_shared->nrotated; i++)
+	{
+		if (qflash_shared->rotated[i].dbid == MyDatabaseId && qflash_shared->rotated[i].relid == relid) break;
+	}
+
+	if (i == qflash_shared->nrotated && i < QFLASH_MAX_ROTATED_RELS)
+	{
+		qflash_shared->rotated[i].dbid	= MyDatabaseId;
+		qflash_shared->rotated[i].relid	= relid;
+		qflash_shared->nrotated++;
+	}
+	LWLockRelease(qflash_shared->lock);
+
+	last_relid = relid;
+}
+
+void
+qflash_rotated_rel_remove(Oid relid)
+{
+	int			i;
+
+	LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < qflash_shared->nrotated; i++)
+	{
+		if (qflash_shared->rotated[i].dbid == MyDatabaseId && qflash_shared->rotated[i].relid == relid)
+		{
+			qflash_shared->rotated[i] = qflash_shared->rotated[--qflash_shared->nrotated];
+			break;
+		}
+	}
+	LWLockRelease(qflash_shared->lock);
+}
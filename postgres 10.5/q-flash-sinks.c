@@ -0,0 +1,2439 @@
+/*
+ * q-flash-sinks.c
+ *		Writers of captured records: the log relation writers, the xact batch,
+ *		the shared ring buffer with its flush worker and the segment files
+ */
+#include "postgres.h"
+#include "q-flash.h"
+
+// Segment file kept open by this backend, file sink
+static int		qflash_file_fd		= -1;
+static uint32	qflash_file_fd_segno = 0;
+static TimestampTz qflash_file_warned = 0;	// last warning about records the file sink dropped
+static TimestampTz qflash_ring_warned = 0;	// last warning about records the ring sink could not take
+
+// Log relation columns filled from a record, matched by name
+static const struct
+{
+	const char *name;
+	Oid			type;			// type of the record value
+} qflash_columns[QFLASH_NCOLS] = {
+	{"added", TIMESTAMPTZOID},
+	{"query", TEXTOID},
+	{"plan", TEXTOID},
+	{"total_time", FLOAT8OID},
+	{"hash", TEXTOID},
+	{"aborted", BOOLOID},
+	{"plan_id", INT8OID},
+	{"rows", INT8OID},
+	{"query_id", INT8OID},
+	{"node_stats", FLOAT8ARRAYOID},
+	{"plan_bin", BYTEAOID}
+};
+
+// Dictionary tables next to a log relation, one row per distinct key
+const QFlashDictInfo qflash_dicts[QFLASH_NDICTS] = {
+	{"_plans", "plan_id", "plan"},
+	{"_queries", "query_id", "query"}
+};
+
+// Columns of the <relname>_nodes table
+static const struct
+{
+	const char *name;
+	Oid			type;			// element type of the array arguments
+} qflash_node_columns[QFLASH_NODE_NCOLS] = {
+	{"log_id", INT8OID},
+	{"added", TIMESTAMPTZOID},
+	{"node_id", INT4OID},
+	{"parent_id", INT4OID},
+	{"node_type", TEXTOID},
+	{"relation", OIDOID},
+	{"index_relation", OIDOID},
+	{"plan_rows", FLOAT8OID},
+	{"actual_rows", FLOAT8OID},
+	{"loops", FLOAT8OID},
+	{"startup_time", FLOAT8OID},
+	{"total_time", FLOAT8OID},
+	{"shared_hit", INT8OID},
+	{"shared_read", INT8OID}
+};
+
+// Dictionary rows this backend knows to exist
+static HTAB *qflash_dict_known = NULL;
+static int		qflash_dict_known_level = 0;	// highest nest_level in qflash_dict_known
+
+// Writer state of the log relations, invalidated by relcache callback
+static HTAB *qflash_log_rels = NULL;
+
+// Records captured by the current transaction, xact sink
+static MemoryContext qflash_batch_cxt	= NULL;
+static QFlashRecord *qflash_batch		= NULL;
+static int		qflash_batch_len		= 0;
+static int		qflash_batch_cap		= 0;
+
+// Records of transactions still running when the flush worker took them
+// from the ring, written once those end
+static MemoryContext qflash_deferred_cxt = NULL;
+static char	   *qflash_deferred		= NULL;
+static uint64	qflash_deferred_len	= 0;
+static bool		qflash_foreign_warned	= false;	// records of other databases were reported
+static int		qflash_flush_failures	= 0;	// failed flushes in a row
+
+// Flush worker signal flags
+static volatile sig_atomic_t got_sighup		= false;
+static volatile sig_atomic_t got_sigterm	= false;
+
+static void qflash_worker_sighup(SIGNAL_ARGS);
+static void qflash_worker_sigterm(SIGNAL_ARGS);
+static void qflash_worker_detach(int code, Datum arg);
+static int qflash_segno_cmp(const void *a, const void *b);
+
+PG_FUNCTION_INFO_V1(qflash_read_segments);
+
+/*
+ * Hand a captured record to the configured sink. The ring sink never blocks:
+ * a full ring drops the record and counts it.
+ */
+void
+qflash_store_record(QFlashRecord *rec)
+{
+	if (qflash_sink == QFLASH_SINK_RING)
+	{
+		if (!qflash_ring_available())
+		{
+			qflash_ring_reject();
+			return;
+		}
+
+		// Nothing to look up for a transaction that wrote nothing yet
+		if (!TransactionIdIsValid(rec->xid))
+			rec->outcome = QFLASH_OUTCOME_UNKNOWN;
+		qflash_ring_append(rec);
+		return;
+	}
+
+	if (qflash_sink == QFLASH_SINK_FILE && qflash_shared != NULL)
+	{
+		// Segments are read without looking the transaction up
+		rec->outcome = QFLASH_OUTCOME_UNKNOWN;
+		qflash_file_append(rec);
+		return;
+	}
+
+	if (qflash_sink == QFLASH_SINK_XACT)
+	{
+		qflash_batch_append(rec);
+		return;
+	}
+
+	log_InRelation(rec);
+}
+
+void
+log_InRelation(QFlashRecord *rec)
+{
+	qflash_write_records(rec, 1);
+}
+
+/*
+ * Write records into their log relations, each run of records for the same
+ * relation in one bulk insert when the heap writer can take it.
+ */
+void
+qflash_write_records(QFlashRecord *recs, int nrecs)
+{
+	bool		spi_connected = false;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			start;
+	int			end;
+	int			nrun;
+	int			i;
+
+	qflash_trace(QFLASH_TRACE_CAPTURE, "q-flash: writing %d records", nrecs);
+
+	// Our own inserts must not be captured again
+	qflash_writing = true;
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+
+	PG_TRY();
+	{
+		for (start = 0; start < nrecs; start = end)
+		{
+			QFlashLogRel *logrel;
+			int64	   *log_ids;
+
+			for (end = start + 1; end < nrecs && recs[end].relid == recs[start].relid
+				&& recs[end].userid == recs[start].userid; end++);
+
+			if (!qflash_log_rel_usable(recs[start].relid))
+				ereport(ERROR,
+						(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+						 errmsg("q-flash log relation %u is not a user table", recs[start].relid)));
+
+			// Records of a day without partition are skipped
+			nrun = qflash_partition_filter(recs + start, end - start);
+			if (nrun == 0) continue;
+
+			// Insert as the role that captured the records, the flush worker
+			// and the commit of another role's transaction must not lend theirs
+			SetUserIdAndSecContext(OidIsValid(recs[start].userid) ? recs[start].userid : save_userid,
+								   save_sec_context | SECURITY_LOCAL_USERID_CHANGE | SECURITY_RESTRICTED_OPERATION);
+
+			// Dictionary rows first, log rows may reference them
+			logrel = get_log_rel(recs[start].relid);
+			if (logrel != NULL && (logrel->cxt != NULL || build_log_layout(logrel)))
+				qflash_write_dicts(logrel, recs + start, nrun, &spi_connected);
+
+			// Zero for rows whose id is unknown
+			log_ids = (int64 *) palloc0(nrun * sizeof(int64));
+
+			if (!qflash_heap_insert_records(recs + start, nrun, log_ids))
+			{
+				qflash_spi_connect(&spi_connected);
+
+				for (i = start; i < start + nrun; i++)
+					qflash_insert_record(&recs[i], &log_ids[i - start]);
+			}
+
+			// Node rows reference the log rows by id
+			logrel = get_log_rel(recs[start].relid);
+			if (logrel != NULL && (logrel->cxt != NULL || build_log_layout(logrel)) && OidIsValid(logrel->nodes_relid))
+			{
+				for (i = start; i < start + nrun; i++)
+				{
+					if (recs[i].nodes == NULL || log_ids[i - start] == 0) continue;
+
+					qflash_spi_connect(&spi_connected);
+					qflash_write_nodes(logrel, &recs[i], log_ids[i - start]);
+				}
+			}
+
+			pfree(log_ids);
+
+			SetUserIdAndSecContext(save_userid, save_sec_context);
+		}
+
+		if (spi_connected && SPI_finish() != SPI_OK_FINISH)
+			elog(ERROR, "SPI_finish failed");
+	}
+	PG_CATCH();
+	{
+		SetUserIdAndSecContext(save_userid, save_sec_context);
+		qflash_writing = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	qflash_writing = false;
+}
+
+/*
+ * Whether records may be written into a relation: an ordinary or partitioned
+ * table created by a user, never a system catalog, whatever the settings say.
+ */
+bool
+qflash_log_rel_usable(Oid relid)
+{
+	Oid			nspid;
+	char		relkind;
+
+	if (relid < FirstNormalObjectId) return false;
+
+	nspid = get_rel_namespace(relid);
+	if (!OidIsValid(nspid) || IsSystemNamespace(nspid) || IsToastNamespace(nspid)) return false;
+
+	relkind = get_rel_relkind(relid);
+	return relkind == RELKIND_RELATION || relkind == RELKIND_PARTITIONED_TABLE;
+}
+
+void
+qflash_spi_connect(bool *spi_connected)
+{
+	if (*spi_connected) return;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	*spi_connected = true;
+}
+
+/*
+ * Key and value a record contributes to a dictionary, false when it has none.
+ */
+bool
+qflash_dict_entry(QFlashRecord *rec, int dict, uint64 *id, const char **value, int *value_len, bool *in_place)
+{
+	switch (dict)
+	{
+		case QFLASH_DICT_PLANS:
+			// Left out by the capture, already in the dictionary, or not text
+			if (rec->plan_len == 0 || rec->plan_binary) return false;
+
+			*id			= rec->plan_id;
+			*value		= rec->plan;
+			*value_len	= rec->plan_len;
+			*in_place	= rec->plan_varlena;
+			break;
+		case QFLASH_DICT_QUERIES:
+			*id			= rec->query_id;
+			*value		= rec->query;
+			*value_len	= rec->query_len;
+			*in_place	= false;
+			break;
+		default:
+			return false;
+	}
+
+	return *id != 0;
+}
+
+/*
+ * Insert the dictionary rows of records that this backend has not written or
+ * seen yet. Rows written concurrently by other backends are skipped by
+ * ON CONFLICT.
+ */
+void
+qflash_write_dicts(QFlashLogRel *logrel, QFlashRecord *recs, int nrecs, bool *spi_connected)
+{
+	int			dict;
+	int			i;
+
+	if (qflash_dict_known == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize		= sizeof(QFlashDictKey);
+		ctl.entrysize	= sizeof(QFlashDictEntry);
+		qflash_dict_known = hash_create("q-flash dictionary rows", 256, &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	for (dict = 0; dict < QFLASH_NDICTS; dict++)
+	{
+		if (!OidIsValid(logrel->dict_relids[dict])) continue;
+
+		for (i = 0; i < nrecs; i++)
+		{
+			QFlashDictKey key;
+			QFlashDictEntry *entry;
+			const char *value;
+			int			value_len;
+			bool		in_place;
+			SPIPlanPtr	spi_plan;
+			Datum		values[2];
+
+			memset(&key, 0, sizeof(key));
+			if (!qflash_dict_entry(&recs[i], dict, &key.id, &value, &value_len, &in_place)) continue;
+			key.relid = logrel->dict_relids[dict];
+
+			if (hash_search(qflash_dict_known, &key, HASH_FIND, NULL) != NULL) continue;
+
+			qflash_spi_connect(spi_connected);
+
+			spi_plan = get_insert_dict_plan(logrel, dict);
+			if (spi_plan == NULL) break;
+
+			values[0] = Int64GetDatum((int64) key.id);
+			values[1] = qflash_varlena_datum(value, value_len, in_place);
+
+			if (SPI_execute_plan(spi_plan, values, NULL, false, 1) < 0)
+				elog(ERROR, "SPI_execute_plan failed for dictionary relation %u", key.relid);
+
+			entry = (QFlashDictEntry *) hash_search(qflash_dict_known, &key, HASH_ENTER, NULL);
+			entry->nest_level = GetCurrentTransactionNestLevel();
+			qflash_dict_known_level = Max(qflash_dict_known_level, entry->nest_level);
+
+			if (dict == QFLASH_DICT_PLANS)
+				qflash_plan_seen_pending(key.relid, key.id);
+		}
+	}
+}
+
+/*
+ * Saved INSERT ... ON CONFLICT DO NOTHING plan for a dictionary of a log
+ * relation. Caller is connected to SPI.
+ */
+SPIPlanPtr
+get_insert_dict_plan(QFlashLogRel *logrel, int dict)
+{
+	Oid			arg_types[2] = {INT8OID, TEXTOID};
+	Oid			dict_relid = logrel->dict_relids[dict];
+	Oid			value_type;
+	char	   *relname;
+	char	   *query_string;
+
+	if (logrel->dict_plans[dict]) return logrel->dict_plans[dict];
+
+	relname = get_rel_name(dict_relid);
+
+	// Dictionary dropped since the layout was built
+	if (relname == NULL) return NULL;
+
+	// Text is not assignable to jsonb or xml
+	value_type = get_atttype(dict_relid, get_attnum(dict_relid, qflash_dicts[dict].value));
+
+	query_string = psprintf("INSERT INTO %s (%s, %s) VALUES ($1, $2%s%s) ON CONFLICT (%s) DO NOTHING",
+		quote_qualified_identifier(get_namespace_name(get_rel_namespace(dict_relid)), relname),
+		qflash_dicts[dict].key, qflash_dicts[dict].value,
+		OidIsValid(value_type) && value_type != TEXTOID ? "::" : "",
+		OidIsValid(value_type) && value_type != TEXTOID ? format_type_be(value_type) : "",
+		qflash_dicts[dict].key);
+
+	logrel->dict_plans[dict] = SPI_prepare(query_string, 2, arg_types);
+
+	if (logrel->dict_plans[dict] == NULL)
+	{
+		elog(ERROR, "SPI_prepare failed for \"%s\"", query_string);
+	}
+
+	if (SPI_keepplan(logrel->dict_plans[dict]) != 0)
+	{
+		elog(ERROR, "SPI_keepplan failed for \"%s\"", query_string);
+	}
+
+	return logrel->dict_plans[dict];
+}
+
+/*
+ * Insert one record into its log relation and return the id of the new row
+ * in log_id, when the relation has one. Caller is connected to SPI.
+ */
+bool
+qflash_insert_record(QFlashRecord *rec, int64 *log_id)
+{
+	QFlashLogRel *logrel;
+	SPIPlanPtr	spi_plan;
+	int			spi_res_state;
+	Datum		values[QFLASH_NCOLS];
+	char		nulls[QFLASH_NCOLS];
+	int			nargs = 0;
+	int			col;
+
+	logrel = get_log_rel(rec->relid);
+	if (logrel == NULL) return false;
+
+	spi_plan = get_insert_log_plan(logrel);
+
+	if (spi_plan == NULL) return false;
+
+	// Arguments in the column order of generate_insert_log_query
+	for (col = 0; col < QFLASH_NCOLS; col++)
+	{
+		bool		isnull;
+
+		if (logrel->atts[col] == InvalidAttrNumber) continue;
+
+		values[nargs]	= qflash_column_datum(logrel, rec, col, &isnull);
+		nulls[nargs]	= isnull ? 'n' : ' ';
+		nargs++;
+	}
+
+	spi_res_state = SPI_execute_plan(spi_plan, values, nulls, false, 1);
+
+	if (spi_res_state <= 0)
+	{
+		elog(ERROR, "SPI_execute_plan failed for log relation %u", rec->relid);
+	}
+
+	// No row comes back when a trigger routed it elsewhere
+	if (spi_res_state == SPI_OK_INSERT_RETURNING && SPI_processed == 1)
+	{
+		bool		isnull;
+		Datum		id = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+		if (!isnull)
+			*log_id = DatumGetInt64(id);
+	}
+
+	return true;
+}
+
+/*
+ * Value of a log column for a record, of type qflash_columns[col].type.
+ */
+Datum
+qflash_column_datum(QFlashLogRel *logrel, QFlashRecord *rec, int col, bool *isnull)
+{
+	*isnull = false;
+
+	switch (col)
+	{
+		case QFLASH_COL_ADDED:
+			return TimestampTzGetDatum(rec->added);
+		case QFLASH_COL_QUERY:
+			// Normalized texts live in the dictionary
+			if (rec->query_id != 0 && OidIsValid(logrel->dict_relids[QFLASH_DICT_QUERIES])) break;
+			return PointerGetDatum(cstring_to_text_with_len(rec->query, rec->query_len));
+		case QFLASH_COL_PLAN:
+			// Deduplicated plans live in the dictionary
+			if (rec->plan_id != 0 && OidIsValid(logrel->dict_relids[QFLASH_DICT_PLANS])) break;
+			if (rec->plan_len == 0 || rec->plan_binary) break;
+			return qflash_varlena_datum(rec->plan, rec->plan_len, rec->plan_varlena);
+		case QFLASH_COL_TOTAL_TIME:
+			return Float8GetDatum(rec->total_time);
+		case QFLASH_COL_HASH:
+			if (rec->hash_len == 0) break;
+			return PointerGetDatum(cstring_to_text_with_len(rec->hash, rec->hash_len));
+		case QFLASH_COL_ABORTED:
+			// Tables of older versions have the column NOT NULL
+			if (rec->outcome == QFLASH_OUTCOME_UNKNOWN && !logrel->aborted_notnull) break;
+			return BoolGetDatum(rec->outcome == QFLASH_OUTCOME_ABORTED);
+		case QFLASH_COL_PLAN_ID:
+			if (rec->plan_id == 0) break;
+			return Int64GetDatum((int64) rec->plan_id);
+		case QFLASH_COL_ROWS:
+			return Int64GetDatum((int64) rec->rows);
+		case QFLASH_COL_QUERY_ID:
+			if (rec->query_id == 0) break;
+			return Int64GetDatum((int64) rec->query_id);
+		case QFLASH_COL_NODE_STATS:
+			if (rec->node_stats == NULL) break;
+			return qflash_node_stats_datum(rec);
+		case QFLASH_COL_PLAN_BIN:
+			if (!rec->plan_binary) break;
+			return qflash_plan_bin_datum(rec);
+	}
+
+	*isnull = true;
+	return (Datum) 0;
+}
+
+/*
+ * BYTEA of the encoded plan of a record.
+ */
+Datum
+qflash_plan_bin_datum(QFlashRecord *rec)
+{
+	return qflash_varlena_datum(rec->plan, rec->plan_len, rec->plan_varlena);
+}
+
+/*
+ * Text or bytea Datum of a record value. Values with a reserved header in
+ * front are used in place, others are copied.
+ */
+Datum
+qflash_varlena_datum(const char *data, int len, bool in_place)
+{
+	struct varlena *result;
+
+	if (in_place)
+		result = (struct varlena *) (data - VARHDRSZ);
+	else
+	{
+		result = (struct varlena *) palloc(VARHDRSZ + len);
+		memcpy(VARDATA(result), data, len);
+	}
+
+	SET_VARSIZE(result, VARHDRSZ + len);
+
+	return PointerGetDatum(result);
+}
+
+/*
+ * DOUBLE PRECISION[] of the node stats of a record.
+ */
+Datum
+qflash_node_stats_datum(QFlashRecord *rec)
+{
+	Datum	   *elems = (Datum *) palloc(rec->nnode_stats * sizeof(Datum));
+	int			i;
+
+	for (i = 0; i < rec->nnode_stats; i++)
+		elems[i] = Float8GetDatum(rec->node_stats[i]);
+
+	return PointerGetDatum(construct_array(elems, rec->nnode_stats, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Insert the plan nodes of a logged record into the nodes relation, all in
+ * one statement. Caller is connected to SPI.
+ */
+void
+qflash_write_nodes(QFlashLogRel *logrel, QFlashRecord *rec, int64 log_id)
+{
+	QFlashPlanDecoder dec;
+	QFlashPlanNodes nodes;
+	SPIPlanPtr	spi_plan;
+	bytea	   *encoded;
+	Datum		values[QFLASH_NODE_NCOLS];
+	Datum	   *elems;
+	bool	   *elem_nulls;
+	int			dims[1];
+	int			lbs[1] = {1};
+	int			col;
+	int			i;
+
+	spi_plan = get_insert_nodes_plan(logrel);
+	if (spi_plan == NULL) return;
+
+	encoded = (bytea *) DatumGetPointer(qflash_varlena_datum(rec->nodes, rec->nodes_len, rec->nodes_varlena));
+
+	memset(&dec, 0, sizeof(dec));
+	memset(&nodes, 0, sizeof(nodes));
+	qflash_plan_decoder_init(&dec, encoded);
+	qflash_plan_collect_nodes(&dec, 0, &nodes);
+
+	values[QFLASH_NODE_COL_LOG_ID]	= Int64GetDatum(log_id);
+	values[QFLASH_NODE_COL_ADDED]	= TimestampTzGetDatum(rec->added);
+
+	elems		= (Datum *) palloc(nodes.len * sizeof(Datum));
+	elem_nulls	= (bool *) palloc(nodes.len * sizeof(bool));
+	dims[0]		= nodes.len;
+
+	for (col = QFLASH_NODE_COL_NODE_ID; col < QFLASH_NODE_NCOLS; col++)
+	{
+		Oid			type = qflash_node_columns[col].type;
+		int16		typlen;
+		bool		typbyval;
+		char		typalign;
+
+		for (i = 0; i < nodes.len; i++)
+			elems[i] = qflash_node_column_datum(&nodes.nodes[i], dec.flags, col, &elem_nulls[i]);
+
+		get_typlenbyvalalign(type, &typlen, &typbyval, &typalign);
+		values[col] = PointerGetDatum(construct_md_array(elems, elem_nulls, 1, dims, lbs, type, typlen, typbyval, typalign));
+	}
+
+	if (SPI_execute_plan(spi_plan, values, NULL, false, 0) < 0)
+		elog(ERROR, "SPI_execute_plan failed for nodes relation %u", logrel->nodes_relid);
+
+	pfree(elems);
+	pfree(elem_nulls);
+	pfree(nodes.nodes);
+	if (!rec->nodes_varlena)
+		pfree(encoded);
+}
+
+/*
+ * Value of a nodes column for a plan node, of type qflash_node_columns[col].type.
+ * Actuals are NULL when the plan was not instrumented for them.
+ */
+Datum
+qflash_node_column_datum(QFlashPlanNode *node, int flags, int col, bool *isnull)
+{
+	*isnull = false;
+
+	switch (col)
+	{
+		case QFLASH_NODE_COL_NODE_ID:
+			return Int32GetDatum(node->id);
+		case QFLASH_NODE_COL_PARENT_ID:
+			if (node->parent_id == 0) break;
+			return Int32GetDatum(node->parent_id);
+		case QFLASH_NODE_COL_NODE_TYPE:
+			return CStringGetTextDatum(node->type);
+		case QFLASH_NODE_COL_RELATION:
+			if (!OidIsValid(node->relid)) break;
+			return ObjectIdGetDatum(node->relid);
+		case QFLASH_NODE_COL_INDEX_RELATION:
+			if (!OidIsValid(node->indexid)) break;
+			return ObjectIdGetDatum(node->indexid);
+		case QFLASH_NODE_COL_PLAN_ROWS:
+			return Float8GetDatum(node->plan_rows);
+		case QFLASH_NODE_COL_ACTUAL_ROWS:
+			if (!(flags & QFLASH_PLAN_ANALYZE)) break;
+			return Float8GetDatum(node->rows);
+		case QFLASH_NODE_COL_LOOPS:
+			if (!(flags & QFLASH_PLAN_ANALYZE)) break;
+			return Float8GetDatum(node->loops);
+		case QFLASH_NODE_COL_STARTUP_TIME:
+			if (!(flags & QFLASH_PLAN_TIMING)) break;
+			return Float8GetDatum(node->startup_time);
+		case QFLASH_NODE_COL_TOTAL_TIME:
+			if (!(flags & QFLASH_PLAN_TIMING)) break;
+			return Float8GetDatum(node->total_time);
+		case QFLASH_NODE_COL_SHARED_HIT:
+			if (!(flags & QFLASH_PLAN_BUFFERS)) break;
+			return Int64GetDatum((int64) node->buffers[0]);
+		case QFLASH_NODE_COL_SHARED_READ:
+			if (!(flags & QFLASH_PLAN_BUFFERS)) break;
+			return Int64GetDatum((int64) node->buffers[1]);
+	}
+
+	*isnull = true;
+	return (Datum) 0;
+}
+
+/*
+ * Saved INSERT ... SELECT FROM unnest plan for the nodes relation of a log
+ * relation. Caller is connected to SPI.
+ */
+SPIPlanPtr
+get_insert_nodes_plan(QFlashLogRel *logrel)
+{
+	StringInfoData query_string;
+	Oid			arg_types[QFLASH_NODE_NCOLS];
+	char	   *relname;
+	int			col;
+
+	if (logrel->nodes_plan) return logrel->nodes_plan;
+
+	relname = get_rel_name(logrel->nodes_relid);
+
+	// Nodes relation dropped since the layout was built
+	if (relname == NULL) return NULL;
+
+	initStringInfo(&query_string);
+	appendStringInfo(&query_string, "INSERT INTO %s (",
+		quote_qualified_identifier(get_namespace_name(get_rel_namespace(logrel->nodes_relid)), relname));
+
+	for (col = 0; col < QFLASH_NODE_NCOLS; col++)
+	{
+		appendStringInfo(&query_string, "%s%s", (col ? ", " : ""), qflash_node_columns[col].name);
+
+		arg_types[col] = (col < QFLASH_NODE_COL_NODE_ID)
+			? qflash_node_columns[col].type
+			: get_array_type(qflash_node_columns[col].type);
+	}
+
+	appendStringInfoString(&query_string, ") SELECT $1, $2, * FROM unnest(");
+	for (col = QFLASH_NODE_COL_NODE_ID; col < QFLASH_NODE_NCOLS; col++)
+		appendStringInfo(&query_string, "%s$%d", (col > QFLASH_NODE_COL_NODE_ID ? ", " : ""), col + 1);
+	appendStringInfoChar(&query_string, ')');
+
+	logrel->nodes_plan = SPI_prepare(query_string.data, QFLASH_NODE_NCOLS, arg_types);
+
+	if (logrel->nodes_plan == NULL)
+	{
+		elog(ERROR, "SPI_prepare failed for \"%s\"", query_string.data);
+	}
+
+	if (SPI_keepplan(logrel->nodes_plan) != 0)
+	{
+		elog(ERROR, "SPI_keepplan failed for \"%s\"", query_string.data);
+	}
+
+	return logrel->nodes_plan;
+}
+
+/*
+ * Form the log tuples and insert them straight into the heap with
+ * heap_multi_insert, then into the indexes. Skips parse, plan and executor,
+ * so our own hooks are never re-entered. All records go to the same relation,
+ * the ids of the new rows are returned in log_ids. Returns false when the spi
+ * writer has to be used instead.
+ */
+bool
+qflash_heap_insert_records(QFlashRecord *recs, int nrecs, int64 *log_ids)
+{
+	QFlashLogRel *logrel;
+	Oid			relid = recs[0].relid;
+	Relation	rel;
+	TupleDesc	tupdesc;
+	AclResult	aclresult;
+	EState	   *estate;
+	ExprContext *econtext;
+	ResultRelInfo *resultRelInfo;
+	TupleTableSlot *slot;
+	BulkInsertState bistate;
+	HeapTuple  *tuples;
+	List	   *defaults = NIL;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+	int			i;
+
+	// Read-only transactions get the usual error from the spi writer
+	if (qflash_writer != QFLASH_WRITER_HEAP || XactReadOnly) return false;
+
+	logrel = get_log_rel(relid);
+	if (logrel == NULL) return true;	// log relation dropped since capture
+
+	if (logrel->cxt == NULL && !build_log_layout(logrel)) return true;
+	if (!logrel->heap_ok) return false;
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_INSERT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, get_rel_name(relid));
+
+	rel = heap_open(relid, RowExclusiveLock);
+	tupdesc = RelationGetDescr(rel);
+
+	estate = CreateExecutorState();
+	econtext = GetPerTupleExprContext(estate);
+
+	// Defaults of the other columns, e.g. the BIGSERIAL key
+	oldcxt = MemoryContextSwitchTo(estate->es_query_cxt);
+	foreach(lc, logrel->defaults)
+	{
+		QFlashDefault *def = (QFlashDefault *) lfirst(lc);
+
+		defaults = lappend(defaults, ExecInitExpr(def->expr, NULL));
+	}
+	MemoryContextSwitchTo(oldcxt);
+
+	resultRelInfo = makeNode(ResultRelInfo);
+	InitResultRelInfo(resultRelInfo, rel, 1, NULL, 0);
+	estate->es_result_relations			= resultRelInfo;
+	estate->es_num_result_relations		= 1;
+	estate->es_result_relation_info		= resultRelInfo;
+
+	slot = ExecInitExtraTupleSlot(estate);
+	ExecSetSlotDescriptor(slot, tupdesc);
+
+	tuples = (HeapTuple *) palloc(nrecs * sizeof(HeapTuple));
+	for (i = 0; i < nrecs; i++)
+	{
+		tuples[i] = qflash_form_tuple(logrel, tupdesc, &recs[i], defaults, econtext);
+		ResetExprContext(econtext);
+
+		// NOT NULL and CHECK constraints, as the INSERT of the spi writer
+		if (tupdesc->constr != NULL)
+		{
+			ExecStoreTuple(tuples[i], slot, InvalidBuffer, false);
+			ExecConstraints(resultRelInfo, slot, estate);
+			ResetExprContext(econtext);
+		}
+
+		if (logrel->id_attnum != InvalidAttrNumber)
+		{
+			bool		isnull;
+			Datum		id = heap_getattr(tuples[i], logrel->id_attnum, tupdesc, &isnull);
+
+			if (!isnull)
+				log_ids[i] = DatumGetInt64(id);
+		}
+	}
+
+	ExecOpenIndices(resultRelInfo, false);
+
+	bistate = GetBulkInsertState();
+	heap_multi_insert(rel, tuples, nrecs, GetCurrentCommandId(true), 0, bistate);
+	FreeBulkInsertState(bistate);
+
+	if (resultRelInfo->ri_NumIndices > 0)
+	{
+		for (i = 0; i < nrecs; i++)
+		{
+			ExecStoreTuple(tuples[i], slot, InvalidBuffer, false);
+			list_free(ExecInsertIndexTuples(slot, &(tuples[i]->t_self), estate, false, NULL, NIL));
+			ResetExprContext(econtext);
+		}
+	}
+
+	ExecCloseIndices(resultRelInfo);
+	ExecResetTupleTable(estate->es_tupleTable, false);
+	FreeExecutorState(estate);
+
+	for (i = 0; i < nrecs; i++)
+		heap_freetuple(tuples[i]);
+	pfree(tuples);
+
+	heap_close(rel, NoLock);
+
+	return true;
+}
+
+/*
+ * Log tuple of one record. defaults holds the ExprStates of logrel->defaults.
+ */
+HeapTuple
+qflash_form_tuple(QFlashLogRel *logrel, TupleDesc tupdesc, QFlashRecord *rec, List *defaults, ExprContext *econtext)
+{
+	HeapTuple	tuple;
+	Datum	   *values;
+	bool	   *nulls;
+	ListCell   *lc_def;
+	ListCell   *lc_state;
+	int			col;
+
+	values = (Datum *) palloc(tupdesc->natts * sizeof(Datum));
+	nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+	memset(nulls, true, tupdesc->natts * sizeof(bool));
+
+	forboth(lc_def, logrel->defaults, lc_state, defaults)
+	{
+		QFlashDefault *def = (QFlashDefault *) lfirst(lc_def);
+
+		values[def->attnum - 1] = ExecEvalExprSwitchContext((ExprState *) lfirst(lc_state), econtext, &nulls[def->attnum - 1]);
+	}
+
+	for (col = 0; col < QFLASH_NCOLS; col++)
+	{
+		AttrNumber	attnum = logrel->atts[col];
+
+		if (attnum == InvalidAttrNumber) continue;
+
+		values[attnum - 1] = qflash_column_datum(logrel, rec, col, &nulls[attnum - 1]);
+
+		if (col == QFLASH_COL_ADDED && logrel->added_type == TIMETZOID)
+			values[attnum - 1] = DirectFunctionCall1(timestamptz_timetz, values[attnum - 1]);
+		else if (col == QFLASH_COL_ADDED && logrel->added_type == TIMESTAMPOID)
+			values[attnum - 1] = DirectFunctionCall1(timestamptz_timestamp, values[attnum - 1]);
+		else if (col == QFLASH_COL_PLAN && logrel->plan_type == JSONBOID && !nulls[attnum - 1])
+			values[attnum - 1] = DirectFunctionCall1(jsonb_in, CStringGetDatum(pnstrdup(rec->plan, rec->plan_len)));
+	}
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
+
+	pfree(values);
+	pfree(nulls);
+
+	return tuple;
+}
+
+/*
+ * Terminated copy of a text or binary value, after VARHDRSZ reserved bytes
+ * so it can be used as a varlena in place.
+ */
+char *
+qflash_copy_bytes(const char *data, int len)
+{
+	char	   *copy = (char *) palloc(VARHDRSZ + len + 1) + VARHDRSZ;
+
+	memcpy(copy, data, len);
+	copy[len] = '\0';
+
+	return copy;
+}
+
+/*
+ * Keep a copy of the record until the transaction commits, xact sink.
+ */
+void
+qflash_batch_append(QFlashRecord *rec)
+{
+	MemoryContext oldcxt;
+	QFlashRecord *copy;
+
+	if (qflash_batch_cxt == NULL)
+		qflash_batch_cxt = AllocSetContextCreate(TopMemoryContext, "q-flash batch", ALLOCSET_DEFAULT_SIZES);
+
+	oldcxt = MemoryContextSwitchTo(qflash_batch_cxt);
+
+	if (qflash_batch_len == qflash_batch_cap)
+	{
+		qflash_batch_cap = qflash_batch_cap ? qflash_batch_cap * 2 : 16;
+		qflash_batch = qflash_batch
+			? repalloc(qflash_batch, qflash_batch_cap * sizeof(QFlashRecord))
+			: palloc(qflash_batch_cap * sizeof(QFlashRecord));
+	}
+
+	copy = &qflash_batch[qflash_batch_len++];
+	*copy = *rec;
+	copy->query	= pnstrdup(rec->query, rec->query_len);
+	copy->plan	= qflash_copy_bytes(rec->plan, rec->plan_len);
+	copy->plan_varlena = true;
+	copy->hash	= pnstrdup(rec->hash, rec->hash_len);
+	if (rec->node_stats != NULL)
+	{
+		double	   *node_stats = palloc(rec->nnode_stats * sizeof(double));
+
+		memcpy(node_stats, rec->node_stats, rec->nnode_stats * sizeof(double));
+		copy->node_stats = node_stats;
+	}
+	if (rec->nodes != NULL)
+	{
+		copy->nodes = (rec->nodes == rec->plan) ? copy->plan : qflash_copy_bytes(rec->nodes, rec->nodes_len);
+		copy->nodes_varlena = true;
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	if (qflash_batch_len >= qflash_xact_batch_size)
+		qflash_batch_flush(false);
+}
+
+void
+qflash_batch_flush(bool committing)
+{
+	int			i;
+
+	if (qflash_batch_len == 0) return;
+
+	// Statements of subtransactions rolled back since
+	for (i = 0; i < qflash_batch_len; i++)
+	{
+		if (TransactionIdIsValid(qflash_batch[i].xid) && TransactionIdDidAbort(qflash_batch[i].xid))
+			qflash_batch[i].outcome = QFLASH_OUTCOME_ABORTED;
+	}
+
+	qflash_batch_write(committing);
+	qflash_batch_reset();
+}
+
+/*
+ * Bulk insert of the batch in a subtransaction: a log table that cannot be
+ * written must not fail the commit of the captured transaction. The records
+ * are then handed to the flush worker, which resolves how the transaction
+ * ended; without a usable ring they are dropped and counted. committing
+ * tells that the transaction is about to commit, not that the batch is full.
+ */
+void
+qflash_batch_write(bool committing)
+{
+	MemoryContext cxt = CurrentMemoryContext;
+	ResourceOwner owner = CurrentResourceOwner;
+	int			i;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(cxt);
+
+	PG_TRY();
+	{
+		qflash_write_records(qflash_batch, qflash_batch_len);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(cxt);
+		CurrentResourceOwner = owner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(cxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(cxt);
+		CurrentResourceOwner = owner;
+
+		if (qflash_ring_available())
+		{
+			for (i = 0; i < qflash_batch_len; i++)
+			{
+				// Statements before the first write are resolved with the
+				// transaction, one that wrote nothing only ends well at commit
+				if (!TransactionIdIsValid(qflash_batch[i].xid))
+					qflash_batch[i].xid = GetTopTransactionIdIfAny();
+				if (!TransactionIdIsValid(qflash_batch[i].xid) && !committing
+					&& qflash_batch[i].outcome == QFLASH_OUTCOME_COMMITTED)
+					qflash_batch[i].outcome = QFLASH_OUTCOME_UNKNOWN;
+				qflash_ring_append(&qflash_batch[i]);
+			}
+
+			ereport(WARNING,
+					(errmsg("q-flash: handed %d records that could not be written to the flush worker", qflash_batch_len),
+					 errdetail_internal("%s", edata->message)));
+		}
+		else
+		{
+			if (qflash_shared != NULL)
+				pg_atomic_fetch_add_u64(&qflash_shared->xact_dropped, qflash_batch_len);
+
+			ereport(WARNING,
+					(errmsg("q-flash: dropped %d records that could not be written", qflash_batch_len),
+					 errdetail_internal("%s", edata->message)));
+		}
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
+void
+qflash_batch_reset(void)
+{
+	if (qflash_batch_cxt)
+		MemoryContextReset(qflash_batch_cxt);
+
+	qflash_batch		= NULL;
+	qflash_batch_len	= 0;
+	qflash_batch_cap	= 0;
+}
+
+/*
+ * Records of a rolled back transaction are the ones most worth keeping:
+ * hand them to the flush worker, which writes them in its own transaction.
+ * The batch insert never aborts the transaction, see qflash_batch_write.
+ * Runs during abort, so nothing here may throw; without a usable ring they
+ * are lost.
+ */
+void
+qflash_batch_handoff(void)
+{
+	int			i;
+
+	if (qflash_batch_len == 0 || !qflash_ring_available()) return;
+
+	for (i = 0; i < qflash_batch_len; i++)
+	{
+		qflash_batch[i].outcome	= QFLASH_OUTCOME_ABORTED;
+		qflash_batch[i].xid		= InvalidTransactionId;
+		qflash_ring_append(&qflash_batch[i]);
+	}
+}
+
+/*
+ * The xact sink writes its records right before commit, so a transaction
+ * running many statements pays for one bulk insert.
+ */
+void
+qflash_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			qflash_batch_flush(true);
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			qflash_batch_flush(false);
+			break;
+		case XACT_EVENT_COMMIT:
+			qflash_plans_publish();
+			break;
+		case XACT_EVENT_PREPARE:
+			// Not known to commit
+			qflash_npending_plans = 0;
+			break;
+		case XACT_EVENT_ABORT:
+			qflash_profile_stop();
+			qflash_batch_handoff();
+			qflash_batch_reset();
+			qflash_npending_plans = 0;
+
+			// Dictionary rows inserted by this transaction are gone
+			if (qflash_dict_known)
+			{
+				hash_destroy(qflash_dict_known);
+				qflash_dict_known = NULL;
+			}
+			qflash_dict_known_level = 0;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Plan texts and dictionary rows inserted by a subtransaction belong to its
+ * parent once it commits, and are gone when it rolls back.
+ */
+void
+qflash_subxact_callback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg)
+{
+	int			nest_level = GetCurrentTransactionNestLevel();
+	int			i;
+	int			n;
+
+	switch (event)
+	{
+		case SUBXACT_EVENT_COMMIT_SUB:
+			for (i = 0; i < qflash_npending_plans; i++)
+			{
+				if (qflash_pending_plans[i].nest_level >= nest_level)
+					qflash_pending_plans[i].nest_level = nest_level - 1;
+			}
+			qflash_dict_known_release(nest_level, false);
+			break;
+		case SUBXACT_EVENT_ABORT_SUB:
+			for (i = n = 0; i < qflash_npending_plans; i++)
+			{
+				if (qflash_pending_plans[i].nest_level < nest_level)
+					qflash_pending_plans[n++] = qflash_pending_plans[i];
+			}
+			qflash_npending_plans = n;
+
+			qflash_dict_known_release(nest_level, true);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Hand the dictionary rows of the subtransaction at nest_level to its parent,
+ * or forget them when it rolled back. Most subtransactions insert none, they
+ * skip the scan.
+ */
+void
+qflash_dict_known_release(int nest_level, bool aborted)
+{
+	HASH_SEQ_STATUS status;
+	QFlashDictEntry *entry;
+
+	if (qflash_dict_known == NULL || qflash_dict_known_level < nest_level) return;
+
+	hash_seq_init(&status, qflash_dict_known);
+	while ((entry = (QFlashDictEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->nest_level < nest_level) continue;
+
+		if (aborted)
+			hash_search(qflash_dict_known, &entry->key, HASH_REMOVE, NULL);
+		else
+			entry->nest_level = nest_level - 1;
+	}
+
+	qflash_dict_known_level = nest_level - 1;
+}
+
+/*
+ * Forget the rows of dictionary relid this backend wrote, InvalidOid those of
+ * all dictionaries: the table was truncated, dropped or had rows deleted, and
+ * the rows have to be inserted again.
+ */
+void
+qflash_dict_known_forget(Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	QFlashDictEntry *entry;
+
+	if (qflash_dict_known == NULL) return;
+
+	hash_seq_init(&status, qflash_dict_known);
+	while ((entry = (QFlashDictEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (relid == InvalidOid || entry->key.relid == relid)
+			hash_search(qflash_dict_known, &entry->key, HASH_REMOVE, NULL);
+	}
+}
+
+/*
+ * Format of the plans of a log relation: json for a jsonb plan column,
+ * text instead of binary without a plan_bin column, qflash.log_format
+ * otherwise.
+ */
+int
+qflash_plan_format(Oid relid)
+{
+	QFlashLogRel *logrel = get_log_rel(relid);
+
+	if (logrel == NULL || (logrel->cxt == NULL && !build_log_layout(logrel)))
+		return qflash_log_format == QFLASH_FORMAT_BINARY ? EXPLAIN_FORMAT_TEXT : qflash_log_format;
+
+	if (logrel->plan_type == JSONBOID)
+		return EXPLAIN_FORMAT_JSON;
+
+	// Encoded plans need somewhere to go
+	if (qflash_log_format == QFLASH_FORMAT_BINARY && logrel->atts[QFLASH_COL_PLAN_BIN] == InvalidAttrNumber)
+		return EXPLAIN_FORMAT_TEXT;
+
+	return qflash_log_format;
+}
+
+/*
+ * Writer state of a log relation, or NULL when the relation is gone.
+ * Stale entries are reset here, outside of invalidation processing.
+ */
+QFlashLogRel*
+get_log_rel(Oid relid)
+{
+	QFlashLogRel *entry;
+	bool		found;
+
+	if (qflash_log_rels == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize		= sizeof(Oid);
+		ctl.entrysize	= sizeof(QFlashLogRel);
+		qflash_log_rels = hash_create("q-flash log relations", 8, &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	entry = (QFlashLogRel *) hash_search(qflash_log_rels, &relid, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->valid	= false;
+		entry->plan		= NULL;
+		entry->cxt		= NULL;
+		memset(entry->dict_relids, 0, sizeof(entry->dict_relids));
+		memset(entry->dict_plans, 0, sizeof(entry->dict_plans));
+		entry->nodes_relid	= InvalidOid;
+		entry->nodes_plan	= NULL;
+	}
+
+	if (!entry->valid)
+	{
+		int			dict;
+
+		if (entry->plan)
+			SPI_freeplan(entry->plan);
+		if (entry->cxt)
+			MemoryContextDelete(entry->cxt);
+		for (dict = 0; dict < QFLASH_NDICTS; dict++)
+		{
+			if (entry->dict_plans[dict])
+				SPI_freeplan(entry->dict_plans[dict]);
+			entry->dict_plans[dict]		= NULL;
+			entry->dict_relids[dict]	= InvalidOid;
+		}
+		if (entry->nodes_plan)
+			SPI_freeplan(entry->nodes_plan);
+
+		entry->nodes_plan	= NULL;
+		entry->nodes_relid	= InvalidOid;
+		entry->plan		= NULL;
+		entry->cxt		= NULL;
+		entry->valid	= true;
+	}
+
+	if (get_rel_name(relid) == NULL) return NULL;
+
+	return entry;
+}
+
+/*
+ * Saved INSERT plan for a log relation, prepared once per backend and
+ * re-prepared only after a relcache invalidation of that relation.
+ * Caller is connected to SPI.
+ */
+SPIPlanPtr
+get_insert_log_plan(QFlashLogRel *logrel)
+{
+	const char* query_string;
+	Oid			arg_types[QFLASH_NCOLS];
+	int			nargs = 0;
+	int			col;
+
+	if (logrel->plan) return logrel->plan;
+
+	if (logrel->cxt == NULL && !build_log_layout(logrel)) return NULL;
+
+	for (col = 0; col < QFLASH_NCOLS; col++)
+	{
+		if (logrel->atts[col] != InvalidAttrNumber)
+			arg_types[nargs++] = qflash_columns[col].type;
+	}
+
+	query_string = generate_insert_log_query(logrel);
+
+	if (!query_string) return NULL;
+
+	logrel->plan = SPI_prepare(query_string, nargs, arg_types);
+
+	if (logrel->plan == NULL)
+	{
+		elog(ERROR, "SPI_prepare failed for \"%s\"", query_string);
+	}
+
+	if (SPI_keepplan(logrel->plan) != 0)
+	{
+		elog(ERROR, "SPI_keepplan failed for \"%s\"", query_string);
+	}
+
+	return logrel->plan;
+}
+
+/*
+ * Map the log columns by name and collect defaults of the remaining ones.
+ * Missing columns are simply not written. heap_ok stays false for anything
+ * the heap writer cannot fill exactly, such records go through the spi
+ * writer and its type coercions.
+ */
+bool
+build_log_layout(QFlashLogRel *logrel)
+{
+	Relation	rel;
+	TupleDesc	tupdesc;
+	MemoryContext oldcxt;
+	int			col;
+	int			dict;
+	int			i;
+
+	rel = try_relation_open(logrel->relid, AccessShareLock);
+	if (rel == NULL) return false;
+
+	logrel->cxt = AllocSetContextCreate(CacheMemoryContext, "q-flash log relation", ALLOCSET_SMALL_SIZES);
+	oldcxt = MemoryContextSwitchTo(logrel->cxt);
+
+	tupdesc = RelationGetDescr(rel);
+
+	// Triggers, e.g. routing into inheritance partitions, and the tuple routing
+	// of a partitioned table need the executor, row level security policies
+	// the rewriter
+	logrel->heap_ok		= (rel->rd_rel->relkind == RELKIND_RELATION && !rel->rd_rel->relhastriggers
+		&& !rel->rd_rel->relrowsecurity);
+	logrel->added_type	= InvalidOid;
+	logrel->plan_type	= InvalidOid;
+	logrel->defaults	= NIL;
+	logrel->id_attnum	= InvalidAttrNumber;
+	logrel->aborted_notnull = false;
+	for (col = 0; col < QFLASH_NCOLS; col++)
+		logrel->atts[col] = InvalidAttrNumber;
+
+	for (dict = 0; dict < QFLASH_NDICTS; dict++)
+	{
+		char	   *dict_name = psprintf("%s%s", RelationGetRelationName(rel), qflash_dicts[dict].suffix);
+
+		logrel->dict_relids[dict] = get_relname_relid(dict_name, RelationGetNamespace(rel));
+	}
+
+	logrel->nodes_relid = get_relname_relid(psprintf("%s%s", RelationGetRelationName(rel), QFLASH_NODES_SUFFIX),
+		RelationGetNamespace(rel));
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = tupdesc->attrs[i];
+		const char *name = NameStr(att->attname);
+
+		if (att->attisdropped) continue;
+
+		for (col = 0; col < QFLASH_NCOLS; col++)
+		{
+			if (strcmp(name, qflash_columns[col].name) == 0) break;
+		}
+
+		if (col == QFLASH_NCOLS)
+		{
+			Node	   *expr = build_column_default(rel, att->attnum);
+
+			// Key of the nodes rows, usually the BIGSERIAL of qflash_init
+			if (strcmp(name, "id") == 0 && att->atttypid == INT8OID)
+				logrel->id_attnum = att->attnum;
+
+			if (expr != NULL)
+			{
+				QFlashDefault *def = palloc(sizeof(QFlashDefault));
+
+				def->attnum	= att->attnum;
+				def->expr	= expression_planner((Expr *) expr);
+				logrel->defaults = lappend(logrel->defaults, def);
+			}
+			continue;
+		}
+
+		logrel->atts[col] = att->attnum;
+
+		if (col == QFLASH_COL_ADDED)
+		{
+			logrel->added_type = att->atttypid;
+			if (att->atttypid != TIMESTAMPTZOID && att->atttypid != TIMESTAMPOID && att->atttypid != TIMETZOID)
+				logrel->heap_ok = false;
+		}
+		else if (col == QFLASH_COL_PLAN)
+		{
+			logrel->plan_type = att->atttypid;
+			if (att->atttypid != TEXTOID && att->atttypid != JSONBOID)
+				logrel->heap_ok = false;
+		}
+		else if (att->atttypid != qflash_columns[col].type)
+			logrel->heap_ok = false;
+
+		if (col == QFLASH_COL_ABORTED)
+			logrel->aborted_notnull = att->attnotnull;
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	relation_close(rel, AccessShareLock);
+
+	return true;
+}
+
+/*
+ * Relcache invalidation: the log relation may be renamed, dropped or altered,
+ * so its writer state is rebuilt on next use.
+ */
+void
+qflash_relcache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	QFlashLogRel *entry;
+	bool		forget_dict = relid == InvalidOid;
+
+	qflash_seen_plans_forget(relid);
+
+	// Dropped, renamed or moved to another schema
+	if (relid == InvalidOid || relid == qflash_log_rel_oid
+		|| qflash_oid_set_contains(&qflash_excluded_rels, relid)
+		|| qflash_oid_set_contains(&qflash_included_rels, relid))
+		qflash_log_rel_valid = false;
+
+	if (qflash_log_rels == NULL)
+	{
+		qflash_dict_known_forget(relid);
+		return;
+	}
+
+	hash_seq_init(&status, qflash_log_rels);
+	while ((entry = (QFlashLogRel *) hash_seq_search(&status)) != NULL)
+	{
+		int			dict;
+
+		if (relid == InvalidOid || entry->relid == relid)
+			entry->valid = false;
+
+		for (dict = 0; dict < QFLASH_NDICTS; dict++)
+		{
+			if (entry->dict_relids[dict] == relid)
+			{
+				entry->valid = false;
+				forget_dict = true;
+			}
+		}
+
+		if (entry->nodes_relid == relid)
+			entry->valid = false;
+	}
+
+	// Rows this backend wrote to a truncated or dropped dictionary are gone
+	if (forget_dict)
+		qflash_dict_known_forget(relid);
+}
+
+/*
+ * A relation got the name of a missing log or listed relation, or a schema
+ * changed. Existing relations are covered by the relcache callback.
+ */
+void
+qflash_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (cacheid == NAMESPACEOID || !OidIsValid(qflash_log_rel_oid) || !qflash_relation_sets_complete)
+		qflash_log_rel_valid = false;
+}
+
+char*
+generate_insert_log_query(QFlashLogRel *logrel)
+{
+	StringInfoData insert_log_query;
+	char	   *relname = get_rel_name(logrel->relid);
+	int			nargs = 0;
+	int			col;
+
+	// Log relation dropped since capture
+	if (relname == NULL) return NULL;
+
+	initStringInfo(&insert_log_query);
+	appendStringInfo(&insert_log_query, "INSERT INTO %s (",
+		quote_qualified_identifier(get_namespace_name(get_rel_namespace(logrel->relid)), relname));
+
+	for (col = 0; col < QFLASH_NCOLS; col++)
+	{
+		if (logrel->atts[col] == InvalidAttrNumber) continue;
+
+		appendStringInfo(&insert_log_query, "%s%s", (nargs++ ? ", " : ""), qflash_columns[col].name);
+	}
+
+	appendStringInfoString(&insert_log_query, ") VALUES (");
+	nargs = 0;
+	for (col = 0; col < QFLASH_NCOLS; col++)
+	{
+		if (logrel->atts[col] == InvalidAttrNumber) continue;
+
+		appendStringInfo(&insert_log_query, "%s$%d", (nargs ? ", " : ""), nargs + 1);
+		nargs++;
+
+		// Text is not assignable to jsonb or xml
+		if (col == QFLASH_COL_PLAN && logrel->plan_type != TEXTOID)
+			appendStringInfo(&insert_log_query, "::%s", format_type_be(logrel->plan_type));
+	}
+	appendStringInfoChar(&insert_log_query, ')');
+
+	// The nodes rows need the id of the log row
+	if (logrel->id_attnum != InvalidAttrNumber && OidIsValid(logrel->nodes_relid))
+		appendStringInfoString(&insert_log_query, " RETURNING id");
+
+	return insert_log_query.data;
+}
+
+/*
+ * The ring sink is usable when the flush worker is attached to our database.
+ */
+bool
+qflash_ring_available(void)
+{
+	return qflash_shared != NULL && qflash_shared->worker_dbid == MyDatabaseId;
+}
+
+/*
+ * Count a record the ring sink cannot take in this backend and warn about
+ * it, at most once per QFLASH_FILE_WARN_INTERVAL. The sink is not switched
+ * behind the user's back.
+ */
+void
+qflash_ring_reject(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (qflash_shared != NULL)
+	{
+		LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+		qflash_shared->dropped++;
+		LWLockRelease(qflash_shared->lock);
+	}
+
+	if (qflash_ring_warned != 0 && !TimestampDifferenceExceeds(qflash_ring_warned, now, QFLASH_FILE_WARN_INTERVAL))
+		return;
+	qflash_ring_warned = now;
+
+	if (qflash_shared == NULL)
+		ereport(WARNING,
+				(errmsg("q-flash: dropped a captured plan, the ring sink needs the module in shared_preload_libraries")));
+	else
+		ereport(WARNING,
+				(errmsg("q-flash: dropped a captured plan, the ring sink is not available in this database"),
+				 errdetail("The flush worker writes into database \"%s\" and may not be running.", qflash_database),
+				 errhint("Use another qflash.sink in this database, qflash_stats() counts the records in ring_dropped.")));
+}
+
+void
+qflash_ring_copy_in(uint64 pos, const void *src, Size len)
+{
+	Size		offset	= pos % qflash_shared->ring_size;
+	Size		first	= Min(len, qflash_shared->ring_size - offset);
+
+	memcpy(qflash_shared->ring + offset, src, first);
+	if (first < len)
+		memcpy(qflash_shared->ring, (const char *) src + first, len - first);
+}
+
+void
+qflash_ring_copy_out(uint64 pos, void *dst, Size len)
+{
+	Size		offset	= pos % qflash_shared->ring_size;
+	Size		first	= Min(len, qflash_shared->ring_size - offset);
+
+	memcpy(dst, qflash_shared->ring + offset, first);
+	if (first < len)
+		memcpy((char *) dst + first, qflash_shared->ring, len - first);
+}
+
+/*
+ * Magic of the record at a ring position. Records start MAXALIGN'ed and the
+ * ring size is a multiple of that, so the magic never wraps around.
+ */
+static inline volatile uint32 *
+qflash_ring_magic(uint64 pos)
+{
+	return (volatile uint32 *) (qflash_shared->ring + pos % qflash_shared->ring_size);
+}
+
+/*
+ * Append a record to the shared ring and wake up the flush worker.
+ * Returns false when the record was dropped.
+ *
+ * Only the space is reserved under the lock, with a zero magic marking the
+ * record as not yet written. The copy happens outside of it and the magic is
+ * set last; the flush worker stops at the first record without it. Nothing
+ * between the reservation and the magic can fail.
+ */
+bool
+qflash_ring_append(QFlashRecord *rec)
+{
+	QFlashRecordHeader hdr;
+	uint64		start;
+	uint64		pos;
+	Latch	   *latch;
+
+	qflash_record_header(rec, &hdr);
+	hdr.magic = 0;
+
+	LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+
+	if (qflash_shared->ring_size - (qflash_shared->head - qflash_shared->tail) < hdr.len)
+	{
+		qflash_shared->dropped++;
+		LWLockRelease(qflash_shared->lock);
+		return false;
+	}
+
+	start = qflash_shared->head;
+	qflash_shared->head += hdr.len;
+	*qflash_ring_magic(start) = 0;
+	latch = qflash_shared->worker_latch;
+
+	LWLockRelease(qflash_shared->lock);
+
+	pos = start;
+	qflash_ring_copy_in(pos, &hdr, sizeof(hdr));
+	pos += sizeof(hdr);
+	qflash_ring_copy_in(pos, rec->node_stats, hdr.nnode_stats * sizeof(double));
+	pos += hdr.nnode_stats * sizeof(double);
+	qflash_ring_copy_in(pos, rec->query, hdr.query_len);
+	pos += hdr.query_len;
+	qflash_ring_copy_in(pos, rec->plan, hdr.plan_len);
+	pos += hdr.plan_len;
+	qflash_ring_copy_in(pos, rec->hash, hdr.hash_len);
+	pos += hdr.hash_len;
+	qflash_ring_copy_in(pos, rec->nodes, hdr.nodes_len);
+
+	pg_write_barrier();
+	*qflash_ring_magic(start) = QFLASH_RECORD_MAGIC;
+
+	if (latch) SetLatch(latch);
+
+	return true;
+}
+
+/*
+ * Serialized form shared by the ring and the segment files.
+ */
+void
+qflash_record_header(QFlashRecord *rec, QFlashRecordHeader *hdr)
+{
+	memset(hdr, 0, sizeof(QFlashRecordHeader));
+	hdr->magic		= QFLASH_RECORD_MAGIC;
+	hdr->dbid		= MyDatabaseId;
+	hdr->relid		= rec->relid;
+	hdr->userid		= rec->userid;
+	hdr->added		= rec->added;
+	hdr->total_time	= rec->total_time;
+	hdr->query_len	= rec->query_len;
+	hdr->plan_len	= rec->plan_len;
+	hdr->hash_len	= rec->hash_len;
+	hdr->nnode_stats = rec->nnode_stats;
+	hdr->plan_binary = rec->plan_binary;
+	hdr->nodes_in_plan = (rec->nodes != NULL && rec->nodes == rec->plan);
+	hdr->nodes_len	= (rec->nodes != NULL && !hdr->nodes_in_plan) ? rec->nodes_len : 0;
+	hdr->outcome	= (uint8) rec->outcome;
+	hdr->xid		= rec->xid;
+	hdr->plan_id	= rec->plan_id;
+	hdr->rows		= rec->rows;
+	hdr->query_id	= rec->query_id;
+	hdr->len		= MAXALIGN(sizeof(QFlashRecordHeader) + hdr->nnode_stats * sizeof(double)
+		+ hdr->query_len + hdr->plan_len + hdr->hash_len + hdr->nodes_len);
+}
+
+/*
+ * Record pointing into the payload that follows a serialized header. The
+ * payload starts MAXALIGN'ed, so the node stats can be used in place.
+ */
+void
+qflash_record_decode(QFlashRecordHeader *hdr, const char *data, QFlashRecord *rec)
+{
+	rec->node_stats	= hdr->nnode_stats > 0 ? (const double *) data : NULL;
+	rec->nnode_stats = hdr->nnode_stats;
+	data += hdr->nnode_stats * sizeof(double);
+
+	rec->relid		= hdr->relid;
+	rec->userid		= hdr->userid;
+	rec->added		= hdr->added;
+	rec->total_time	= hdr->total_time;
+	rec->query		= data;
+	rec->query_len	= hdr->query_len;
+	rec->plan		= data + hdr->query_len;
+	rec->plan_len	= hdr->plan_len;
+	rec->plan_binary = hdr->plan_binary;
+	rec->plan_varlena = false;
+	rec->hash		= data + hdr->query_len + hdr->plan_len;
+	rec->hash_len	= hdr->hash_len;
+	rec->nodes		= hdr->nodes_len > 0 ? rec->hash + hdr->hash_len : NULL;
+	rec->nodes_len	= hdr->nodes_len;
+	rec->nodes_varlena = false;
+	if (hdr->nodes_in_plan)
+	{
+		rec->nodes		= rec->plan;
+		rec->nodes_len	= rec->plan_len;
+	}
+	rec->outcome	= (QFlashOutcome) hdr->outcome;
+	rec->xid		= hdr->xid;
+	rec->plan_id	= hdr->plan_id;
+	rec->rows		= hdr->rows;
+	rec->query_id	= hdr->query_id;
+}
+
+/*
+ * Whether a header read from a segment file describes a record that fits in
+ * the avail bytes left in the file and whose payload fits in the record. A
+ * torn or foreign file fails here instead of being decoded out of bounds.
+ */
+bool
+qflash_record_valid(QFlashRecordHeader *hdr, uint64 avail)
+{
+	uint64		payload;
+
+	if (hdr->magic != QFLASH_RECORD_MAGIC) return false;
+	if (hdr->len < sizeof(QFlashRecordHeader) || hdr->len != MAXALIGN(hdr->len) || hdr->len > avail) return false;
+
+	// uint32 fields, the sum cannot overflow in 64 bits
+	payload = (uint64) hdr->nnode_stats * sizeof(double) + (uint64) hdr->query_len + (uint64) hdr->plan_len
+		+ (uint64) hdr->hash_len + (uint64) hdr->nodes_len;
+	if (sizeof(QFlashRecordHeader) + payload > hdr->len) return false;
+
+	// Node stats come three per node, plan nodes only as the binary plan itself
+	if (hdr->nnode_stats % 3 != 0) return false;
+	if (hdr->nodes_in_plan && (!hdr->plan_binary || hdr->nodes_len != 0)) return false;
+
+	return true;
+}
+
+/*
+ * Drain everything currently in the ring and write it in one transaction,
+ * each log relation and role in a subtransaction of its own so that a
+ * failing one drops only its records. The space is given back to the ring
+ * after the commit; when the transaction fails the records are retried, up to
+ * QFLASH_FLUSH_MAX_RETRIES times before they are dropped and counted.
+ * Records of transactions still running are kept by the worker until they
+ * end, so that aborted tells how they ended; up to the size of the ring,
+ * beyond that and on the final flush they are written with aborted unknown.
+ * Records of other databases cannot be written here, they are counted as
+ * dropped. Runs in the flush worker only.
+ */
+void
+qflash_ring_flush(MemoryContext flush_cxt, bool final)
+{
+	MemoryContext oldcxt;
+	QFlashRecord *recs;
+	int			nrecs = 0;
+	char	   *buf;
+	char	   *deferred;
+	uint64		deferred_len = 0;
+	uint64		foreign = 0;
+	uint64		tail;
+	uint64		head;
+	uint64		len;
+	uint64		total;
+	uint64		off;
+	int			start;
+	int			end;
+
+	LWLockAcquire(qflash_shared->lock, LW_SHARED);
+	tail = qflash_shared->tail;
+	head = qflash_shared->head;
+	LWLockRelease(qflash_shared->lock);
+
+	// Only this worker moves the tail, so the reserved space stays ours
+	// without the lock; records still being copied end the batch
+	for (len = 0; tail + len < head;)
+	{
+		QFlashRecordHeader hdr;
+
+		if (*qflash_ring_magic(tail + len) != QFLASH_RECORD_MAGIC) break;
+		pg_read_barrier();
+
+		qflash_ring_copy_out(tail + len, &hdr, sizeof(hdr));
+		len += hdr.len;
+	}
+
+	if (len == 0 && qflash_deferred_len == 0) return;
+
+	// Deferred records first, they were captured before
+	oldcxt = MemoryContextSwitchTo(flush_cxt);
+	total = qflash_deferred_len + len;
+	buf = palloc(total);
+	if (qflash_deferred_len > 0)
+		memcpy(buf, qflash_deferred, qflash_deferred_len);
+	if (len > 0)
+		qflash_ring_copy_out(tail, buf + qflash_deferred_len, len);
+	deferred = palloc(total);
+
+	// Records point into buf
+	recs = (QFlashRecord *) palloc((total / MAXALIGN(sizeof(QFlashRecordHeader))) * sizeof(QFlashRecord));
+	MemoryContextSwitchTo(oldcxt);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "q-flash: flushing ring buffer");
+
+	PG_TRY();
+	{
+		for (off = 0; off < total;)
+		{
+			QFlashRecordHeader hdr;
+
+			memcpy(&hdr, buf + off, sizeof(hdr));
+
+			if (hdr.dbid == MyDatabaseId)
+			{
+				if (qflash_record_resolve(&hdr))
+					qflash_record_decode(&hdr, buf + off + sizeof(hdr), &recs[nrecs++]);
+				else if (final || deferred_len + hdr.len > qflash_shared->ring_size)
+				{
+					hdr.outcome = QFLASH_OUTCOME_UNKNOWN;
+					qflash_record_decode(&hdr, buf + off + sizeof(hdr), &recs[nrecs++]);
+				}
+				else
+				{
+					memcpy(deferred + deferred_len, buf + off, hdr.len);
+					deferred_len += hdr.len;
+				}
+			}
+			else
+				foreign++;
+
+			off += hdr.len;
+		}
+
+		for (start = 0; start < nrecs; start = end)
+		{
+			for (end = start + 1; end < nrecs && recs[end].relid == recs[start].relid
+				&& recs[end].userid == recs[start].userid; end++);
+
+			qflash_ring_flush_run(recs + start, end - start);
+		}
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		uint64		nfailed = 0;
+
+		// Keep the records in the ring and the deferred ones, the next flush
+		// tries them again, unless they failed too often
+		EmitErrorReport();
+		FlushErrorState();
+		AbortCurrentTransaction();
+		MemoryContextSwitchTo(oldcxt);
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		if (++qflash_flush_failures < QFLASH_FLUSH_MAX_RETRIES)
+		{
+			MemoryContextReset(flush_cxt);
+			return;
+		}
+
+		for (off = 0; off < total; nfailed++)
+			off += ((QFlashRecordHeader *) (buf + off))->len;
+
+		LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+		qflash_shared->tail += len;
+		qflash_shared->dropped += nfailed;
+		LWLockRelease(qflash_shared->lock);
+
+		if (qflash_deferred_cxt != NULL)
+			MemoryContextReset(qflash_deferred_cxt);
+		qflash_deferred		= NULL;
+		qflash_deferred_len	= 0;
+		qflash_flush_failures = 0;
+
+		ereport(LOG,
+				(errmsg("q-flash: dropped " UINT64_FORMAT " ring records after %d failed flushes",
+						nfailed, QFLASH_FLUSH_MAX_RETRIES),
+				 errdetail("They are counted in ring_dropped of qflash_stats().")));
+
+		MemoryContextReset(flush_cxt);
+		return;
+	}
+	PG_END_TRY();
+
+	qflash_flush_failures = 0;
+
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+	qflash_shared->tail += len;
+	qflash_shared->dropped += foreign;
+	LWLockRelease(qflash_shared->lock);
+
+	if (foreign > 0 && !qflash_foreign_warned)
+	{
+		ereport(LOG,
+				(errmsg("q-flash: dropped " UINT64_FORMAT " ring records of databases other than \"%s\"",
+						foreign, qflash_database),
+				 errhint("Later ones are only counted in ring_dropped of qflash_stats().")));
+		qflash_foreign_warned = true;
+	}
+
+	if (qflash_deferred_cxt == NULL)
+		qflash_deferred_cxt = AllocSetContextCreate(TopMemoryContext, "q-flash deferred", ALLOCSET_DEFAULT_SIZES);
+
+	MemoryContextReset(qflash_deferred_cxt);
+	qflash_deferred		= NULL;
+	qflash_deferred_len	= deferred_len;
+	if (deferred_len > 0)
+	{
+		qflash_deferred = MemoryContextAlloc(qflash_deferred_cxt, deferred_len);
+		memcpy(qflash_deferred, deferred, deferred_len);
+	}
+
+	MemoryContextReset(flush_cxt);
+}
+
+/*
+ * Outcome of the (sub)transaction that captured a record: false while it is
+ * still running, otherwise true with the outcome set to aborted when it
+ * rolled back or crashed.
+ */
+bool
+qflash_record_resolve(QFlashRecordHeader *hdr)
+{
+	if (!TransactionIdIsValid(hdr->xid)) return true;
+
+	if (TransactionIdIsInProgress(hdr->xid)) return false;
+
+	if (!TransactionIdDidCommit(hdr->xid))
+		hdr->outcome = QFLASH_OUTCOME_ABORTED;
+
+	return true;
+}
+
+/*
+ * Write the records of one log relation and role in a subtransaction.
+ * Errors are reported as a warning and the records are dropped, so that a
+ * missing table or privilege does not hold up the records of the others.
+ */
+void
+qflash_ring_flush_run(QFlashRecord *recs, int nrecs)
+{
+	MemoryContext cxt = CurrentMemoryContext;
+	ResourceOwner owner = CurrentResourceOwner;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(cxt);
+
+	PG_TRY();
+	{
+		qflash_write_records(recs, nrecs);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(cxt);
+		CurrentResourceOwner = owner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(cxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(cxt);
+		CurrentResourceOwner = owner;
+
+		ereport(WARNING,
+				(errmsg("q-flash: dropped %d records of log relation %u", nrecs, recs[0].relid),
+				 errdetail_internal("%s", edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
+static void
+qflash_worker_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+qflash_worker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+qflash_worker_detach(int code, Datum arg)
+{
+	LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+	qflash_shared->worker_latch	= NULL;
+	qflash_shared->worker_dbid	= InvalidOid;
+	LWLockRelease(qflash_shared->lock);
+}
+
+/*
+ * Flush worker: drains the shared ring buffer into the log relations,
+ * keeping the inserts off the latency path of the capturing backends.
+ */
+void
+qflash_worker_main(Datum main_arg)
+{
+	MemoryContext flush_cxt;
+	TimestampTz next_rotate = 0;
+
+	pqsignal(SIGHUP, qflash_worker_sighup);
+	pqsignal(SIGTERM, qflash_worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(qflash_database, NULL);
+
+	flush_cxt = AllocSetContextCreate(TopMemoryContext, "q-flash flush", ALLOCSET_DEFAULT_SIZES);
+
+	LWLockAcquire(qflash_shared->lock, LW_EXCLUSIVE);
+	qflash_shared->worker_latch	= MyLatch;
+	qflash_shared->worker_dbid	= MyDatabaseId;
+	LWLockRelease(qflash_shared->lock);
+	before_shmem_exit(qflash_worker_detach, (Datum) 0);
+
+	while (!got_sigterm)
+	{
+		int			rc;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+			qflash_flush_naptime, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH) proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		qflash_ring_flush(flush_cxt, false);
+
+		// A failed rotation is tried again after the next naptime
+		if (GetCurrentTimestamp() >= next_rotate && qflash_worker_rotate())
+			next_rotate = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), QFLASH_ROTATE_INTERVAL);
+	}
+
+	// Write out what was captured before shutdown
+	qflash_ring_flush(flush_cxt, true);
+
+	proc_exit(1);
+}
+
+/*
+ * Next part of a record written with pwritev, empty parts are left out.
+ */
+static inline void
+qflash_iov_add(struct iovec *iov, int *niov, const void *base, Size len)
+{
+	if (len == 0) return;
+
+	iov[*niov].iov_base	= (void *) base;
+	iov[*niov].iov_len	= len;
+	(*niov)++;
+}
+
+/*
+ * Append a record to the current segment file. The position is reserved
+ * under the file lock, the write itself runs concurrently with other
+ * backends. Segments are preallocated to their full size; readers skip the
+ * zeroes of space not written (yet). Returns false when the record was dropped:
+ * like a full ring, a full disk or a missing privilege must not fail the
+ * captured statement.
+ */
+bool
+qflash_file_append(QFlashRecord *rec)
+{
+	static const char padding[MAXIMUM_ALIGNOF];
+	QFlashRecordHeader hdr;
+	char		path[MAXPGPATH];
+	struct iovec iov[7];
+	int			niov = 0;
+	uint32		segno;
+	uint64		offset;
+	uint64		segment_size;
+
+	qflash_record_header(rec, &hdr);
+
+	LWLockAcquire(qflash_shared->file_lock, LW_EXCLUSIVE);
+
+	// Continue after the segments left by a previous run
+	if (!qflash_shared->file_started)
+	{
+		if (mkdir(QFLASH_SEGMENT_DIR, S_IRWXU) < 0 && errno != EEXIST)
+		{
+			int			save_errno = errno;
+
+			LWLockRelease(qflash_shared->file_lock);
+			errno = save_errno;
+			return qflash_file_drop("create directory", QFLASH_SEGMENT_DIR);
+		}
+
+		qflash_shared->file_segno			= qflash_file_last_segno() + 1;
+		qflash_shared->file_offset			= 0;
+		qflash_shared->file_segment_size	= (uint64) qflash_segment_size * 1024;
+		qflash_shared->file_started			= true;
+	}
+
+	if (qflash_shared->file_offset + hdr.len > qflash_shared->file_segment_size)
+	{
+		qflash_shared->file_segno++;
+		qflash_shared->file_offset			= 0;
+		qflash_shared->file_segment_size	= (uint64) qflash_segment_size * 1024;
+	}
+
+	if (hdr.len > qflash_shared->file_segment_size)
+	{
+		LWLockRelease(qflash_shared->file_lock);
+		pg_atomic_fetch_add_u64(&qflash_shared->file_dropped, 1);
+		return false;
+	}
+
+	segno			= qflash_shared->file_segno;
+	offset			= qflash_shared->file_offset;
+	segment_size	= qflash_shared->file_segment_size;
+	qflash_shared->file_offset += hdr.len;
+
+	LWLockRelease(qflash_shared->file_lock);
+
+	// The backend starting a segment retires the oldest one
+	if (offset == 0 && qflash_max_segments > 0 && segno > (uint32) qflash_max_segments)
+	{
+		qflash_segment_path(path, segno - qflash_max_segments);
+		if (unlink(path) < 0 && errno != ENOENT)
+			ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove q-flash segment \"%s\": %m", path)));
+	}
+
+	if (qflash_file_fd < 0 || qflash_file_fd_segno != segno)
+	{
+		if (qflash_file_fd >= 0)
+			close(qflash_file_fd);
+
+		qflash_segment_path(path, segno);
+		qflash_file_fd = BasicOpenFile(path, O_RDWR | O_CREAT | PG_BINARY, S_IRUSR | S_IWUSR);
+		if (qflash_file_fd < 0)
+			return qflash_file_drop("open q-flash segment", path);
+		qflash_file_fd_segno = segno;
+	}
+
+	// Only grows the file, records already written by others stay intact
+	if (offset == 0 && ftruncate(qflash_file_fd, segment_size) < 0)
+	{
+		qflash_segment_path(path, segno);
+		return qflash_file_drop("extend q-flash segment", path);
+	}
+
+	// Written from where the parts are, a large plan is never copied
+	qflash_iov_add(iov, &niov, &hdr, sizeof(hdr));
+	qflash_iov_add(iov, &niov, rec->node_stats, hdr.nnode_stats * sizeof(double));
+	qflash_iov_add(iov, &niov, rec->query, hdr.query_len);
+	qflash_iov_add(iov, &niov, rec->plan, hdr.plan_len);
+	qflash_iov_add(iov, &niov, rec->hash, hdr.hash_len);
+	qflash_iov_add(iov, &niov, rec->nodes, hdr.nodes_len);
+	qflash_iov_add(iov, &niov, padding, hdr.len - (sizeof(hdr) + hdr.nnode_stats * sizeof(double)
+		+ hdr.query_len + hdr.plan_len + hdr.hash_len + hdr.nodes_len));
+
+	errno = 0;
+	if (pwritev(qflash_file_fd, iov, niov, offset) != hdr.len)
+	{
+		// A short write sets no errno, assume the disk is full
+		if (errno == 0) errno = ENOSPC;
+		qflash_segment_path(path, segno);
+		return qflash_file_drop("write to q-flash segment", path);
+	}
+
+	return true;
+}
+
+/*
+ * Count a record the file sink could not write and warn about it, at most
+ * once per QFLASH_FILE_WARN_INTERVAL in a backend. Reports errno, returns
+ * false.
+ */
+bool
+qflash_file_drop(const char *action, const char *path)
+{
+	int			save_errno = errno;
+	TimestampTz now = GetCurrentTimestamp();
+
+	pg_atomic_fetch_add_u64(&qflash_shared->file_dropped, 1);
+
+	if (qflash_file_warned != 0 && !TimestampDifferenceExceeds(qflash_file_warned, now, QFLASH_FILE_WARN_INTERVAL))
+		return false;
+	qflash_file_warned = now;
+
+	errno = save_errno;
+	ereport(WARNING,
+		(errcode_for_file_access(),
+		 errmsg("could not %s \"%s\": %m", action, path),
+		 errdetail("q-flash drops the records it cannot write, qflash_stats() counts them.")));
+
+	return false;
+}
+
+uint32
+qflash_file_last_segno(void)
+{
+	uint32	   *segnos;
+	int			nsegnos = qflash_segment_list(&segnos);
+
+	return nsegnos > 0 ? segnos[nsegnos - 1] : 0;
+}
+
+void
+qflash_segment_path(char *path, uint32 segno)
+{
+	snprintf(path, MAXPGPATH, QFLASH_SEGMENT_DIR "/%08X", segno);
+}
+
+static int
+qflash_segno_cmp(const void *a, const void *b)
+{
+	uint32		sa = *(const uint32 *) a;
+	uint32		sb = *(const uint32 *) b;
+
+	return (sa > sb) - (sa < sb);
+}
+
+/*
+ * Existing segment numbers in ascending order.
+ */
+int
+qflash_segment_list(uint32 **segnos)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	int			nsegnos = 0;
+	int			cap = 16;
+
+	*segnos = (uint32 *) palloc(cap * sizeof(uint32));
+
+	dir = AllocateDir(QFLASH_SEGMENT_DIR);
+	if (dir == NULL && errno == ENOENT) return 0;
+
+	while ((de = ReadDir(dir, QFLASH_SEGMENT_DIR)) != NULL)
+	{
+		if (strlen(de->d_name) != 8 || strspn(de->d_name, "0123456789ABCDEF") != 8) continue;
+
+		if (nsegnos == cap)
+		{
+			cap *= 2;
+			*segnos = (uint32 *) repalloc(*segnos, cap * sizeof(uint32));
+		}
+		(*segnos)[nsegnos++] = (uint32) strtoul(de->d_name, NULL, 16);
+	}
+
+	FreeDir(dir);
+
+	qsort(*segnos, nsegnos, sizeof(uint32), qflash_segno_cmp);
+
+	return nsegnos;
+}
+
+/*
+ * Unmap the current segment, also on early end or error of the scan.
+ */
+void
+qflash_segment_scan_release(void *arg)
+{
+	QFlashSegmentScan *scan = (QFlashSegmentScan *) arg;
+
+	if (scan->map != NULL)
+		munmap(scan->map, scan->map_len);
+
+	scan->map		= NULL;
+	scan->map_len	= 0;
+	scan->off		= 0;
+}
+
+/*
+ * Records of all segment files, oldest first. Segments are mapped one at a
+ * time and records decoded as they are returned, without touching shared
+ * buffers or WAL.
+ */
+Datum
+qflash_read_segments(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	QFlashSegmentScan *scan;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcxt;
+		MemoryContextCallback *cb;
+		TupleDesc	tupdesc;
+
+		if (!superuser())
+			ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to read q-flash segments")));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		scan = (QFlashSegmentScan *) palloc0(sizeof(QFlashSegmentScan));
+		scan->nsegnos = qflash_segment_list(&scan->segnos);
+		funcctx->user_fctx = scan;
+
+		cb = (MemoryContextCallback *) palloc(sizeof(MemoryContextCallback));
+		cb->func	= qflash_segment_scan_release;
+		cb->arg		= scan;
+		MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx, cb);
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	scan = (QFlashSegmentScan *) funcctx->user_fctx;
+
+	for (;;)
+	{
+		QFlashRecordHeader hdr;
+		char		path[MAXPGPATH];
+		struct stat st;
+		int			fd;
+
+		if (scan->map != NULL && scan->off + sizeof(hdr) <= scan->map_len)
+		{
+			QFlashRecord rec;
+			Datum		values[14];
+			bool		nulls[14];
+
+			memcpy(&hdr, scan->map + scan->off, sizeof(hdr));
+
+			// Space reserved by a backend that failed or crashed before its
+			// write completed: records start at aligned offsets, look for the
+			// next one written after it
+			if (!qflash_record_valid(&hdr, (uint64) (scan->map_len - scan->off)))
+			{
+				scan->off += MAXIMUM_ALIGNOF;
+				continue;
+			}
+
+			qflash_record_decode(&hdr, scan->map + scan->off + sizeof(hdr), &rec);
+			scan->off += hdr.len;
+
+			memset(nulls, false, sizeof(nulls));
+			values[0] = Int32GetDatum((int32) scan->segno);
+			values[1] = TimestampTzGetDatum(rec.added);
+			values[2] = ObjectIdGetDatum(hdr.dbid);
+			values[3] = ObjectIdGetDatum(rec.relid);
+			values[4] = Float8GetDatum(rec.total_time);
+			values[5] = PointerGetDatum(cstring_to_text_with_len(rec.query, rec.query_len));
+			values[6] = PointerGetDatum(cstring_to_text_with_len(rec.plan, rec.plan_len));
+			nulls[6] = rec.plan_binary;
+			values[7] = PointerGetDatum(cstring_to_text_with_len(rec.hash, rec.hash_len));
+			nulls[7] = (rec.hash_len == 0);
+			values[8] = BoolGetDatum(rec.outcome == QFLASH_OUTCOME_ABORTED);
+			nulls[8] = (rec.outcome == QFLASH_OUTCOME_UNKNOWN);
+			values[9] = Int64GetDatum((int64) rec.plan_id);
+			nulls[9] = (rec.plan_id == 0);
+			values[10] = Int64GetDatum((int64) rec.rows);
+			values[11] = Int64GetDatum((int64) rec.query_id);
+			nulls[11] = (rec.query_id == 0);
+			values[12] = (rec.node_stats != NULL) ? qflash_node_stats_datum(&rec) : (Datum) 0;
+			nulls[12] = (rec.node_stats == NULL);
+			values[13] = rec.plan_binary ? qflash_plan_bin_datum(&rec) : (Datum) 0;
+			nulls[13] = !rec.plan_binary;
+
+			SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+		}
+
+		// Current segment exhausted, map the next one
+		qflash_segment_scan_release(scan);
+
+		if (scan->next >= scan->nsegnos)
+			SRF_RETURN_DONE(funcctx);
+
+		scan->segno = scan->segnos[scan->next++];
+		qflash_segment_path(path, scan->segno);
+
+		fd = BasicOpenFile(path, O_RDONLY | PG_BINARY, 0);
+		if (fd < 0)
+		{
+			// Retired while we were reading
+			if (errno == ENOENT) continue;
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open q-flash segment \"%s\": %m", path)));
+		}
+
+		if (fstat(fd, &st) < 0 || st.st_size == 0)
+		{
+			close(fd);
+			continue;
+		}
+
+		scan->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (scan->map == MAP_FAILED)
+		{
+			scan->map = NULL;
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not map q-flash segment \"%s\": %m", path)));
+		}
+
+		scan->map_len	= st.st_size;
+		scan->off		= 0;
+	}
+}
@@ -1,15 +1,5 @@
 #include "postgres.h"
-#include "commands/explain.h"
-#include "executor/spi.h"
-#include "utils/guc.h"
-#include "catalog/pg_type.h"
-#include "catalog/pg_namespace.h"
-#include "catalog/namespace.h"
-#include "utils/builtins.h"
-#include "utils/lsyscache.h"
-#include "utils/syscache.h"
-#include <float.h>
-
+#include "q-flash.h"
 
 PG_MODULE_MAGIC;
 
@@ -17,11 +7,155 @@ PG_MODULE_MAGIC;
 static bool		qflash_enabled_status		= false;
 static double	qflash_log_min_duration		= 0.0;	// msec 
 static char		*qflash_log_hash			= "";	// egz. indentifier for queries in one session
-static char		*qflash_log_rel_name		= "";
-static char		*qflash_log_namespace_name	= "";
+char			*qflash_log_rel_name		= "";
+char			*qflash_log_namespace_name	= "";
 static Oid		qflash_log_namespace_oid	= InvalidOid;
-static Oid		qflash_log_rel_oid			= InvalidOid;
+Oid				qflash_log_rel_oid			= InvalidOid;
+bool			qflash_log_rel_valid		= false;	// OIDs above match the settings, kept by invalidations
+static char		*qflash_exclude_tables		= "";	// statements on these tables are not captured
+static char		*qflash_include_tables		= "";	// if set, only statements on these tables are captured
 static bool		qflash_log_nested			= false;
+int				qflash_sink					= 0;	// QFLASH_SINK_*
+static int		qflash_ring_size			= 8192;	// kB, shared ring buffer
+char			*qflash_database			= "postgres";	// database of the flush worker
+int				qflash_flush_naptime		= 1000;	// msec
+int				qflash_writer				= 0;	// QFLASH_WRITER_*
+int				qflash_xact_batch_size		= 1000;	// records buffered by the xact sink
+int				qflash_segment_size			= 16384;	// kB, file sink segment
+int				qflash_max_segments			= 64;	// segments kept by the file sink, 0 keeps all
+static bool		qflash_plan_dedup			= false;	// store plan texts once per plan shape
+static bool		qflash_query_fingerprint	= false;	// store normalized query texts once per fingerprint
+int				qflash_retention			= 0;	// days of log partitions kept, 0 keeps all
+static double	qflash_sample_rate			= 1.0;	// fraction of eligible statements captured
+static int		qflash_sample_mode			= 0;	// QFLASH_SAMPLE_*
+static int		qflash_instrument_mode		= 0;	// QFLASH_INSTRUMENT_*
+static int		qflash_max_fingerprints		= 10000;	// entries of the fingerprint table
+static int		qflash_max_plans			= 10000;	// entries of the seen plans table
+static bool		qflash_log_timing			= true;	// per-node timing
+static bool		qflash_log_buffers			= true;	// per-node buffer usage
+static bool		qflash_log_verbose			= true;	// EXPLAIN VERBOSE output
+static bool		qflash_log_rows_only		= false;	// per-node row counts only
+static int		qflash_timing_source		= 0;	// QFLASH_TIMING_*
+static int		qflash_profile_interval		= 0;	// usec of CPU time between profile samples, 0 disables
+int				qflash_trace_level			= 0;	// QFLASH_TRACE_*, only in builds with QFLASH_TRACE
+int				qflash_log_format			= EXPLAIN_FORMAT_TEXT;	// EXPLAIN_FORMAT_* of captured plans
+static bool		qflash_log_nodes			= false;	// one <relname>_nodes row per plan node
+static int		qflash_max_plan_bytes		= 0;	// rendered plans are cut to this size, 0 unlimited
+static double	qflash_anomaly_sigma		= 0.0;	// capture beyond mean + sigma * stddev of the fingerprint, 0 disables
+static int		qflash_anomaly_min_calls	= 20;	// executions before a fingerprint's baseline is trusted
+static double	qflash_anomaly_alpha		= 0.05;	// weight of the newest execution in the moving baseline
+static double	qflash_max_captures_per_sec	= 0.0;	// all backends together, 0 unlimited
+static double	qflash_backend_max_captures_per_sec = 0.0;	// each backend, 0 unlimited
+static int		qflash_capture_burst		= 10;	// captures allowed at once after a quiet period
+
+static const struct config_enum_entry sink_options[] = {
+	{"table", QFLASH_SINK_TABLE, false},
+	{"xact", QFLASH_SINK_XACT, false},
+	{"ring", QFLASH_SINK_RING, false},
+	{"file", QFLASH_SINK_FILE, false},
+	{NULL, 0, false}
+};
+
+QFlashOidSet qflash_excluded_rels = {NULL, 0, 0};
+QFlashOidSet qflash_included_rels = {NULL, 0, 0};
+bool			qflash_relation_sets_complete = true;	// every listed table was found
+
+static const struct config_enum_entry trace_level_options[] = {
+	{"off", QFLASH_TRACE_OFF, false},
+	{"capture", QFLASH_TRACE_CAPTURE, false},
+	{"hooks", QFLASH_TRACE_HOOKS, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry log_format_options[] = {
+	{"text", EXPLAIN_FORMAT_TEXT, false},
+	{"json", EXPLAIN_FORMAT_JSON, false},
+	{"yaml", EXPLAIN_FORMAT_YAML, false},
+	{"xml", EXPLAIN_FORMAT_XML, false},
+	{"binary", QFLASH_FORMAT_BINARY, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry writer_options[] = {
+	{"heap", QFLASH_WRITER_HEAP, false},
+	{"spi", QFLASH_WRITER_SPI, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry sample_mode_options[] = {
+	{"random", QFLASH_SAMPLE_RANDOM, false},
+	{"hash", QFLASH_SAMPLE_HASH, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry instrument_mode_options[] = {
+	{"full", QFLASH_INSTRUMENT_FULL, false},
+	{"adaptive", QFLASH_INSTRUMENT_ADAPTIVE, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry timing_source_options[] = {
+	{"system", QFLASH_TIMING_SYSTEM, false},
+	{"tsc", QFLASH_TIMING_TSC, false},
+	{"coarse", QFLASH_TIMING_COARSE, false},
+	{NULL, 0, false}
+};
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define QFLASH_CLOCK_COARSE		CLOCK_MONOTONIC_COARSE
+#else
+#define QFLASH_CLOCK_COARSE		CLOCK_MONOTONIC
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QFLASH_HAVE_TSC
+
+static inline uint64
+qflash_rdtsc(void)
+{
+	uint32		lo;
+	uint32		hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64) hi << 32) | lo;
+}
+#endif
+
+#define QFLASH_TSC_CALIBRATION	10000	// usec
+
+static double	qflash_tsc_sec_per_tick	= 0;	// zero without a usable or calibrated TSC
+
+static QFlashQueryState *qflash_queries = NULL;
+
+// Query whose plan nodes are being executed
+static QFlashQueryState *qflash_running = NULL;
+
+// Query sampled by the profiler and the plan_node_id running in it, read by the SIGPROF handler
+static QFlashQueryState *volatile qflash_profiling = NULL;
+static volatile int qflash_profile_node = -1;
+static bool		qflash_profile_handler_set = false;
+
+QFlashSharedState *qflash_shared = NULL;
+
+// Token bucket of qflash.backend_max_captures_per_sec and counters of this backend
+static pg_atomic_uint64 qflash_backend_capture_tat;
+static uint64 qflash_backend_captured = 0;
+static uint64 qflash_backend_rate_limited = 0;
+
+static HTAB *qflash_fingerprints = NULL;		// shared, when preloaded
+static HTAB *qflash_local_fingerprints = NULL;	// otherwise per backend
+
+static HTAB *qflash_seen_plans = NULL;			// shared, when preloaded
+static HTAB *qflash_local_seen_plans = NULL;	// otherwise per backend
+
+static QFlashPlanDicts qflash_local_plan_dicts;
+
+QFlashPendingPlan *qflash_pending_plans = NULL;
+int				qflash_npending_plans = 0;
+static int		qflash_pending_plans_cap = 0;
+
+// Set while writing records, our own statements are never captured
+bool			qflash_writing = false;
 
 // Current nesting depth of ExecutorRun calls
 static int  nesting_level		= 0;
@@ -31,36 +165,20 @@ static ExecutorStart_hook_type prev_ExecutorStart	= NULL;
 static ExecutorRun_hook_type prev_ExecutorRun		= NULL;
 static ExecutorFinish_hook_type prev_ExecutorFinish	= NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd		= NULL;
-
-// count elements in array
-#define NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
-
-// export symbols on windows 
-PGDLLEXPORT void _PG_init();
-PGDLLEXPORT void _PG_fini();
-
-// symbols
-void _PG_init(void);
-void _PG_fini(void);
-
-void enabled_GucAssign(bool newval, void *extra);
-bool namespace_GucCheck(char **newval, void **extra, GucSource source);
-bool rel_GucCheck(char **newval, void **extra, GucSource source);
+static shmem_startup_hook_type prev_shmem_startup_hook	= NULL;
 
 static void explain_ExecutorStart(QueryDesc *queryDesc, int eflags);
 static void explain_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count, bool execute_once);
 static void explain_ExecutorFinish(QueryDesc *queryDesc);
 static void explain_ExecutorEnd(QueryDesc *queryDesc);
-
-bool set_qflash_namespace_oid(const char *namespace_name);
-bool set_qflash_relname_oid(const char *relname_name);
-Oid get_qflash_log_rel_oid(void);
-
-bool qflash_enabled(QueryDesc *queryDesc);
-void log_InRelation(ExplainState *es, QueryDesc *queryDesc);
-char* generate_insert_log_query(void);
+static void qflash_shmem_startup(void);
+static TupleTableSlot *qflash_exec_proc_node(PlanState *node);
+static void qflash_profile_handler(SIGNAL_ARGS);
 
 PG_FUNCTION_INFO_V1(qflash_init);
+PG_FUNCTION_INFO_V1(qflash_timing_resolution);
+PG_FUNCTION_INFO_V1(qflash_stats);
+PG_FUNCTION_INFO_V1(qflash_plans_deleted);
 
 /*
  * ## INSTALL
@@ -72,10 +190,35 @@ PG_FUNCTION_INFO_V1(qflash_init);
  *
  * ## DB 
  *
- * CREATE FUNCTION qflash_init(TEXT,TEXT) RETURNS bool
+ * CREATE FUNCTION qflash_init(TEXT,TEXT,BOOL DEFAULT false) RETURNS bool
  * AS 'q-flash', 'qflash_init'
  * LANGUAGE C STRICT;
  * SELECT public.qflash_init('public', 'qflash');
+ *
+ * ## PLAN FORMAT
+ *
+ * SET qflash.log_format = 'json';
+ * SELECT public.qflash_init('public', 'qflash');
+ * SELECT * FROM public.qflash WHERE public.qflash_plan_nodes(plan) @> ARRAY['Seq Scan on orders'];
+ *
+ * SET qflash.log_format = 'binary';
+ * CREATE FUNCTION qflash_decode_plan(bytea, text DEFAULT 'text') RETURNS text
+ * AS 'q-flash', 'qflash_decode_plan' LANGUAGE C STRICT STABLE;
+ * SELECT qflash_decode_plan(plan_bin, 'json') FROM public.qflash;
+ *
+ * ## PLAN NODES
+ *
+ * SET qflash.log_nodes = on;
+ * SELECT relation, avg(greatest(actual_rows, 1) / greatest(plan_rows, 1)) FROM public.qflash_nodes
+ *   WHERE node_type LIKE '%Scan' AND loops > 0 GROUP BY relation;
+ *
+ * ## PARTITIONING
+ *
+ * SELECT public.qflash_init('public', 'qflash', true);
+ * qflash.retention = 30
+ * CREATE FUNCTION qflash_rotate(TEXT,TEXT) RETURNS bool
+ * AS 'q-flash', 'qflash_rotate'
+ * LANGUAGE C STRICT;
  * GRANT ALL ON TABLE public.qflash TO public;
  *
  * ## USAGE 
@@ -86,13 +229,45 @@ PG_FUNCTION_INFO_V1(qflash_init);
  * SET qflash.log_relname = 'qflash';
  * SET qflash.log_hash = '';
  *
+ * ## INSTRUMENTATION
+ *
+ * SET qflash.timing_source = 'tsc';
+ * CREATE FUNCTION qflash_timing_resolution() RETURNS float8
+ * AS 'q-flash', 'qflash_timing_resolution' LANGUAGE C STRICT;
+ *
+ * ## ASYNC SINK
+ *
+ * shared_preload_libraries = 'q-flash'
+ * qflash.database = 'postgres'
+ * SET qflash.sink = 'ring';
+ *
+ * ## FILE SINK
+ *
+ * SET qflash.sink = 'file';
+ * CREATE FUNCTION qflash_read_segments(OUT segno integer, OUT added timestamptz,
+ *   OUT dbid oid, OUT relid oid, OUT total_time float8, OUT query text, OUT plan text,
+ *   OUT hash text, OUT aborted bool, OUT plan_id bigint, OUT rows bigint,
+ *   OUT query_id bigint, OUT node_stats float8[], OUT plan_bin bytea)
+ * RETURNS SETOF record AS 'q-flash', 'qflash_read_segments' LANGUAGE C STRICT;
+ *
+ * ## RATE LIMITING
+ *
+ * qflash.max_captures_per_sec = 50
+ * CREATE FUNCTION qflash_stats(OUT captured bigint, OUT rate_limited bigint,
+ *   OUT backend_captured bigint, OUT backend_rate_limited bigint, OUT ring_dropped bigint,
+ *   OUT file_dropped bigint, OUT xact_dropped bigint, OUT partition_skipped bigint)
+ * RETURNS record AS 'q-flash', 'qflash_stats' LANGUAGE C;
+ *
  * */
 		
 Datum
 qflash_init(PG_FUNCTION_ARGS)
 {
-	text  *namespace_name	= PG_GETARG_TEXT_P(0);
-	text  *relname_name		= PG_GETARG_TEXT_P(1);
+	char  *namespace_name	= text_to_cstring(PG_GETARG_TEXT_P(0));
+	char  *relname_name		= text_to_cstring(PG_GETARG_TEXT_P(1));
+	bool   partitioned		= PG_NARGS() > 2 ? PG_GETARG_BOOL(2) : false;
+	const char *plan_type	= (qflash_log_format == EXPLAIN_FORMAT_JSON) ? "JSONB" : "TEXT";
+	char  *trigger_namespace = NULL;
 	StringInfoData	ddl_query;
 	
 	initStringInfo(&ddl_query);
@@ -100,14 +275,128 @@ qflash_init(PG_FUNCTION_ARGS)
 		CREATE TABLE %s.%s \
 		(\
 			id BIGSERIAL NOT NULL,\
-			added TIME WITH TIME ZONE NOT NULL DEFAULT now(),\
+			added TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(),\
 			query TEXT,\
-			plan TEXT,\
+			plan %s,\
 			total_time DOUBLE PRECISION,\
 			hash TEXT,\
-			CONSTRAINT qflash_pkey PRIMARY KEY(id)\
+			aborted BOOLEAN DEFAULT false,\
+			plan_id BIGINT,\
+			rows BIGINT,\
+			query_id BIGINT,\
+			node_stats DOUBLE PRECISION[],\
+			plan_bin BYTEA%s\
+		)%s;\
+		CREATE TABLE %s.%s_plans \
+		(\
+			plan_id BIGINT NOT NULL,\
+			added TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(),\
+			plan %s,\
+			CONSTRAINT %s_plans_pkey PRIMARY KEY(plan_id)\
+		);\
+		CREATE TABLE %s.%s_queries \
+		(\
+			query_id BIGINT NOT NULL,\
+			added TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(),\
+			query TEXT,\
+			CONSTRAINT %s_queries_pkey PRIMARY KEY(query_id)\
 		)\
-	", VARDATA(namespace_name), VARDATA(relname_name));
+	", namespace_name, relname_name, plan_type,
+		// Partitions get their own primary keys
+		partitioned ? "" : ", CONSTRAINT qflash_pkey PRIMARY KEY(id)",
+		partitioned ? " PARTITION BY RANGE (added)" : "",
+		namespace_name, relname_name, plan_type, relname_name,
+		namespace_name, relname_name, relname_name);
+
+	// One row per plan node of a log row, written with qflash.log_nodes,
+	// partitioned by day along with the log table
+	appendStringInfo(&ddl_query, "\
+		;\
+		CREATE TABLE %s.%s_nodes \
+		(\
+			log_id BIGINT NOT NULL,\
+			added TIMESTAMP WITH TIME ZONE NOT NULL,\
+			node_id INTEGER NOT NULL,\
+			parent_id INTEGER,\
+			node_type TEXT NOT NULL,\
+			relation REGCLASS,\
+			index_relation REGCLASS,\
+			plan_rows DOUBLE PRECISION,\
+			actual_rows DOUBLE PRECISION,\
+			loops DOUBLE PRECISION,\
+			startup_time DOUBLE PRECISION,\
+			total_time DOUBLE PRECISION,\
+			shared_hit BIGINT,\
+			shared_read BIGINT%s\
+		)%s\
+	", namespace_name, relname_name,
+		partitioned ? "" : psprintf(", CONSTRAINT %s_nodes_pkey PRIMARY KEY(log_id, node_id)", relname_name),
+		partitioned ? " PARTITION BY RANGE (added)" : "");
+
+	if (!partitioned)
+		appendStringInfo(&ddl_query, "\
+		;\
+		CREATE INDEX %s_nodes_added_idx ON %s.%s_nodes (added)\
+		", relname_name, namespace_name, relname_name);
+
+	// Labels of all nodes of a JSON plan, "Seq Scan on orders", indexed for @> queries
+	if (qflash_log_format == EXPLAIN_FORMAT_JSON)
+	{
+		appendStringInfo(&ddl_query, "\
+		;\
+		CREATE FUNCTION %s.%s_plan_nodes(plan jsonb) RETURNS text[] LANGUAGE sql IMMUTABLE AS $qflash$\
+			WITH RECURSIVE n(node) AS (\
+				SELECT plan->'Plan'\
+				UNION ALL\
+				SELECT c FROM n, jsonb_array_elements(\
+					CASE WHEN jsonb_typeof(n.node->'Plans') = 'array' THEN n.node->'Plans' ELSE '[]' END) c\
+			)\
+			SELECT array_agg(DISTINCT (node->>'Node Type') || coalesce(' on ' || (node->>'Relation Name'), ''))\
+			FROM n WHERE node IS NOT NULL\
+		$qflash$;\
+		CREATE INDEX %s_plans_plan_nodes_idx ON %s.%s_plans USING GIN (%s.%s_plan_nodes(plan))\
+		", namespace_name, relname_name, relname_name, namespace_name, relname_name, namespace_name, relname_name);
+
+		// Partitions get their own indexes
+		if (!partitioned)
+			appendStringInfo(&ddl_query, "\
+		;\
+		CREATE INDEX %s_plan_nodes_idx ON %s.%s USING GIN (%s.%s_plan_nodes(plan))\
+		", relname_name, namespace_name, relname_name, namespace_name, relname_name);
+	}
+
+	// Deleted plan and query texts are written again. C functions need a
+	// superuser, anyone else gets the triggers once one created the function.
+	if (superuser())
+	{
+		appendStringInfo(&ddl_query, "\
+		;\
+		CREATE OR REPLACE FUNCTION %s.qflash_plans_deleted() RETURNS trigger\
+			AS 'q-flash', 'qflash_plans_deleted' LANGUAGE C\
+		", namespace_name);
+		trigger_namespace = namespace_name;
+	}
+	else
+	{
+		Oid			trigger_func = LookupFuncName(list_make1(makeString("qflash_plans_deleted")), 0, NULL, true);
+
+		if (OidIsValid(trigger_func))
+			trigger_namespace = get_namespace_name(get_func_namespace(trigger_func));
+		else
+			ereport(NOTICE,
+					(errmsg("q-flash: rows deleted from \"%s_plans\" and \"%s_queries\" will not be noticed", relname_name, relname_name),
+					 errhint("Have a superuser create the function qflash_plans_deleted() before qflash_init, or use TRUNCATE.")));
+	}
+
+	if (trigger_namespace != NULL)
+		appendStringInfo(&ddl_query, "\
+		;\
+		CREATE TRIGGER %s_plans_deleted AFTER DELETE ON %s.%s_plans\
+			FOR EACH STATEMENT EXECUTE PROCEDURE %s.qflash_plans_deleted();\
+		CREATE TRIGGER %s_queries_deleted AFTER DELETE ON %s.%s_queries\
+			FOR EACH STATEMENT EXECUTE PROCEDURE %s.qflash_plans_deleted()\
+		", relname_name, namespace_name, relname_name, trigger_namespace,
+			relname_name, namespace_name, relname_name, trigger_namespace);
 
 	if (SPI_connect() != SPI_OK_CONNECT)
 	{
@@ -115,11 +404,14 @@ qflash_init(PG_FUNCTION_ARGS)
 		PG_RETURN_BOOL(false);
 	}
 
-	if (SPI_execute(ddl_query.data, false, 1) != SPI_OK_UTILITY)
+	if (SPI_execute(ddl_query.data, false, 0) != SPI_OK_UTILITY)
 	{
 		elog(ERROR, "SPI_execute DDL failed");
 	}
 
+	if (partitioned)
+		qflash_rotate_partitions(get_relname_relid(relname_name, get_namespace_oid(namespace_name, false)));
+
 	if (SPI_finish() != SPI_OK_FINISH)
 	{
 		elog(ERROR, "SPI_finish failed");
@@ -131,8 +423,6 @@ qflash_init(PG_FUNCTION_ARGS)
 void
 _PG_init(void)
 {
-	elog(LOG, "Init started!");
-
 	/* Define custom GUC variables. */
 	DefineCustomBoolVariable("qflash.enabled",
 		"Is query flash enabled.",
@@ -153,17 +443,220 @@ _PG_init(void)
 	DefineCustomStringVariable("qflash.log_namespace_name",
 		"Schema on the query plans logs.",
 		"Define only schema name.",
-		&qflash_log_namespace_name, "", PGC_USERSET, 0, namespace_GucCheck, NULL, NULL);
+		&qflash_log_namespace_name, "", PGC_USERSET, 0, log_namespace_GucCheck, log_rel_GucAssign, NULL);
 
 	DefineCustomStringVariable("qflash.log_relname",
 		"Table on the query plans logs.",
 		"Define only table name.",
-		&qflash_log_rel_name, "", PGC_USERSET, 0, rel_GucCheck, NULL, NULL);
+		&qflash_log_rel_name, "", PGC_USERSET, 0, log_relname_GucCheck, log_rel_GucAssign, NULL);
+
+	DefineCustomStringVariable("qflash.exclude_tables",
+		"Statements touching any of these tables are not captured.",
+		"Comma separated, optionally schema-qualified table names.",
+		&qflash_exclude_tables, "", PGC_USERSET, 0, tables_GucCheck, log_rel_GucAssign, NULL);
+
+	DefineCustomStringVariable("qflash.include_tables",
+		"Only statements touching one of these tables are captured, all when empty.",
+		"Comma separated, optionally schema-qualified table names.",
+		&qflash_include_tables, "", PGC_USERSET, 0, tables_GucCheck, log_rel_GucAssign, NULL);
 
 	DefineCustomBoolVariable("qflash.log_nested",
 		"Log nested statements.", NULL,
 		&qflash_log_nested, false, PGC_SUSET, 0, NULL, NULL, NULL);
 
+	DefineCustomEnumVariable("qflash.sink",
+		"Where captured plans are written.",
+		"table inserts synchronously, xact inserts in bulk at commit, ring hands records to the flush worker.",
+		&qflash_sink, QFLASH_SINK_TABLE, sink_options, PGC_USERSET, 0, sink_GucCheck, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.log_format",
+		"EXPLAIN format of captured plans.",
+		"binary stores a compact encoding in the plan_bin column, log tables with a jsonb plan column always get json.",
+		&qflash_log_format, EXPLAIN_FORMAT_TEXT, log_format_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.log_nodes",
+		"Store every plan node of a captured plan as a row of the <relname>_nodes table.",
+		"Node type, relation, index, estimated and actual rows, loops, times and shared buffers, keyed by log row id and node id.",
+		&qflash_log_nodes, false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.max_plan_bytes",
+		"Largest plan stored, in bytes, including the truncation marker.",
+		"Nodes past the first ones that can fit are not rendered, the rest is cut and marked: text, YAML and XML on a character boundary, JSON after its last complete line with the open groups closed. Zero stores plans whole, binary plans are never cut.",
+		&qflash_max_plan_bytes, 0, 0, INT_MAX, PGC_USERSET, 0, max_plan_bytes_GucCheck, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.writer",
+		"How records are inserted into the log table.",
+		"heap forms the tuple and inserts it directly, spi executes a prepared INSERT.",
+		&qflash_writer, QFLASH_WRITER_HEAP, writer_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("qflash.sample_rate",
+		"Fraction of eligible statements that are instrumented and captured.",
+		"Decided before the statement starts, 1 captures all.",
+		&qflash_sample_rate, 1.0, 0.0, 1.0, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.sample_mode",
+		"How statements are sampled.",
+		"random decides per statement, hash per qflash.log_hash.",
+		&qflash_sample_mode, QFLASH_SAMPLE_RANDOM, sample_mode_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.instrument_mode",
+		"How much of a sampled statement is instrumented.",
+		"full instruments every node, adaptive only measures the total time until a fingerprint was slow once.",
+		&qflash_instrument_mode, QFLASH_INSTRUMENT_FULL, instrument_mode_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.log_timing",
+		"Measure the time spent in every plan node.",
+		"Row counts are still collected when off.",
+		&qflash_log_timing, true, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.log_buffers",
+		"Collect buffer usage of every plan node.",
+		NULL,
+		&qflash_log_buffers, true, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.log_verbose",
+		"Log plans in EXPLAIN VERBOSE form.",
+		NULL,
+		&qflash_log_verbose, true, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.log_rows_only",
+		"Collect only row counts of plan nodes, overrides qflash.log_timing and qflash.log_buffers.",
+		NULL,
+		&qflash_log_rows_only, false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.timing_source",
+		"Clock used for per-node timings.",
+		"system uses the executor instrumentation, tsc a time stamp counter calibrated at server start (CLOCK_MONOTONIC without shared_preload_libraries), coarse CLOCK_MONOTONIC_COARSE.",
+		&qflash_timing_source, QFLASH_TIMING_SYSTEM, timing_source_options, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.profile_interval",
+		"Microseconds of CPU time between samples of the running plan node of captured queries.",
+		"Replaces per-node timing, zero disables the profiler. Uses ITIMER_PROF, so waits are not sampled; rounded up to the kernel timer tick.",
+		&qflash_profile_interval, 0, 0, 1000000, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("qflash.anomaly_sigma",
+		"Capture only executions slower than the mean plus this many standard deviations of their fingerprint.",
+		"Zero captures every execution above qflash.log_min_duration.",
+		&qflash_anomaly_sigma, 0.0, 0.0, 1000.0, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.anomaly_min_calls",
+		"Executions of a fingerprint before its baseline is used.",
+		"Until then qflash.log_min_duration alone decides.",
+		&qflash_anomaly_min_calls, 20, 1, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("qflash.anomaly_alpha",
+		"Weight of the newest execution in the moving mean and variance of a fingerprint.",
+		NULL,
+		&qflash_anomaly_alpha, 0.05, 0.001, 1.0, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("qflash.max_captures_per_sec",
+		"Maximum number of plans captured per second by all backends together.",
+		"Requires shared_preload_libraries, zero is unlimited.",
+		&qflash_max_captures_per_sec, 0.0, 0.0, 1000000.0, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("qflash.backend_max_captures_per_sec",
+		"Maximum number of plans captured per second by one backend.",
+		"Zero is unlimited.",
+		&qflash_backend_max_captures_per_sec, 0.0, 0.0, 1000000.0, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.capture_burst",
+		"Captures allowed in a burst before the rate limits apply.",
+		NULL,
+		&qflash_capture_burst, 10, 1, 1000000, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.trace_level",
+		"Log what q-flash does, in builds with QFLASH_TRACE only.",
+		"capture traces captured and written records, hooks also every executor hook call.",
+		&qflash_trace_level, QFLASH_TRACE_OFF, trace_level_options, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.max_fingerprints",
+		"Maximum number of statement fingerprints remembered.",
+		NULL,
+		&qflash_max_fingerprints, 10000, 100, INT_MAX, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.max_plans",
+		"Maximum number of plan shapes remembered as stored in the plan dictionary.",
+		"Captures of these shapes skip rendering the plan text.",
+		&qflash_max_plans, 10000, 100, INT_MAX, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.xact_batch_size",
+		"Maximum number of records the xact sink buffers before writing them.",
+		NULL,
+		&qflash_xact_batch_size, 1000, 1, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.plan_dedup",
+		"Store each distinct plan shape once in the <relname>_plans table.",
+		"Log rows then carry plan_id instead of the plan text.",
+		&qflash_plan_dedup, false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("qflash.query_fingerprint",
+		"Store normalized query texts once per fingerprint in the <relname>_queries table.",
+		"Constants are replaced by parameters, the fingerprint is the queryId when one is computed.",
+		&qflash_query_fingerprint, false, PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.retention",
+		"Days of log partitions kept by the flush worker.",
+		"Older partitions are dropped, zero keeps all.",
+		&qflash_retention, 0, 0, INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.segment_size",
+		"Size of a segment file of the file sink.",
+		NULL,
+		&qflash_segment_size, 16384, 64, MAX_KILOBYTES, PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.max_segments",
+		"Number of segment files kept by the file sink.",
+		"Zero keeps all segments.",
+		&qflash_max_segments, 64, 0, INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.ring_size",
+		"Size of the shared ring buffer for the ring sink.",
+		NULL,
+		&qflash_ring_size, 8192, 64, MAX_KILOBYTES, PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("qflash.database",
+		"Database the flush worker connects to.",
+		"Only backends of this database can use the ring sink.",
+		&qflash_database, "postgres", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("qflash.flush_naptime",
+		"Maximum delay between flushes of the ring buffer.",
+		NULL,
+		&qflash_flush_naptime, 1000, 10, INT_MAX, PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	EmitWarningsOnPlaceholders("qflash");
+
+	CacheRegisterRelcacheCallback(qflash_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(RELNAMENSP, qflash_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, qflash_syscache_callback, (Datum) 0);
+	RegisterXactCallback(qflash_xact_callback, NULL);
+	RegisterSubXactCallback(qflash_subxact_callback, NULL);
+
+	pg_atomic_init_u64(&qflash_backend_capture_tat, 0);
+
+	/* Shared ring buffer and flush worker, only when preloaded. */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		BackgroundWorker worker;
+
+		RequestAddinShmemSpace(qflash_shmem_size());
+		RequestNamedLWLockTranche("q-flash", 4);
+
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = qflash_shmem_startup;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags		= BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time	= BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time	= 10;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "q-flash");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "qflash_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "q-flash flush worker");
+		worker.bgw_main_arg		= (Datum) 0;
+		worker.bgw_notify_pid	= 0;
+		RegisterBackgroundWorker(&worker);
+	}
+
 	/* Install hooks. */
 	prev_ExecutorStart = ExecutorStart_hook;
 	ExecutorStart_hook = explain_ExecutorStart;
@@ -192,254 +685,2634 @@ set_qflash_relname_oid(const char *relname_name)
 	qflash_log_rel_oid = get_relname_relid(relname_name, qflash_log_namespace_oid);
 	if (!OidIsValid(qflash_log_rel_oid)) return false;
 
+	// A system catalog is treated as missing, nothing is captured into it
+	if (!qflash_log_rel_usable(qflash_log_rel_oid))
+	{
+		qflash_log_rel_oid = InvalidOid;
+		return false;
+	}
+
 	return true;
 }
 
+/*
+ * Log relation named by the settings. Looked up once, together with the
+ * excluded and included relations, and then kept valid by the GUC assign
+ * hooks and the relcache/syscache callbacks; a missing relation is
+ * remembered as well.
+ */
 Oid get_qflash_log_rel_oid()
 {
-	if (!OidIsValid(qflash_log_rel_oid))
+	if (!qflash_log_rel_valid && IsTransactionState())
 	{
-		set_qflash_namespace_oid(qflash_log_namespace_name);
-		set_qflash_relname_oid(qflash_log_rel_name);
+		qflash_log_namespace_oid	= InvalidOid;
+		qflash_log_rel_oid			= InvalidOid;
+
+		if (set_qflash_namespace_oid(qflash_log_namespace_name))
+			set_qflash_relname_oid(qflash_log_rel_name);
+
+		qflash_build_relation_sets();
+
+		qflash_log_rel_valid = true;
 	}
 
 	return qflash_log_rel_oid;
 }
 
-bool
-qflash_enabled(QueryDesc *queryDesc)
+/*
+ * Relations whose statements are never captured, the log relation with its
+ * dictionaries and qflash.exclude_tables, and those of qflash.include_tables.
+ * Caller is in a transaction.
+ */
+void
+qflash_build_relation_sets(void)
 {
-	return ( 
-		qflash_enabled_status
-		&& (nesting_level == 0 || qflash_log_nested)
-		&& get_qflash_log_rel_oid() != InvalidOid
-		&& (queryDesc->operation == CMD_SELECT || queryDesc->operation == CMD_UPDATE || queryDesc->operation == CMD_INSERT || queryDesc->operation == CMD_DELETE)
-		/* Note: Next line is protection against recursion to log query generated by QFlash */
-		&& (
-			queryDesc->plannedstmt->relationOids == NULL || (
-				queryDesc->plannedstmt->relationOids->length > 0
-				// insert into log
-				&& queryDesc->plannedstmt->relationOids->head->data.oid_value != qflash_log_rel_oid
-				// pg_type
-				&& queryDesc->plannedstmt->relationOids->head->data.oid_value != TypeRelationId
-				)
-			)
-		);
-}
+	List	   *excluded = NIL;
+	List	   *included = NIL;
+	bool		complete = true;
 
-void enabled_GucAssign(bool newval, void *extra)
-{
-	if (newval) return;
-	
-	qflash_log_rel_oid			= InvalidOid;
-	qflash_log_namespace_oid	= InvalidOid;
-}
+	excluded = lappend_oid(excluded, TypeRelationId);
 
-bool
-namespace_GucCheck(char **newval, void **extra, GucSource source)
-{
-	if (qflash_enabled_status && !set_qflash_namespace_oid(*newval)) return false;
+	if (OidIsValid(qflash_log_rel_oid))
+	{
+		int			dict;
 
-	return true;
+		excluded = lappend_oid(excluded, qflash_log_rel_oid);
+
+		for (dict = 0; dict < QFLASH_NDICTS; dict++)
+		{
+			char	   *dict_name = psprintf("%s%s", qflash_log_rel_name, qflash_dicts[dict].suffix);
+
+			excluded = lappend_oid(excluded, get_relname_relid(dict_name, qflash_log_namespace_oid));
+		}
+
+		excluded = lappend_oid(excluded,
+			get_relname_relid(psprintf("%s%s", qflash_log_rel_name, QFLASH_NODES_SUFFIX), qflash_log_namespace_oid));
+	}
+
+	complete &= qflash_resolve_tables(qflash_exclude_tables, &excluded);
+	complete &= qflash_resolve_tables(qflash_include_tables, &included);
+
+	qflash_oid_set_build(&qflash_excluded_rels, excluded);
+	qflash_oid_set_build(&qflash_included_rels, included);
+
+	// A table created later under a listed name must be picked up
+	qflash_relation_sets_complete = complete;
 }
 
+/*
+ * Append the OIDs of a comma separated list of possibly qualified table
+ * names. Returns false when some of them do not exist.
+ */
 bool
-rel_GucCheck(char **newval, void **extra, GucSource source)
+qflash_resolve_tables(const char *tables, List **oids)
 {
-	if (qflash_enabled_status && !set_qflash_relname_oid(*newval)) return false;
-	
-	//GUC_check_errdetail("\"max_stack_depth\" must not exceed %ldkB.",
-	//	(stack_rlimit - STACK_DEPTH_SLOP) / 1024L);
-	//GUC_check_errhint("Increase the platform's stack depth limit via \"ulimit -s\" or local equivalent.");
-	return true;
-}
+	char	   *rawstring;
+	char	   *name;
+	char	   *saveptr = NULL;
+	bool		complete = true;
 
-void
-_PG_fini(void)
-{
-	/* Uninstall hooks. */
-	ExecutorStart_hook = prev_ExecutorStart;
-	ExecutorRun_hook = prev_ExecutorRun;
-	ExecutorFinish_hook = prev_ExecutorFinish;
-	ExecutorEnd_hook = prev_ExecutorEnd;
-}
+	if (tables == NULL || tables[0] == '\0') return true;
 
-static void
-explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
-{
-	elog(LOG, "Init explain_ExecutorStart");
-	
-	if (qflash_enabled(queryDesc))
+	rawstring = pstrdup(tables);
+
+	for (name = strtok_r(rawstring, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr))
 	{
-		queryDesc->instrument_options |= INSTRUMENT_ALL;
-	}
+		RangeVar   *rv;
+		Oid			relid;
+		List	   *names;
 
-	if (prev_ExecutorStart) prev_ExecutorStart(queryDesc, eflags);
-	else standard_ExecutorStart(queryDesc, eflags);
+		while (scanner_isspace(*name)) name++;
+		if (*name == '\0') continue;
 
-	if (qflash_enabled(queryDesc) && queryDesc->totaltime == NULL)
-	{
-		MemoryContext oldcxt;
+		// Checked by tables_GucCheck already, nothing here may fail the statement
+		names = qflash_table_name_list(name);
+		if (names == NIL)
+		{
+			complete = false;
+			continue;
+		}
 
-		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL);
-		MemoryContextSwitchTo(oldcxt);
+		rv = makeRangeVarFromNameList(names);
+		relid = RangeVarGetRelid(rv, NoLock, true);
+
+		if (OidIsValid(relid))
+			*oids = lappend_oid(*oids, relid);
+		else
+			complete = false;
 	}
 
-	elog(DEBUG1, "End explain_ExecutorStart");
+	pfree(rawstring);
+
+	return complete;
 }
 
 /*
-* ExecutorRun hook: all we need do is track nesting depth
-*/
-static void
-explain_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count, bool execute_once)
+ * Name list of a possibly schema-qualified, possibly quoted table name, NIL
+ * when it is not one. Unlike stringToQualifiedNameList it never throws.
+ */
+List *
+qflash_table_name_list(const char *name)
 {
-	nesting_level++;
-	PG_TRY();
-	{
-		if (prev_ExecutorRun)
-			prev_ExecutorRun(queryDesc, direction, count, execute_once);
-		else
-			standard_ExecutorRun(queryDesc, direction, count, execute_once);
-		nesting_level--;
-	}
-	PG_CATCH();
+	char	   *rawname = pstrdup(name);
+	List	   *parts;
+	List	   *names = NIL;
+	ListCell   *lc;
+
+	// A database name would make RangeVarGetRelid throw for other databases
+	if (!SplitIdentifierString(rawname, '.', &parts) || parts == NIL || list_length(parts) > 2)
 	{
-		nesting_level--;
-		PG_RE_THROW();
+		list_free(parts);
+		pfree(rawname);
+		return NIL;
 	}
-	PG_END_TRY();
+
+	foreach(lc, parts)
+		names = lappend(names, makeString(pstrdup((char *) lfirst(lc))));
+
+	list_free(parts);
+	pfree(rawname);
+
+	return names;
 }
 
 /*
-* ExecutorFinish hook: all we need do is track nesting depth
-*/
-static void
-explain_ExecutorFinish(QueryDesc *queryDesc)
+ * qflash.exclude_tables and qflash.include_tables are only resolved by the
+ * next captured statement, so their syntax is checked when they are set.
+ */
+bool tables_GucCheck(char **newval, void **extra, GucSource source)
 {
-	nesting_level++;
-	PG_TRY();
-	{
-		if (prev_ExecutorFinish)
-			prev_ExecutorFinish(queryDesc);
-		else
-			standard_ExecutorFinish(queryDesc);
-		nesting_level--;
-	}
-	PG_CATCH();
+	char	   *rawstring;
+	char	   *name;
+	char	   *saveptr = NULL;
+
+	if (*newval == NULL || (*newval)[0] == '\0') return true;
+
+	rawstring = pstrdup(*newval);
+
+	for (name = strtok_r(rawstring, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr))
 	{
-		nesting_level--;
-		PG_RE_THROW();
+		while (scanner_isspace(*name)) name++;
+		if (*name == '\0') continue;
+
+		if (qflash_table_name_list(name) == NIL)
+		{
+			GUC_check_errdetail("\"%s\" is not a valid table name.", name);
+			pfree(rawstring);
+			return false;
+		}
 	}
-	PG_END_TRY();
+
+	pfree(rawstring);
+
+	return true;
 }
 
+/*
+ * A limit below the size of the truncation markers could not be kept, such
+ * limits are refused.
+ */
+bool max_plan_bytes_GucCheck(int *newval, void **extra, GucSource source)
+{
+	if (*newval == 0 || *newval >= QFLASH_PLAN_BYTES_MIN) return true;
+
+	GUC_check_errdetail("qflash.max_plan_bytes must be 0 or at least %d.", QFLASH_PLAN_BYTES_MIN);
+	return false;
+}
 
-static void
-explain_ExecutorEnd(QueryDesc *queryDesc)
+void
+qflash_oid_set_build(QFlashOidSet *set, List *oids)
 {
-	ExplainState *es;
+	ListCell   *lc;
+	int			size = 8;
 
-	elog(LOG, "Init explain_ExecutorEnd");
+	while (size < list_length(oids) * 2)
+		size *= 2;
 
-	if (qflash_enabled(queryDesc))
-	{
-		/* Make sure stats accumulation is done.  (Note: it's okay if several levels of hook all do this.) */
-		InstrEndLoop(queryDesc->totaltime);
+	if (set->slots != NULL)
+		pfree(set->slots);
 
-		if ((queryDesc->totaltime->total * 1000.0) <= qflash_log_min_duration) 
-			return;
+	set->slots		= (Oid *) MemoryContextAllocZero(TopMemoryContext, size * sizeof(Oid));
+	set->mask		= size - 1;
+	set->nmembers	= 0;
 
-		es = NewExplainState();
-		/* Query plan settings */
-		es->analyze	= true;
-		es->verbose	= true;
-		es->buffers	= es->analyze;
-		es->timing	= es->analyze;
-		es->summary	= es->analyze;
-		es->format	= EXPLAIN_FORMAT_TEXT;
+	foreach(lc, oids)
+	{
+		Oid			relid = lfirst_oid(lc);
+		uint32		i;
 
-		ExplainBeginOutput(es);				// Header: XML, JSON ... etc. depends es->format
-		ExplainPrintPlan(es, queryDesc);	// Print query plan to es->str->data
-		if (es->analyze)
-			ExplainPrintTriggers(es, queryDesc);	// Add plans for triggers
-		ExplainEndOutput(es);				// Footer: XML, JSON ... etc. depends es->format
+		if (!OidIsValid(relid)) continue;
 
-		/* Remove last line break */
-		if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
-			es->str->data[--es->str->len] = '\0';
+		for (i = QFLASH_OID_HASH(relid) & set->mask; set->slots[i] != InvalidOid; i = (i + 1) & set->mask)
+		{
+			if (set->slots[i] == relid) break;
+		}
 
-		/* Fix JSON to output an object */
-		if (es->format == EXPLAIN_FORMAT_JSON)
+		if (set->slots[i] == InvalidOid)
 		{
-			es->str->data[0] = '{';
-			es->str->data[es->str->len - 1] = '}';
+			set->slots[i] = relid;
+			set->nmembers++;
 		}
+	}
+}
+
+bool
+qflash_oid_set_contains(QFlashOidSet *set, Oid relid)
+{
+	uint32		i;
 
-		log_InRelation(es, queryDesc);
+	if (set->nmembers == 0) return false;
 
-		// Clean query plan from memory.
-		pfree(es->str->data);
+	for (i = QFLASH_OID_HASH(relid) & set->mask; set->slots[i] != InvalidOid; i = (i + 1) & set->mask)
+	{
+		if (set->slots[i] == relid) return true;
 	}
 
-	if (prev_ExecutorEnd) prev_ExecutorEnd(queryDesc);
-	else standard_ExecutorEnd(queryDesc);
-	
-	elog(LOG, "End explain_ExecutorEnd");
+	return false;
 }
 
-void
-log_InRelation(ExplainState *es, QueryDesc *queryDesc)
+/*
+ * No excluded relation anywhere in the statement, and one of the included
+ * ones when qflash.include_tables is set.
+ */
+bool
+qflash_relations_eligible(List *relationOids)
 {
-	const char* query_string;
-	SPIPlanPtr	spi_plan;
-	int			spi_res_state;
-	Oid			arg_types[4]	= { TEXTOID, TEXTOID, FLOAT8OID, TEXTOID };
-	char		nulls[4]		= { ' ', ' ', ' ', (strlen(qflash_log_hash) ? ' ' : 'n') };
-	Datum		values[4]		= {
-		CStringGetTextDatum(queryDesc->sourceText),
-		CStringGetTextDatum(es->str->data),
-		Float8GetDatum(queryDesc->totaltime->total * 1000.0),
-		CStringGetTextDatum(qflash_log_hash)
-	};
+	bool		included = (qflash_included_rels.nmembers == 0);
+	ListCell   *lc;
 
-	elog(LOG, "log_InRelation");
+	foreach(lc, relationOids)
+	{
+		Oid			relid = lfirst_oid(lc);
 
-	query_string = generate_insert_log_query();
+		if (qflash_oid_set_contains(&qflash_excluded_rels, relid)) return false;
 
-	if (!query_string) return;
-	
-	if (SPI_connect() != SPI_OK_CONNECT)
-	{
-		elog(ERROR, "SPI_connect failed");
-		return;
+		if (!included && qflash_oid_set_contains(&qflash_included_rels, relid))
+			included = true;
 	}
 
-	spi_plan = SPI_prepare(query_string, NELEMS(arg_types), arg_types);
+	return included;
+}
+
+bool
+qflash_enabled(QueryDesc *queryDesc)
+{
+	return ( 
+		qflash_enabled_status
+		&& !qflash_writing
+		&& !IsParallelWorker()
+		&& (nesting_level == 0 || qflash_log_nested)
+		&& get_qflash_log_rel_oid() != InvalidOid
+		&& (queryDesc->operation == CMD_SELECT || queryDesc->operation == CMD_UPDATE || queryDesc->operation == CMD_INSERT || queryDesc->operation == CMD_DELETE)
+		/* Note: Next line is protection against recursion to log query generated by QFlash */
+		&& qflash_relations_eligible(queryDesc->plannedstmt->relationOids)
+		);
+}
+
+/*
+ * Sampling decision for a statement about to start. The hash mode keys on
+ * qflash.log_hash, so all statements of a sampled request are captured
+ * together and the same request is sampled in every backend.
+ */
+bool
+qflash_sampled(void)
+{
+	double		value;
+
+	if (qflash_sample_rate >= 1.0) return true;
+	if (qflash_sample_rate <= 0.0) return false;
 
-	if (spi_plan == NULL)
+	if (qflash_sample_mode == QFLASH_SAMPLE_HASH && qflash_log_hash[0] != '\0')
 	{
-		elog(ERROR, "SPI_execute_plan failed for \"%s\" when log query \"%s\"", query_string, queryDesc->sourceText);
+		uint64		hash = qflash_hash_bytes(QFLASH_FNV_OFFSET, qflash_log_hash, strlen(qflash_log_hash));
+
+		// Top 53 bits as a fraction in [0, 1)
+		value = (double) (hash >> 11) / (double) (UINT64CONST(1) << 53);
 	}
+	else
+		value = (double) random() / ((double) MAX_RANDOM_VALUE + 1.0);
+
+	return value < qflash_sample_rate;
+}
+
+/*
+ * Node instrumentation requested by the qflash.log_* settings. Row counts are
+ * always collected, they are nearly free compared to the timer calls.
+ */
+int
+qflash_instrument_options(void)
+{
+	int			options = INSTRUMENT_ROWS;
+
+	if (qflash_log_rows_only) return options;
+
+	if (qflash_log_timing)
+		options |= INSTRUMENT_TIMER;
+	if (qflash_log_buffers)
+		options |= INSTRUMENT_BUFFERS;
+
+	return options;
+}
+
+/*
+ * Remember that a started query is captured. The state lives in the query's
+ * own memory context and unlinks itself when that goes away, also on error.
+ */
+QFlashQueryState *
+qflash_query_state_create(QueryDesc *queryDesc)
+{
+	QFlashQueryState *state;
+
+	state = (QFlashQueryState *) MemoryContextAllocZero(queryDesc->estate->es_query_cxt, sizeof(QFlashQueryState));
+	state->queryDesc	= queryDesc;
+	state->next			= qflash_queries;
+	qflash_queries		= state;
+
+	state->cb.func	= qflash_query_state_release;
+	state->cb.arg	= state;
+	MemoryContextRegisterResetCallback(queryDesc->estate->es_query_cxt, &state->cb);
 
-	spi_res_state = SPI_execute_plan(spi_plan, values, nulls, false, 1);
+	return state;
+}
+
+QFlashQueryState *
+qflash_query_state_find(QueryDesc *queryDesc)
+{
+	QFlashQueryState *state;
 
-	if (spi_res_state <= 0)
+	for (state = qflash_queries; state != NULL; state = state->next)
 	{
-		elog(ERROR, "SPI_execute_plan failed for \"%s\" when log query \"%s\"", query_string, queryDesc->sourceText);
+		if (state->queryDesc == queryDesc) return state;
 	}
 
-	if (SPI_finish() != SPI_OK_FINISH)
-		elog(ERROR, "SPI_finish failed");
+	return NULL;
+}
+
+void
+qflash_query_state_release(void *arg)
+{
+	QFlashQueryState **prev;
+
+	// Query ended without ExecutorEnd, e.g. on error
+	if (qflash_profiling == (QFlashQueryState *) arg)
+		qflash_profile_stop();
+
+	for (prev = &qflash_queries; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == (QFlashQueryState *) arg)
+		{
+			*prev = (*prev)->next;
+			break;
+		}
+	}
 }
 
-char*
-generate_insert_log_query()
+/*
+ * Current value of a q-flash clock in ticks, nanoseconds for all but a
+ * calibrated TSC.
+ */
+static inline uint64
+qflash_clock_ticks(int source)
 {
-	StringInfoData insert_log_query;
-	initStringInfo(&insert_log_query);
-	appendStringInfo(&insert_log_query, "INSERT INTO %s.%s (query, plan, total_time, hash) VALUES ($1, $2, $3, $4)", qflash_log_namespace_name, qflash_log_rel_name);
+	struct timespec ts;
 
-	return insert_log_query.data;
+#ifdef QFLASH_HAVE_TSC
+	if (source == QFLASH_TIMING_TSC && qflash_tsc_sec_per_tick > 0)
+		return qflash_rdtsc();
+#endif
+
+	clock_gettime(source == QFLASH_TIMING_COARSE ? QFLASH_CLOCK_COARSE : CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double
+qflash_clock_sec_per_tick(int source)
+{
+	if (source == QFLASH_TIMING_TSC && qflash_tsc_sec_per_tick > 0)
+		return qflash_tsc_sec_per_tick;
+
+	return 1e-9;
+}
+
+/*
+ * Measure the TSC frequency against CLOCK_MONOTONIC. Takes a sleep of
+ * QFLASH_TSC_CALIBRATION, so it is done once when the shared memory is set
+ * up and never in a backend. Without preloading or a usable TSC the tsc
+ * source falls back to CLOCK_MONOTONIC.
+ */
+void
+qflash_tsc_calibrate(void)
+{
+#ifdef QFLASH_HAVE_TSC
+	struct timespec t0;
+	struct timespec t1;
+	uint64		c0;
+	uint64		c1;
+	double		sec;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = qflash_rdtsc();
+	pg_usleep(QFLASH_TSC_CALIBRATION);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c1 = qflash_rdtsc();
+
+	sec = (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (c1 > c0 && sec > 0)
+		qflash_tsc_sec_per_tick = sec / (double) (c1 - c0);
+#endif
+}
+
+/*
+ * Time the plan nodes of a query with a q-flash clock. Every node gets
+ * qflash_exec_proc_node in front of its ExecProcNodeReal, row counts and
+ * buffer usage are still kept by the executor's instrumentation.
+ */
+void
+qflash_node_ticks_init(QueryDesc *queryDesc, QFlashQueryState *state)
+{
+	qflash_wrap_nodes(queryDesc, state);
+	qflash_multi_exec_timer_walker(queryDesc->planstate, NULL);
+
+	state->node_ticks	= (QFlashNodeTicks *) MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+		Max(state->nnodes, 1) * sizeof(QFlashNodeTicks));
+}
+
+/*
+ * Put qflash_exec_proc_node in front of every plan node, once per query.
+ */
+void
+qflash_wrap_nodes(QueryDesc *queryDesc, QFlashQueryState *state)
+{
+	int			max_id = -1;
+
+	if (state->nnodes > 0) return;
+
+	qflash_max_node_id_walker(queryDesc->planstate, &max_id);
+	state->nnodes = max_id + 1;
+
+	qflash_wrap_node_walker(queryDesc->planstate, NULL);
+}
+
+/*
+ * Hash and the bitmap nodes are run by MultiExecProcNode, never through
+ * ExecProcNode, so they keep the executor's timer of their instrumentation.
+ */
+bool
+qflash_multi_exec_timer_walker(PlanState *planstate, void *context)
+{
+	if (planstate == NULL) return false;
+
+	switch (nodeTag(planstate))
+	{
+		case T_HashState:
+		case T_BitmapIndexScanState:
+		case T_BitmapAndState:
+		case T_BitmapOrState:
+			if (planstate->instrument != NULL)
+				planstate->instrument->need_timer = true;
+			break;
+		default:
+			break;
+	}
+
+	return planstate_tree_walker(planstate, qflash_multi_exec_timer_walker, context);
+}
+
+bool
+qflash_max_node_id_walker(PlanState *planstate, int *max_id)
+{
+	if (planstate == NULL) return false;
+
+	*max_id = Max(*max_id, planstate->plan->plan_node_id);
+
+	return planstate_tree_walker(planstate, qflash_max_node_id_walker, max_id);
+}
+
+bool
+qflash_wrap_node_walker(PlanState *planstate, void *context)
+{
+	if (planstate == NULL) return false;
+
+	planstate->ExecProcNode = qflash_exec_proc_node;
+
+	return planstate_tree_walker(planstate, qflash_wrap_node_walker, context);
+}
+
+/*
+ * ExecProcNode of timed or profiled plan nodes, ExecProcNodeInstr with our
+ * own clock that also tells the profiler which node is running.
+ */
+static TupleTableSlot *
+qflash_exec_proc_node(PlanState *node)
+{
+	QFlashQueryState *state = qflash_running;
+	Instrumentation *instr = node->instrument;
+	QFlashNodeTicks *ticks = NULL;
+	TupleTableSlot *result;
+	uint64		start = 0;
+	bool		startup;
+	bool		profiled = false;
+	int			prev_node = -1;
+
+	if (state != NULL && state->queryDesc->estate == node->state && node->plan->plan_node_id < state->nnodes)
+	{
+		if (state->node_ticks != NULL)
+			ticks = &state->node_ticks[node->plan->plan_node_id];
+		profiled = (state == qflash_profiling);
+	}
+
+	if (profiled)
+	{
+		prev_node = qflash_profile_node;
+		qflash_profile_node = node->plan->plan_node_id;
+	}
+
+	if (instr)
+		InstrStartNode(instr);
+
+	// Until the first tuple of a loop, which marks the instrumentation running
+	startup = (instr == NULL || !instr->running);
+	if (startup)
+		check_stack_depth();
+
+	if (ticks)
+		start = qflash_clock_ticks(state->timing_source);
+
+	result = node->ExecProcNodeReal(node);
+
+	if (ticks)
+	{
+		uint64		elapsed = qflash_clock_ticks(state->timing_source) - start;
+
+		ticks->total += elapsed;
+		if (startup)
+			ticks->startup += elapsed;
+	}
+
+	if (instr)
+		InstrStopNode(instr, TupIsNull(result) ? 0.0 : 1.0);
+
+	if (profiled)
+		qflash_profile_node = prev_node;
+
+	return result;
+}
+
+/*
+ * Start sampling the node a query is executing every qflash.profile_interval
+ * of CPU time. Only the outermost profiled query is sampled, nodes of nested
+ * queries count for the node that called them.
+ */
+void
+qflash_profile_start(QueryDesc *queryDesc, QFlashQueryState *state)
+{
+	struct itimerval timer;
+
+	if (qflash_profiling != NULL) return;
+
+	qflash_wrap_nodes(queryDesc, state);
+
+	state->profile_samples	= (uint64 *) MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+		Max(state->nnodes, 1) * sizeof(uint64));
+	state->profile_total	= 0;
+	state->profile_interval	= qflash_profile_interval;
+
+	if (!qflash_profile_handler_set)
+	{
+		pqsignal(SIGPROF, qflash_profile_handler);
+		qflash_profile_handler_set = true;
+	}
+
+	qflash_profile_node	= -1;
+	qflash_profiling	= state;
+
+	timer.it_interval.tv_sec	= state->profile_interval / 1000000;
+	timer.it_interval.tv_usec	= state->profile_interval % 1000000;
+	timer.it_value				= timer.it_interval;
+
+	if (setitimer(ITIMER_PROF, &timer, NULL) < 0)
+	{
+		qflash_profiling = NULL;
+		elog(WARNING, "could not start q-flash profiling timer: %m");
+	}
+}
+
+void
+qflash_profile_stop(void)
+{
+	struct itimerval timer;
+
+	if (qflash_profiling == NULL) return;
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+
+	qflash_profiling	= NULL;
+	qflash_profile_node	= -1;
+}
+
+static void
+qflash_profile_handler(SIGNAL_ARGS)
+{
+	QFlashQueryState *state = qflash_profiling;
+	int			node = qflash_profile_node;
+
+	if (state == NULL) return;
+
+	state->profile_total++;
+	if (node >= 0 && node < state->nnodes)
+		state->profile_samples[node]++;
+}
+
+/*
+ * Append the samples of every plan node, indented like the plan. Counts are
+ * exclusive: a sample goes to the innermost node running at that moment.
+ * Nodes run by MultiExecProcNode are never entered through the wrapper,
+ * their samples count for the node above them.
+ */
+void
+qflash_profile_report(ExplainState *es, QueryDesc *queryDesc, QFlashQueryState *state)
+{
+	QFlashProfileContext context;
+
+	context.state	= state;
+	context.stmt	= queryDesc->plannedstmt;
+	context.es		= es;
+	context.depth	= 1;
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfo(es->str, "\nProfile: " UINT64_FORMAT " samples every %d us of CPU time",
+			state->profile_total, state->profile_interval);
+		qflash_profile_report_walker(queryDesc->planstate, &context);
+		return;
+	}
+
+	// Structured formats list the nodes flat, in plan order
+	ExplainOpenGroup("Profile", "Profile", true, es);
+	ExplainPropertyLong("Samples", (long) state->profile_total, es);
+	ExplainPropertyInteger("Interval", state->profile_interval, es);
+	ExplainOpenGroup("Nodes", "Nodes", false, es);
+	qflash_profile_report_walker(queryDesc->planstate, &context);
+	ExplainCloseGroup("Nodes", "Nodes", false, es);
+	ExplainCloseGroup("Profile", "Profile", true, es);
+}
+
+bool
+qflash_profile_report_walker(PlanState *planstate, QFlashProfileContext *context)
+{
+	QFlashQueryState *state = context->state;
+	int			id = planstate->plan->plan_node_id;
+	uint64		samples = (id < state->nnodes) ? state->profile_samples[id] : 0;
+	double		percent = state->profile_total > 0 ? 100.0 * samples / state->profile_total : 0.0;
+	ExplainState *es = context->es;
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoChar(es->str, '\n');
+		appendStringInfoSpaces(es->str, context->depth * 2);
+		appendStringInfo(es->str, "%s (node %d): " UINT64_FORMAT " samples, %.1f%%",
+			qflash_node_label(planstate->plan, context->stmt), id, samples, percent);
+	}
+	else
+	{
+		ExplainOpenGroup("Node", NULL, true, es);
+		ExplainPropertyText("Node", qflash_node_label(planstate->plan, context->stmt), es);
+		ExplainPropertyInteger("Node Id", id, es);
+		ExplainPropertyInteger("Depth", context->depth, es);
+		ExplainPropertyLong("Samples", (long) samples, es);
+		ExplainPropertyFloat("Percent", percent, 1, es);
+		ExplainCloseGroup("Node", NULL, true, es);
+	}
+
+	context->depth++;
+	planstate_tree_walker(planstate, qflash_profile_report_walker, context);
+	context->depth--;
+
+	return false;
+}
+
+/*
+ * Short description of a plan node, the relation for scans.
+ */
+char *
+qflash_node_label(Plan *plan, PlannedStmt *stmt)
+{
+	const char *name = qflash_node_type_name(nodeTag(plan));
+	Oid			relid = qflash_node_relid(plan, stmt);
+	char	   *relname = OidIsValid(relid) ? get_rel_name(relid) : NULL;
+
+	if (relname != NULL)
+		return psprintf("%s on %s", name, relname);
+
+	return pstrdup(name);
+}
+
+/*
+ * Relation scanned by a plan node, InvalidOid for other nodes.
+ */
+Oid
+qflash_node_relid(Plan *plan, PlannedStmt *stmt)
+{
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_ForeignScan:
+			if (((Scan *) plan)->scanrelid > 0)
+				return rt_fetch(((Scan *) plan)->scanrelid, stmt->rtable)->relid;
+			break;
+		default:
+			break;
+	}
+
+	return InvalidOid;
+}
+
+/*
+ * Index used by a plan node, InvalidOid for other nodes.
+ */
+Oid
+qflash_node_indexid(Plan *plan)
+{
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			return ((IndexScan *) plan)->indexid;
+		case T_IndexOnlyScan:
+			return ((IndexOnlyScan *) plan)->indexid;
+		case T_BitmapIndexScan:
+			return ((BitmapIndexScan *) plan)->indexid;
+		default:
+			return InvalidOid;
+	}
+}
+
+/*
+ * Move the ticks of every node into its instrumentation, where EXPLAIN
+ * expects the timings.
+ */
+bool
+qflash_apply_ticks_walker(PlanState *planstate, QFlashQueryState *state)
+{
+	if (planstate == NULL) return false;
+
+	if (planstate->instrument != NULL && planstate->plan->plan_node_id < state->nnodes)
+	{
+		QFlashNodeTicks *ticks = &state->node_ticks[planstate->plan->plan_node_id];
+		double		sec_per_tick = qflash_clock_sec_per_tick(state->timing_source);
+
+		InstrEndLoop(planstate->instrument);
+		planstate->instrument->total	+= ticks->total * sec_per_tick;
+		planstate->instrument->startup	+= ticks->startup * sec_per_tick;
+	}
+
+	return planstate_tree_walker(planstate, qflash_apply_ticks_walker, state);
+}
+
+/*
+ * Loops, rows of all loops and total time (msec) of every node, in the order
+ * the nodes appear in the EXPLAIN output.
+ */
+bool
+qflash_node_stats_walker(PlanState *planstate, QFlashNodeStats *stats)
+{
+	Instrumentation *instr;
+
+	if (planstate == NULL) return false;
+
+	if (stats->len + 3 > stats->cap)
+	{
+		stats->cap = stats->cap ? stats->cap * 2 : 48;
+		stats->values = stats->values
+			? repalloc(stats->values, stats->cap * sizeof(double))
+			: palloc(stats->cap * sizeof(double));
+	}
+
+	instr = planstate->instrument;
+	if (instr != NULL)
+	{
+		InstrEndLoop(instr);
+		stats->values[stats->len++] = instr->nloops;
+		stats->values[stats->len++] = instr->ntuples;
+		stats->values[stats->len++] = instr->total * 1000.0;
+	}
+	else
+	{
+		stats->values[stats->len++] = 0;
+		stats->values[stats->len++] = 0;
+		stats->values[stats->len++] = 0;
+	}
+
+	return planstate_tree_walker(planstate, qflash_node_stats_walker, stats);
+}
+
+/*
+ * Resolution of the clock chosen by qflash.timing_source in nanoseconds.
+ */
+Datum
+qflash_timing_resolution(PG_FUNCTION_ARGS)
+{
+	struct timespec res;
+
+	if (qflash_timing_source == QFLASH_TIMING_TSC && qflash_tsc_sec_per_tick > 0)
+		PG_RETURN_FLOAT8(qflash_tsc_sec_per_tick * 1e9);
+
+	if (clock_getres(qflash_timing_source == QFLASH_TIMING_COARSE ? QFLASH_CLOCK_COARSE : CLOCK_MONOTONIC, &res) < 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8((double) res.tv_sec * 1e9 + (double) res.tv_nsec);
+}
+
+/*
+ * Fingerprint of a statement stored as query_id: the queryId when one is
+ * computed, the same as pg_stat_statements shows, a hash of the normalized
+ * statement text otherwise. norm is that text when the caller has it
+ * already, NULL to normalize here. Never zero.
+ */
+uint64
+qflash_statement_fingerprint(QueryDesc *queryDesc, const char *norm, int norm_len)
+{
+	char	   *own_norm = NULL;
+	uint64		fingerprint;
+
+	if (queryDesc->plannedstmt->queryId != 0)
+		return queryDesc->plannedstmt->queryId;
+
+	if (norm == NULL)
+	{
+		const char *stmt_text = qflash_statement_text(queryDesc, &norm_len);
+
+		norm = own_norm = qflash_normalize_query(stmt_text, norm_len, &norm_len);
+	}
+
+	fingerprint = qflash_hash_bytes(QFLASH_FNV_OFFSET, norm, norm_len);
+
+	if (own_norm != NULL)
+		pfree(own_norm);
+
+	return fingerprint != 0 ? fingerprint : 1;
+}
+
+/*
+ * Key of a statement for adaptive instrumentation and the anomaly baselines,
+ * taken at ExecutorStart of every sampled statement: the queryId when one is
+ * computed, otherwise a hash of the statement text with quoted strings and
+ * numbers left out and whitespace collapsed. It skips the scanner the
+ * normalization of query_id needs, which runs only for stored captures. A
+ * statement keeps its key when its plan changes, so a regression caused by
+ * a new plan is judged against the old timings. Never zero.
+ */
+uint64
+qflash_statement_key(QueryDesc *queryDesc)
+{
+	const char *p;
+	const char *end;
+	uint64		key = QFLASH_FNV_OFFSET;
+	int			len;
+	char		prev = ' ';
+
+	if (queryDesc->plannedstmt->queryId != 0)
+		return queryDesc->plannedstmt->queryId;
+
+	p = qflash_statement_text(queryDesc, &len);
+	end = p + len;
+
+	while (p < end)
+	{
+		char		c = *p++;
+
+		if (c == '\'')
+		{
+			// Doubled quotes stay inside the string
+			while (p < end)
+			{
+				if (*p++ != '\'') continue;
+				if (p < end && *p == '\'')
+				{
+					p++;
+					continue;
+				}
+				break;
+			}
+			c = '?';
+		}
+		else if (isdigit((unsigned char) c) && !isalnum((unsigned char) prev) && prev != '_' && prev != '$')
+		{
+			while (p < end && (isalnum((unsigned char) *p) || *p == '.'))
+				p++;
+			c = '?';
+		}
+		else if (scanner_isspace(c))
+		{
+			if (prev == ' ') continue;
+			c = ' ';
+		}
+
+		key = qflash_hash_bytes(key, &c, 1);
+		prev = c;
+	}
+
+	return key != 0 ? key : 1;
+}
+
+/*
+ * Entry of a fingerprint in the shared table, or in a backend-local one when
+ * the module is not preloaded. Returns NULL when it is missing and either
+ * create is false or the table holds qflash.max_fingerprints entries. Caller
+ * holds qflash_fingerprint_lock, exclusively to create, and reads or writes
+ * the other fields under the entry's mutex.
+ */
+QFlashFingerprint *
+qflash_fingerprint_entry(uint64 fingerprint, bool create)
+{
+	HTAB	   *table = qflash_fingerprints;
+	QFlashFingerprint *entry;
+	bool		found;
+
+	if (table == NULL)
+	{
+		if (qflash_local_fingerprints == NULL)
+		{
+			HASHCTL		ctl;
+
+			memset(&ctl, 0, sizeof(ctl));
+			ctl.keysize		= sizeof(uint64);
+			ctl.entrysize	= sizeof(QFlashFingerprint);
+			qflash_local_fingerprints = hash_create("q-flash local fingerprints", 256, &ctl, HASH_ELEM | HASH_BLOBS);
+		}
+		table = qflash_local_fingerprints;
+	}
+
+	entry = (QFlashFingerprint *) hash_search(table, &fingerprint, HASH_FIND, NULL);
+	if (entry != NULL || !create) return entry;
+
+	if (hash_get_num_entries(table) >= qflash_max_fingerprints) return NULL;
+
+	entry = (QFlashFingerprint *) hash_search(table, &fingerprint, HASH_ENTER_NULL, &found);
+	if (entry != NULL && !found)
+	{
+		SpinLockInit(&entry->mutex);
+		entry->slow		= false;
+		entry->calls	= 0;
+		entry->mean		= 0;
+		entry->var		= 0;
+	}
+
+	return entry;
+}
+
+void
+qflash_fingerprint_lock(LWLockMode mode)
+{
+	if (qflash_fingerprints != NULL)
+		LWLockAcquire(qflash_shared->fingerprint_lock, mode);
+}
+
+void
+qflash_fingerprint_unlock(void)
+{
+	if (qflash_fingerprints != NULL)
+		LWLockRelease(qflash_shared->fingerprint_lock);
+}
+
+bool
+qflash_fingerprint_slow(uint64 fingerprint)
+{
+	volatile QFlashFingerprint *entry;
+	bool		slow = false;
+
+	qflash_fingerprint_lock(LW_SHARED);
+	entry = qflash_fingerprint_entry(fingerprint, false);
+	if (entry != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		slow = entry->slow;
+		SpinLockRelease(&entry->mutex);
+	}
+	qflash_fingerprint_unlock();
+
+	return slow;
+}
+
+/*
+ * Later executions of a slow fingerprint get full node instrumentation. Once
+ * the table is full no new fingerprints are marked.
+ */
+void
+qflash_fingerprint_mark_slow(uint64 fingerprint)
+{
+	volatile QFlashFingerprint *entry;
+
+	// Usually known already, only inserting excludes the other backends
+	qflash_fingerprint_lock(LW_SHARED);
+	entry = qflash_fingerprint_entry(fingerprint, false);
+	if (entry == NULL)
+	{
+		qflash_fingerprint_unlock();
+		qflash_fingerprint_lock(LW_EXCLUSIVE);
+		entry = qflash_fingerprint_entry(fingerprint, true);
+	}
+
+	if (entry != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		entry->slow = true;
+		SpinLockRelease(&entry->mutex);
+	}
+	qflash_fingerprint_unlock();
+}
+
+/*
+ * Fold an execution time (msec) into the moving mean and variance of its
+ * fingerprint and tell whether it lies more than qflash.anomaly_sigma
+ * standard deviations above the mean seen so far. Until the baseline has
+ * qflash.anomaly_min_calls executions, or without room for the fingerprint,
+ * every execution counts as anomalous and qflash.log_min_duration decides.
+ */
+bool
+qflash_fingerprint_anomaly(uint64 fingerprint, double total_time)
+{
+	volatile QFlashFingerprint *entry;
+	bool		anomaly = true;
+
+	// Every capture of every backend gets here, only inserting excludes the others
+	qflash_fingerprint_lock(LW_SHARED);
+
+	entry = qflash_fingerprint_entry(fingerprint, false);
+	if (entry == NULL)
+	{
+		qflash_fingerprint_unlock();
+		qflash_fingerprint_lock(LW_EXCLUSIVE);
+		entry = qflash_fingerprint_entry(fingerprint, true);
+	}
+
+	if (entry != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+
+		if (entry->calls >= (uint64) qflash_anomaly_min_calls)
+			anomaly = (total_time > entry->mean + qflash_anomaly_sigma * sqrt(entry->var));
+
+		if (entry->calls == 0)
+			entry->mean = total_time;
+		else
+		{
+			double		diff = total_time - entry->mean;
+			double		incr = qflash_anomaly_alpha * diff;
+
+			entry->mean	+= incr;
+			entry->var	= (1.0 - qflash_anomaly_alpha) * (entry->var + diff * incr);
+		}
+		entry->calls++;
+
+		SpinLockRelease(&entry->mutex);
+	}
+
+	qflash_fingerprint_unlock();
+
+	return anomaly;
+}
+
+void enabled_GucAssign(bool newval, void *extra)
+{
+	qflash_log_rel_valid = false;
+}
+
+/*
+ * Only marks the log relation stale, assign hooks must not touch the
+ * catalogs. It is looked up again by the next statement.
+ */
+void log_rel_GucAssign(const char *newval, void *extra)
+{
+	qflash_log_rel_valid = false;
+}
+
+bool log_namespace_GucCheck(char **newval, void **extra, GucSource source)
+{
+	if (qflash_sink != QFLASH_SINK_RING || qflash_log_rel_changeable("qflash.log_namespace_name", *newval, source))
+		return true;
+
+	GUC_check_errcode(ERRCODE_INSUFFICIENT_PRIVILEGE);
+	GUC_check_errmsg("permission denied to set parameter \"%s\" while qflash.sink is \"ring\"", "qflash.log_namespace_name");
+	return false;
+}
+
+bool log_relname_GucCheck(char **newval, void **extra, GucSource source)
+{
+	if (qflash_sink != QFLASH_SINK_RING || qflash_log_rel_changeable("qflash.log_relname", *newval, source))
+		return true;
+
+	GUC_check_errcode(ERRCODE_INSUFFICIENT_PRIVILEGE);
+	GUC_check_errmsg("permission denied to set parameter \"%s\" while qflash.sink is \"ring\"", "qflash.log_relname");
+	return false;
+}
+
+/*
+ * Switching to the ring sink is refused to a role that moved the log
+ * relation away from its server setting.
+ */
+bool sink_GucCheck(int *newval, void **extra, GucSource source)
+{
+	if (*newval != QFLASH_SINK_RING || qflash_sink == QFLASH_SINK_RING) return true;
+
+	if (qflash_log_rel_changeable("qflash.log_namespace_name", qflash_log_namespace_name, source)
+		&& qflash_log_rel_changeable("qflash.log_relname", qflash_log_rel_name, source))
+		return true;
+
+	GUC_check_errcode(ERRCODE_INSUFFICIENT_PRIVILEGE);
+	GUC_check_errmsg("permission denied to set parameter \"%s\" to \"ring\"", "qflash.sink");
+	GUC_check_errdetail("qflash.log_namespace_name or qflash.log_relname differ from the server setting.");
+	return false;
+}
+
+/*
+ * While qflash.sink is ring the flush worker writes the records, so the log
+ * relation behaves as a superuser setting: other roles may only SET it to
+ * its server value. Settings of ALTER ROLE and ALTER DATABASE apply as
+ * usual, the records are inserted as the capturing role in any case.
+ */
+bool qflash_log_rel_changeable(const char *name, const char *newval, GucSource source)
+{
+	const char *reset_val;
+
+	if (source < PGC_S_CLIENT || !IsTransactionState() || superuser()) return true;
+
+	reset_val = GetConfigOptionResetString(name);
+
+	return strcmp(newval, reset_val != NULL ? reset_val : "") == 0;
+}
+
+void
+_PG_fini(void)
+{
+	/* Uninstall hooks. */
+	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorRun_hook = prev_ExecutorRun;
+	ExecutorFinish_hook = prev_ExecutorFinish;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+	shmem_startup_hook = prev_shmem_startup_hook;
+}
+
+static void
+explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	bool		capture;
+	uint64		fingerprint = 0;
+	bool		full = true;
+	int			instrument_options = 0;
+
+	// Unsampled statements run without instrumentation
+	capture = qflash_enabled(queryDesc) && qflash_sampled();
+
+	qflash_trace(QFLASH_TRACE_HOOKS, "q-flash: ExecutorStart, capture %d", capture);
+
+	if (capture)
+	{
+		if (qflash_instrument_mode == QFLASH_INSTRUMENT_ADAPTIVE || qflash_anomaly_sigma > 0)
+			fingerprint = qflash_statement_key(queryDesc);
+
+		// Per-node timing only for fingerprints that were slow before
+		if (qflash_instrument_mode == QFLASH_INSTRUMENT_ADAPTIVE)
+			full = qflash_fingerprint_slow(fingerprint);
+
+		if (full)
+		{
+			instrument_options = qflash_instrument_options();
+
+			// The profiler takes the place of per-node timing
+			if (qflash_profile_interval > 0)
+				instrument_options &= ~INSTRUMENT_TIMER;
+
+			// Nodes are timed by our own clock instead
+			if (qflash_timing_source != QFLASH_TIMING_SYSTEM)
+				queryDesc->instrument_options |= instrument_options & ~INSTRUMENT_TIMER;
+			else
+				queryDesc->instrument_options |= instrument_options;
+		}
+	}
+
+	if (prev_ExecutorStart) prev_ExecutorStart(queryDesc, eflags);
+	else standard_ExecutorStart(queryDesc, eflags);
+
+	if (capture)
+	{
+		QFlashQueryState *state = qflash_query_state_create(queryDesc);
+
+		state->log_relid	= qflash_log_rel_oid;
+
+		state->fingerprint	= fingerprint;
+		state->full			= full;
+		state->instrument_options = instrument_options;
+		state->timing_source = qflash_timing_source;
+
+		if ((instrument_options & INSTRUMENT_TIMER) && state->timing_source != QFLASH_TIMING_SYSTEM)
+			qflash_node_ticks_init(queryDesc, state);
+
+		if (full && qflash_profile_interval > 0)
+			qflash_profile_start(queryDesc, state);
+
+		if (queryDesc->totaltime == NULL)
+		{
+			MemoryContext oldcxt;
+
+			oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+			queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_TIMER);
+			MemoryContextSwitchTo(oldcxt);
+		}
+	}
+}
+
+/*
+* ExecutorRun hook: track nesting depth and the query being executed
+*/
+static void
+explain_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count, bool execute_once)
+{
+	QFlashQueryState *prev_running = qflash_running;
+
+	qflash_running = qflash_query_state_find(queryDesc);
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+		nesting_level--;
+		qflash_running = prev_running;
+	}
+	PG_CATCH();
+	{
+		nesting_level--;
+		qflash_running = prev_running;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+* ExecutorFinish hook: track nesting depth and the query being executed
+*/
+static void
+explain_ExecutorFinish(QueryDesc *queryDesc)
+{
+	QFlashQueryState *prev_running = qflash_running;
+
+	qflash_running = qflash_query_state_find(queryDesc);
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		nesting_level--;
+		qflash_running = prev_running;
+	}
+	PG_CATCH();
+	{
+		nesting_level--;
+		qflash_running = prev_running;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+static void
+explain_ExecutorEnd(QueryDesc *queryDesc)
+{
+	QFlashQueryState *state;
+
+	state = qflash_query_state_find(queryDesc);
+	qflash_trace(QFLASH_TRACE_HOOKS, "q-flash: ExecutorEnd, captured %d", state != NULL);
+
+	if (state != NULL)
+		qflash_capture(queryDesc, state);
+
+	if (prev_ExecutorEnd) prev_ExecutorEnd(queryDesc);
+	else standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * Render the plan of a finished query and hand it to the sink when the query
+ * ran long enough. Without node instrumentation only the plan with its
+ * estimates is rendered.
+ */
+void
+qflash_capture(QueryDesc *queryDesc, QFlashQueryState *state)
+{
+	ExplainState *es;
+	QFlashRecord rec;
+	QFlashPlanPrune prune;
+	double		total_time;
+	int			format;
+	int			nnodes = 0;
+
+	if (qflash_profiling == state)
+		qflash_profile_stop();
+
+	/* Make sure stats accumulation is done.  (Note: it's okay if several levels of hook all do this.) */
+	InstrEndLoop(queryDesc->totaltime);
+
+	total_time = queryDesc->totaltime->total * 1000.0;
+
+	// Every execution feeds the baseline, before the duration check
+	if (qflash_anomaly_sigma > 0 && state->fingerprint != 0
+		&& !qflash_fingerprint_anomaly(state->fingerprint, total_time))
+		return;
+
+	if (total_time <= qflash_log_min_duration) 
+		return;
+
+	if (state->fingerprint != 0)
+		qflash_fingerprint_mark_slow(state->fingerprint);
+
+	// Rendering and storing the plan is the expensive part
+	if (!qflash_capture_allowed())
+		return;
+
+	if (state->node_ticks != NULL)
+		qflash_apply_ticks_walker(queryDesc->planstate, state);
+
+	format = qflash_plan_format(state->log_relid);
+
+	rec.plan_id		= qflash_plan_dedup ? qflash_plan_hash(queryDesc->plannedstmt, qflash_plan_options(state, format)) : 0;
+	rec.node_stats	= NULL;
+	rec.nnode_stats	= 0;
+	rec.plan_binary	= false;
+	rec.plan_varlena = false;
+	rec.nodes		= NULL;
+	rec.nodes_len	= 0;
+	rec.nodes_varlena = false;
+
+	if (rec.plan_id != 0 && state->full)
+	{
+		QFlashNodeStats stats;
+
+		memset(&stats, 0, sizeof(stats));
+		qflash_node_stats_walker(queryDesc->planstate, &stats);
+		rec.node_stats	= stats.values;
+		rec.nnode_stats	= stats.len;
+	}
+
+	// Encoded once, also for plans left out as already stored
+	if (qflash_log_nodes)
+	{
+		StringInfoData buf;
+
+		qflash_plan_encode(queryDesc, state, &buf);
+		rec.nodes		= buf.data + VARHDRSZ;
+		rec.nodes_len	= buf.len - VARHDRSZ;
+		rec.nodes_varlena = true;
+	}
+
+	// Known shape: the text is in the plan dictionary, the node stats carry the actuals
+	if (rec.plan_id != 0 && state->profile_samples == NULL && qflash_plan_seen(state->log_relid, rec.plan_id))
+	{
+		qflash_trace(QFLASH_TRACE_CAPTURE, "q-flash: plan " UINT64_FORMAT " already stored", rec.plan_id);
+
+		rec.plan		= "";
+		rec.plan_len	= 0;
+		qflash_capture_store(queryDesc, &rec, state, total_time);
+
+		if (rec.nodes != NULL)
+			pfree((char *) rec.nodes - VARHDRSZ);
+		return;
+	}
+
+	if (format == QFLASH_FORMAT_BINARY)
+	{
+		StringInfoData buf;
+
+		if (rec.nodes != NULL)
+		{
+			rec.plan		= rec.nodes;
+			rec.plan_len	= rec.nodes_len;
+		}
+		else
+		{
+			qflash_plan_encode(queryDesc, state, &buf);
+			rec.plan		= buf.data + VARHDRSZ;
+			rec.plan_len	= buf.len - VARHDRSZ;
+		}
+		rec.plan_binary	= true;
+		rec.plan_varlena = true;
+		qflash_capture_store(queryDesc, &rec, state, total_time);
+
+		pfree((char *) rec.plan - VARHDRSZ);
+		return;
+	}
+
+	es = NewExplainState();
+	// Room for a varlena header, the writers store the plan as text in place
+	appendStringInfoSpaces(es->str, VARHDRSZ);
+
+	/* Query plan settings */
+	es->analyze	= state->full;
+	es->verbose	= qflash_log_verbose;
+	es->buffers	= es->analyze && (state->instrument_options & INSTRUMENT_BUFFERS) != 0;
+	es->timing	= es->analyze && (state->instrument_options & INSTRUMENT_TIMER) != 0;
+	es->summary	= es->analyze;
+	es->format	= format;
+
+	// Nodes past the first ones that can fit are left out before rendering,
+	// so a plan over thousands of partitions never takes much more than the
+	// limit in backend memory
+	memset(&prune, 0, sizeof(prune));
+	if (qflash_max_plan_bytes > 0)
+	{
+		qflash_count_nodes_walker(queryDesc->planstate, &nnodes);
+		prune.budget = qflash_max_plan_bytes
+			/ (format == EXPLAIN_FORMAT_TEXT ? QFLASH_NODE_BYTES_TEXT : QFLASH_NODE_BYTES_STRUCTURED) + 1;
+		if (nnodes > prune.budget)
+			qflash_plan_prune_walker(queryDesc->planstate, &prune);
+	}
+
+	PG_TRY();
+	{
+		ExplainBeginOutput(es);				// Header: XML, JSON ... etc. depends es->format
+		ExplainPrintPlan(es, queryDesc);	// Print query plan to es->str->data
+		if (es->analyze)
+			ExplainPrintTriggers(es, queryDesc);	// Add plans for triggers
+		if (state->profile_samples != NULL && es->format != EXPLAIN_FORMAT_TEXT)
+			qflash_profile_report(es, queryDesc, state);
+		ExplainEndOutput(es);				// Footer: XML, JSON ... etc. depends es->format
+
+		/* Remove last line break */
+		if (es->str->len > VARHDRSZ && es->str->data[es->str->len - 1] == '\n')
+			es->str->data[--es->str->len] = '\0';
+
+		if (state->profile_samples != NULL && es->format == EXPLAIN_FORMAT_TEXT)
+			qflash_profile_report(es, queryDesc, state);
+	}
+	PG_CATCH();
+	{
+		qflash_plan_prune_restore(&prune);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	qflash_plan_prune_restore(&prune);
+
+	/* Fix JSON to output an object */
+	if (es->format == EXPLAIN_FORMAT_JSON)
+	{
+		es->str->data[VARHDRSZ] = '{';
+		es->str->data[es->str->len - 1] = '}';
+	}
+
+	if (qflash_max_plan_bytes > 0 && (prune.saved != NIL || es->str->len - VARHDRSZ > qflash_max_plan_bytes))
+		qflash_plan_truncate(es->str, es->format, nnodes);
+
+	rec.plan		= es->str->data + VARHDRSZ;
+	rec.plan_len	= es->str->len - VARHDRSZ;
+	rec.plan_varlena = true;
+
+	qflash_capture_store(queryDesc, &rec, state, total_time);
+
+	// Clean query plan from memory.
+	pfree(es->str->data);
+	if (rec.nodes != NULL)
+		pfree((char *) rec.nodes - VARHDRSZ);
+}
+
+/*
+ * Cut a rendered plan, following the VARHDRSZ reserved bytes, down to
+ * qflash.max_plan_bytes, so the sinks never store more than that, and mark
+ * it with the number of nodes of the whole plan. Text, YAML and XML are
+ * clipped on a character boundary; JSON keeps its complete lines and closes
+ * the groups left open, so it still parses. Markers fit in
+ * QFLASH_PLAN_BYTES_MIN, the smallest limit max_plan_bytes_GucCheck accepts.
+ */
+void
+qflash_plan_truncate(StringInfo str, int format, int nnodes)
+{
+	char		marker[64];
+	int			len = str->len - VARHDRSZ;
+	int			clip;
+
+	if (format == EXPLAIN_FORMAT_JSON)
+	{
+		qflash_plan_truncate_json(str, nnodes);
+		return;
+	}
+
+	snprintf(marker, sizeof(marker), "\n... (truncated, %d plan nodes)", nnodes);
+
+	clip = pg_mbcliplen(str->data + VARHDRSZ, len, Max(qflash_max_plan_bytes - (int) strlen(marker), 0));
+	str->len = VARHDRSZ + clip;
+	str->data[str->len] = '\0';
+	appendStringInfoString(str, marker);
+}
+
+/*
+ * EXPLAIN puts every property and array element of a JSON plan on a line of
+ * its own, so the plan is cut after the last line that leaves room for
+ * closing the groups still open and for the marker properties, which end
+ * the outermost object.
+ */
+void
+qflash_plan_truncate_json(StringInfo str, int nnodes)
+{
+	char		marker[64];
+	char	   *data = str->data + VARHDRSZ;
+	int			len = Min(str->len - VARHDRSZ, qflash_max_plan_bytes);
+	char	   *open = palloc(len + 1);
+	int			depth = 0;
+	int			clip = 1;
+	bool		quoted = false;
+	int			i;
+
+	snprintf(marker, sizeof(marker), ", \"Truncated\": true, \"Plan Nodes\": %d}", nnodes);
+
+	for (i = 0; i < len; i++)
+	{
+		if (quoted)
+		{
+			if (data[i] == '\\')
+				i++;
+			else if (data[i] == '"')
+				quoted = false;
+			continue;
+		}
+
+		if (data[i] == '"')
+			quoted = true;
+		else if (data[i] == '{' || data[i] == '[')
+			depth++;
+		else if (data[i] == '}' || data[i] == ']')
+			depth--;
+		else if (data[i] == '\n' && i + depth - 1 + (int) strlen(marker) <= qflash_max_plan_bytes)
+			clip = i;
+	}
+
+	// The groups open at the cut, outermost first
+	depth = 0;
+	quoted = false;
+	for (i = 0; i < clip; i++)
+	{
+		if (quoted)
+		{
+			if (data[i] == '\\')
+				i++;
+			else if (data[i] == '"')
+				quoted = false;
+			continue;
+		}
+
+		if (data[i] == '"')
+			quoted = true;
+		else if (data[i] == '{' || data[i] == '[')
+			open[depth++] = data[i];
+		else if (data[i] == '}' || data[i] == ']')
+			depth--;
+	}
+
+	// The last line was complete, its separator goes
+	while (clip > 1 && (scanner_isspace(data[clip - 1]) || data[clip - 1] == ','))
+		clip--;
+	str->len = VARHDRSZ + clip;
+	str->data[str->len] = '\0';
+
+	while (depth > 1)
+		appendStringInfoChar(str, open[--depth] == '{' ? '}' : ']');
+
+	appendStringInfoString(str, str->data[str->len - 1] == '{' ? marker + 2 : marker);
+
+	pfree(open);
+}
+
+/*
+ * Number of nodes in a plan tree, subplans included.
+ */
+bool
+qflash_count_nodes_walker(PlanState *planstate, int *nnodes)
+{
+	(*nnodes)++;
+	return planstate_tree_walker(planstate, qflash_count_nodes_walker, nnodes);
+}
+
+/*
+ * Leave out the nodes EXPLAIN would print after the first prune->budget
+ * ones. ExplainNode is not exported, so the plan is rendered by
+ * ExplainPrintPlan and cut short where nothing refers to what is left out:
+ * the member lists of Append, MergeAppend, ModifyTable, BitmapAnd, BitmapOr
+ * and custom scans, init plans and subplans. Children of the other nodes are
+ * needed to deparse their expressions and are always kept. Walks the plan in
+ * the order of ExplainNode.
+ */
+bool
+qflash_plan_prune_walker(PlanState *planstate, QFlashPlanPrune *prune)
+{
+	Plan	   *plan = planstate->plan;
+
+	prune->budget--;
+
+	qflash_plan_prune_list(&planstate->initPlan, true, prune);
+
+	if (outerPlanState(planstate))
+		qflash_plan_prune_walker(outerPlanState(planstate), prune);
+	if (innerPlanState(planstate))
+		qflash_plan_prune_walker(innerPlanState(planstate), prune);
+
+	switch (nodeTag(plan))
+	{
+		case T_ModifyTable:
+			qflash_plan_prune_members(&((ModifyTable *) plan)->plans,
+				((ModifyTableState *) planstate)->mt_plans, prune);
+			break;
+		case T_Append:
+			qflash_plan_prune_members(&((Append *) plan)->appendplans,
+				((AppendState *) planstate)->appendplans, prune);
+			break;
+		case T_MergeAppend:
+			qflash_plan_prune_members(&((MergeAppend *) plan)->mergeplans,
+				((MergeAppendState *) planstate)->mergeplans, prune);
+			break;
+		case T_BitmapAnd:
+			qflash_plan_prune_members(&((BitmapAnd *) plan)->bitmapplans,
+				((BitmapAndState *) planstate)->bitmapplans, prune);
+			break;
+		case T_BitmapOr:
+			qflash_plan_prune_members(&((BitmapOr *) plan)->bitmapplans,
+				((BitmapOrState *) planstate)->bitmapplans, prune);
+			break;
+		case T_SubqueryScan:
+			qflash_plan_prune_walker(((SubqueryScanState *) planstate)->subplan, prune);
+			break;
+		case T_CustomScan:
+			qflash_plan_prune_list(&((CustomScanState *) planstate)->custom_ps, false, prune);
+			break;
+		default:
+			break;
+	}
+
+	qflash_plan_prune_list(&planstate->subPlan, true, prune);
+
+	return false;
+}
+
+// ExplainMemberNodes prints as many states as the plan lists
+void
+qflash_plan_prune_members(List **plans, PlanState **planstates, QFlashPlanPrune *prune)
+{
+	int			n = list_length(*plans);
+	int			i;
+
+	for (i = 0; i < n && prune->budget > 0; i++)
+		qflash_plan_prune_walker(planstates[i], prune);
+
+	if (i < n)
+		qflash_plan_prune_cut(plans, i, prune);
+}
+
+// A list of SubPlanStates, or of PlanStates
+void
+qflash_plan_prune_list(List **states, bool subplans, QFlashPlanPrune *prune)
+{
+	ListCell   *lc;
+	int			i = 0;
+
+	foreach(lc, *states)
+	{
+		if (prune->budget <= 0) break;
+
+		if (subplans)
+			qflash_plan_prune_walker(((SubPlanState *) lfirst(lc))->planstate, prune);
+		else
+			qflash_plan_prune_walker((PlanState *) lfirst(lc), prune);
+		i++;
+	}
+
+	if (i < list_length(*states))
+		qflash_plan_prune_cut(states, i, prune);
+}
+
+// The list itself may belong to a cached plan, the field gets a shorter copy
+void
+qflash_plan_prune_cut(List **field, int n, QFlashPlanPrune *prune)
+{
+	QFlashPrunedList *saved = palloc(sizeof(QFlashPrunedList));
+
+	saved->field	= field;
+	saved->list		= *field;
+	prune->saved	= lappend(prune->saved, saved);
+
+	*field = list_truncate(list_copy(*field), n);
+}
+
+void
+qflash_plan_prune_restore(QFlashPlanPrune *prune)
+{
+	ListCell   *lc;
+
+	foreach(lc, prune->saved)
+	{
+		QFlashPrunedList *saved = (QFlashPrunedList *) lfirst(lc);
+
+		*saved->field = saved->list;
+	}
+}
+
+/*
+ * Fill in the remaining fields of a captured record and store it.
+ */
+void
+qflash_capture_store(QueryDesc *queryDesc, QFlashRecord *rec, QFlashQueryState *state, double total_time)
+{
+	rec->relid		= state->log_relid;
+	rec->userid		= GetUserId();
+	rec->added		= GetCurrentTimestamp();
+	rec->total_time	= total_time;
+	rec->query_id	= 0;
+
+	if (qflash_query_fingerprint)
+	{
+		const char *stmt_text = qflash_statement_text(queryDesc, &rec->query_len);
+
+		rec->query = qflash_normalize_query(stmt_text, rec->query_len, &rec->query_len);
+
+		rec->query_id = qflash_statement_fingerprint(queryDesc, rec->query, rec->query_len);
+	}
+	else
+	{
+		rec->query		= queryDesc->sourceText;
+		rec->query_len	= strlen(queryDesc->sourceText);
+	}
+	rec->hash		= qflash_log_hash;
+	rec->hash_len	= strlen(qflash_log_hash);
+	rec->outcome	= QFLASH_OUTCOME_COMMITTED;
+	rec->rows		= queryDesc->estate->es_processed;
+
+	// Whether it rolls back is known after the record went to the ring
+	rec->xid		= GetCurrentTransactionIdIfAny();
+	if (!TransactionIdIsValid(rec->xid))
+		rec->xid	= GetTopTransactionIdIfAny();
+
+	qflash_trace(QFLASH_TRACE_CAPTURE, "q-flash: captured %.3f ms, plan of %d bytes", rec->total_time, rec->plan_len);
+
+	qflash_store_record(rec);
+}
+
+/*
+ * Text of the executed statement, without the other statements of a
+ * multi-statement query string.
+ */
+const char *
+qflash_statement_text(QueryDesc *queryDesc, int *len)
+{
+	const char *query = queryDesc->sourceText;
+	int			location = queryDesc->plannedstmt->stmt_location;
+	int			query_len = queryDesc->plannedstmt->stmt_len;
+
+	if (location < 0)
+	{
+		*len = strlen(query);
+		return query;
+	}
+
+	query += location;
+	if (query_len <= 0)
+		query_len = strlen(query);
+
+	// stmt_location may point at whitespace after the previous statement
+	while (query_len > 0 && scanner_isspace(*query))
+	{
+		query++;
+		query_len--;
+	}
+
+	*len = query_len;
+	return query;
+}
+
+/*
+ * Statement text with literal constants replaced by $n parameters, numbered
+ * after the parameters already present in the text.
+ */
+char *
+qflash_normalize_query(const char *query, int query_len, int *norm_len)
+{
+	char	   *str = pnstrdup(query, query_len);
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int		   *locs;
+	int		   *lens;
+	int			nlocs = 0;
+	int			cap = 16;
+	int			max_param = 0;
+	StringInfoData buf;
+	int			last = 0;
+	int			i;
+
+	locs = (int *) palloc(cap * sizeof(int));
+	lens = (int *) palloc(cap * sizeof(int));
+
+	yyscanner = scanner_init(str, &yyextra, ScanKeywords, NumScanKeywords);
+	yyextra.escape_string_warning = false;
+
+	for (;;)
+	{
+		int			tok = core_yylex(&yylval, &yylloc, yyscanner);
+
+		if (tok == 0) break;
+
+		if (tok == PARAM)
+		{
+			max_param = Max(max_param, yylval.ival);
+			continue;
+		}
+
+		if (tok != SCONST && tok != BCONST && tok != XCONST && tok != ICONST && tok != FCONST) continue;
+
+		if (nlocs == cap)
+		{
+			cap *= 2;
+			locs = (int *) repalloc(locs, cap * sizeof(int));
+			lens = (int *) repalloc(lens, cap * sizeof(int));
+		}
+
+		// flex terminates the current token inside scanbuf
+		locs[nlocs] = yylloc;
+		lens[nlocs] = strlen(yyextra.scanbuf + yylloc);
+		nlocs++;
+	}
+
+	scanner_finish(yyscanner);
+
+	initStringInfo(&buf);
+	for (i = 0; i < nlocs; i++)
+	{
+		appendBinaryStringInfo(&buf, str + last, locs[i] - last);
+		appendStringInfo(&buf, "$%d", max_param + i + 1);
+		last = locs[i] + lens[i];
+	}
+	appendBinaryStringInfo(&buf, str + last, query_len - last);
+
+	pfree(locs);
+	pfree(lens);
+	pfree(str);
+
+	*norm_len = buf.len;
+	return buf.data;
+}
+
+uint64
+qflash_hash_bytes(uint64 hash, const void *data, Size len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+
+	while (len--)
+	{
+		hash ^= *p++;
+		hash *= QFLASH_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+uint64
+qflash_hash_int(uint64 hash, int32 value)
+{
+	return qflash_hash_bytes(hash, &value, sizeof(value));
+}
+
+/*
+ * Hash of the plan: node types, scanned relations, indexes, join types,
+ * aggregation strategies, sort keys and the expressions of filters, output
+ * columns and join and index conditions, with constants reduced to their
+ * type. Everything the stored plan text shows apart from costs, row counts,
+ * timings and the values of constants, so executions that differ only in
+ * their literals share an id. options are the EXPLAIN options of
+ * qflash_plan_options, the size limit of stored plans is part of the hash
+ * as well: texts rendered differently get different ids. Never zero.
+ */
+uint64
+qflash_plan_hash(PlannedStmt *stmt, int32 options)
+{
+	uint64		hash = QFLASH_FNV_OFFSET;
+	ListCell   *lc;
+
+	hash = qflash_hash_int(hash, options);
+	hash = qflash_hash_int(hash, qflash_max_plan_bytes);
+	hash = qflash_hash_int(hash, (int32) stmt->commandType);
+	hash = qflash_plan_hash_walk(hash, stmt->planTree, stmt);
+
+	foreach(lc, stmt->subplans)
+		hash = qflash_plan_hash_walk(hash, (Plan *) lfirst(lc), stmt);
+
+	return hash != 0 ? hash : 1;
+}
+
+/*
+ * Bitmap of the EXPLAIN options a captured plan is rendered with, the format
+ * in the low byte.
+ */
+int32
+qflash_plan_options(QFlashQueryState *state, int format)
+{
+	int32		options = format & 0xFF;
+
+	if (qflash_log_verbose)
+		options |= 0x100;
+	if (state->full)
+		options |= 0x200;
+	if (state->full && (state->instrument_options & INSTRUMENT_TIMER))
+		options |= 0x400;
+	if (state->full && (state->instrument_options & INSTRUMENT_BUFFERS))
+		options |= 0x800;
+
+	return options;
+}
+
+uint64
+qflash_plan_hash_walk(uint64 hash, Plan *plan, PlannedStmt *stmt)
+{
+	List	   *children = NIL;
+	ListCell   *lc;
+
+	// Keeps a missing left child apart from a missing right one
+	if (plan == NULL) return qflash_hash_int(hash, 0);
+
+	hash = qflash_hash_int(hash, (int32) nodeTag(plan));
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_ForeignScan:
+			if (((Scan *) plan)->scanrelid > 0)
+				hash = qflash_hash_int(hash, (int32) rt_fetch(((Scan *) plan)->scanrelid, stmt->rtable)->relid);
+			break;
+		case T_IndexScan:
+			hash = qflash_hash_int(hash, (int32) rt_fetch(((Scan *) plan)->scanrelid, stmt->rtable)->relid);
+			hash = qflash_hash_int(hash, (int32) ((IndexScan *) plan)->indexid);
+			hash = qflash_hash_expr(hash, (Node *) ((IndexScan *) plan)->indexqualorig);
+			hash = qflash_hash_expr(hash, (Node *) ((IndexScan *) plan)->indexorderbyorig);
+			break;
+		case T_IndexOnlyScan:
+			hash = qflash_hash_int(hash, (int32) rt_fetch(((Scan *) plan)->scanrelid, stmt->rtable)->relid);
+			hash = qflash_hash_int(hash, (int32) ((IndexOnlyScan *) plan)->indexid);
+			hash = qflash_hash_expr(hash, (Node *) ((IndexOnlyScan *) plan)->indexqual);
+			hash = qflash_hash_expr(hash, (Node *) ((IndexOnlyScan *) plan)->indexorderby);
+			break;
+		case T_BitmapIndexScan:
+			hash = qflash_hash_int(hash, (int32) ((BitmapIndexScan *) plan)->indexid);
+			hash = qflash_hash_expr(hash, (Node *) ((BitmapIndexScan *) plan)->indexqualorig);
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			hash = qflash_hash_int(hash, (int32) ((Join *) plan)->jointype);
+			hash = qflash_hash_expr(hash, (Node *) ((Join *) plan)->joinqual);
+			if (IsA(plan, MergeJoin))
+				hash = qflash_hash_expr(hash, (Node *) ((MergeJoin *) plan)->mergeclauses);
+			else if (IsA(plan, HashJoin))
+				hash = qflash_hash_expr(hash, (Node *) ((HashJoin *) plan)->hashclauses);
+			break;
+		case T_Agg:
+			hash = qflash_hash_int(hash, (int32) ((Agg *) plan)->aggstrategy);
+			hash = qflash_hash_bytes(hash, ((Agg *) plan)->grpColIdx, ((Agg *) plan)->numCols * sizeof(AttrNumber));
+			break;
+		case T_Group:
+			hash = qflash_hash_bytes(hash, ((Group *) plan)->grpColIdx, ((Group *) plan)->numCols * sizeof(AttrNumber));
+			break;
+		case T_Sort:
+			hash = qflash_hash_bytes(hash, ((Sort *) plan)->sortColIdx, ((Sort *) plan)->numCols * sizeof(AttrNumber));
+			hash = qflash_hash_bytes(hash, ((Sort *) plan)->sortOperators, ((Sort *) plan)->numCols * sizeof(Oid));
+			hash = qflash_hash_bytes(hash, ((Sort *) plan)->nullsFirst, ((Sort *) plan)->numCols * sizeof(bool));
+			break;
+		case T_Limit:
+			hash = qflash_hash_expr(hash, ((Limit *) plan)->limitOffset);
+			hash = qflash_hash_expr(hash, ((Limit *) plan)->limitCount);
+			break;
+		case T_Result:
+			hash = qflash_hash_expr(hash, ((Result *) plan)->resconstantqual);
+			break;
+		case T_ModifyTable:
+			foreach(lc, ((ModifyTable *) plan)->resultRelations)
+				hash = qflash_hash_int(hash, (int32) rt_fetch(lfirst_int(lc), stmt->rtable)->relid);
+			children = ((ModifyTable *) plan)->plans;
+			break;
+		case T_Append:
+			children = ((Append *) plan)->appendplans;
+			break;
+		case T_MergeAppend:
+			hash = qflash_hash_bytes(hash, ((MergeAppend *) plan)->sortColIdx, ((MergeAppend *) plan)->numCols * sizeof(AttrNumber));
+			hash = qflash_hash_bytes(hash, ((MergeAppend *) plan)->sortOperators, ((MergeAppend *) plan)->numCols * sizeof(Oid));
+			hash = qflash_hash_bytes(hash, ((MergeAppend *) plan)->nullsFirst, ((MergeAppend *) plan)->numCols * sizeof(bool));
+			children = ((MergeAppend *) plan)->mergeplans;
+			break;
+		case T_BitmapAnd:
+			children = ((BitmapAnd *) plan)->bitmapplans;
+			break;
+		case T_BitmapOr:
+			children = ((BitmapOr *) plan)->bitmapplans;
+			break;
+		case T_SubqueryScan:
+			hash = qflash_plan_hash_walk(hash, ((SubqueryScan *) plan)->subplan, stmt);
+			break;
+		case T_CustomScan:
+			children = ((CustomScan *) plan)->custom_plans;
+			break;
+		default:
+			break;
+	}
+
+	hash = qflash_hash_expr(hash, (Node *) plan->qual);
+	hash = qflash_hash_expr(hash, (Node *) plan->targetlist);
+
+	hash = qflash_hash_int(hash, list_length(children));
+	foreach(lc, children)
+		hash = qflash_plan_hash_walk(hash, (Plan *) lfirst(lc), stmt);
+
+	hash = qflash_plan_hash_walk(hash, plan->lefttree, stmt);
+	hash = qflash_plan_hash_walk(hash, plan->righttree, stmt);
+
+	return hash;
+}
+
+/*
+ * Hash of an expression tree: node types, operators, functions, columns,
+ * parameters, result types and the types of constants. Their values, token
+ * locations and the cost estimates of subplans differ between executions of
+ * the same plan and are left out.
+ */
+uint64
+qflash_hash_expr(uint64 hash, Node *expr)
+{
+	qflash_hash_expr_walker(expr, &hash);
+
+	return hash;
+}
+
+bool
+qflash_hash_expr_walker(Node *node, uint64 *hash)
+{
+	uint64		h = *hash;
+
+	if (node == NULL)
+	{
+		*hash = qflash_hash_int(h, 0);
+		return false;
+	}
+
+	h = qflash_hash_int(h, (int32) nodeTag(node));
+
+	switch (nodeTag(node))
+	{
+		case T_List:
+			h = qflash_hash_int(h, list_length((List *) node));
+			break;
+		case T_Var:
+			h = qflash_hash_int(h, (int32) ((Var *) node)->varno);
+			h = qflash_hash_int(h, (int32) ((Var *) node)->varattno);
+			h = qflash_hash_int(h, (int32) ((Var *) node)->varlevelsup);
+			break;
+		case T_Const:
+			{
+				Const	   *c = (Const *) node;
+
+				// Literals differ between executions of the same statement
+				h = qflash_hash_int(h, (int32) c->consttype);
+				h = qflash_hash_int(h, c->consttypmod);
+			}
+			break;
+		case T_Param:
+			h = qflash_hash_int(h, (int32) ((Param *) node)->paramkind);
+			h = qflash_hash_int(h, ((Param *) node)->paramid);
+			h = qflash_hash_int(h, (int32) ((Param *) node)->paramtype);
+			break;
+		case T_Aggref:
+			h = qflash_hash_int(h, (int32) ((Aggref *) node)->aggfnoid);
+			h = qflash_hash_int(h, (int32) ((Aggref *) node)->aggstar);
+			h = qflash_hash_int(h, (int32) ((Aggref *) node)->aggkind);
+			h = qflash_hash_int(h, (int32) ((Aggref *) node)->aggsplit);
+			break;
+		case T_WindowFunc:
+			h = qflash_hash_int(h, (int32) ((WindowFunc *) node)->winfnoid);
+			h = qflash_hash_int(h, (int32) ((WindowFunc *) node)->winstar);
+			h = qflash_hash_int(h, (int32) ((WindowFunc *) node)->winref);
+			break;
+		case T_ArrayRef:
+			h = qflash_hash_int(h, (int32) ((ArrayRef *) node)->refarraytype);
+			h = qflash_hash_int(h, list_length(((ArrayRef *) node)->refupperindexpr));
+			h = qflash_hash_int(h, list_length(((ArrayRef *) node)->reflowerindexpr));
+			break;
+		case T_FuncExpr:
+			h = qflash_hash_int(h, (int32) ((FuncExpr *) node)->funcid);
+			h = qflash_hash_int(h, (int32) ((FuncExpr *) node)->funcformat);
+			h = qflash_hash_int(h, (int32) ((FuncExpr *) node)->funcvariadic);
+			break;
+		case T_NamedArgExpr:
+			h = qflash_hash_int(h, ((NamedArgExpr *) node)->argnumber);
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			h = qflash_hash_int(h, (int32) ((OpExpr *) node)->opno);
+			break;
+		case T_ScalarArrayOpExpr:
+			h = qflash_hash_int(h, (int32) ((ScalarArrayOpExpr *) node)->opno);
+			h = qflash_hash_int(h, (int32) ((ScalarArrayOpExpr *) node)->useOr);
+			break;
+		case T_BoolExpr:
+			h = qflash_hash_int(h, (int32) ((BoolExpr *) node)->boolop);
+			break;
+		case T_SubLink:
+			h = qflash_hash_int(h, (int32) ((SubLink *) node)->subLinkType);
+			h = qflash_hash_int(h, ((SubLink *) node)->subLinkId);
+			break;
+		case T_SubPlan:
+			h = qflash_hash_int(h, (int32) ((SubPlan *) node)->subLinkType);
+			h = qflash_hash_int(h, ((SubPlan *) node)->plan_id);
+			break;
+		case T_FieldSelect:
+			h = qflash_hash_int(h, (int32) ((FieldSelect *) node)->fieldnum);
+			h = qflash_hash_int(h, (int32) ((FieldSelect *) node)->resulttype);
+			break;
+		case T_RelabelType:
+			h = qflash_hash_int(h, (int32) ((RelabelType *) node)->resulttype);
+			h = qflash_hash_int(h, ((RelabelType *) node)->resulttypmod);
+			h = qflash_hash_int(h, (int32) ((RelabelType *) node)->relabelformat);
+			break;
+		case T_CoerceViaIO:
+			h = qflash_hash_int(h, (int32) ((CoerceViaIO *) node)->resulttype);
+			h = qflash_hash_int(h, (int32) ((CoerceViaIO *) node)->coerceformat);
+			break;
+		case T_ArrayCoerceExpr:
+			h = qflash_hash_int(h, (int32) ((ArrayCoerceExpr *) node)->elemfuncid);
+			h = qflash_hash_int(h, (int32) ((ArrayCoerceExpr *) node)->resulttype);
+			h = qflash_hash_int(h, ((ArrayCoerceExpr *) node)->resulttypmod);
+			break;
+		case T_ConvertRowtypeExpr:
+			h = qflash_hash_int(h, (int32) ((ConvertRowtypeExpr *) node)->resulttype);
+			break;
+		case T_CollateExpr:
+			h = qflash_hash_int(h, (int32) ((CollateExpr *) node)->collOid);
+			break;
+		case T_CaseExpr:
+			h = qflash_hash_int(h, (int32) ((CaseExpr *) node)->casetype);
+			h = qflash_hash_int(h, list_length(((CaseExpr *) node)->args));
+			break;
+		case T_CaseTestExpr:
+			h = qflash_hash_int(h, (int32) ((CaseTestExpr *) node)->typeId);
+			break;
+		case T_ArrayExpr:
+			h = qflash_hash_int(h, (int32) ((ArrayExpr *) node)->array_typeid);
+			h = qflash_hash_int(h, (int32) ((ArrayExpr *) node)->multidims);
+			break;
+		case T_RowExpr:
+			h = qflash_hash_int(h, (int32) ((RowExpr *) node)->row_typeid);
+			break;
+		case T_RowCompareExpr:
+			{
+				ListCell   *lc;
+
+				h = qflash_hash_int(h, (int32) ((RowCompareExpr *) node)->rctype);
+				foreach(lc, ((RowCompareExpr *) node)->opnos)
+					h = qflash_hash_int(h, (int32) lfirst_oid(lc));
+			}
+			break;
+		case T_CoalesceExpr:
+			h = qflash_hash_int(h, (int32) ((CoalesceExpr *) node)->coalescetype);
+			break;
+		case T_MinMaxExpr:
+			h = qflash_hash_int(h, (int32) ((MinMaxExpr *) node)->minmaxtype);
+			h = qflash_hash_int(h, (int32) ((MinMaxExpr *) node)->op);
+			break;
+		case T_SQLValueFunction:
+			h = qflash_hash_int(h, (int32) ((SQLValueFunction *) node)->op);
+			h = qflash_hash_int(h, ((SQLValueFunction *) node)->typmod);
+			break;
+		case T_XmlExpr:
+			h = qflash_hash_int(h, (int32) ((XmlExpr *) node)->op);
+			if (((XmlExpr *) node)->name != NULL)
+				h = qflash_hash_bytes(h, ((XmlExpr *) node)->name, strlen(((XmlExpr *) node)->name));
+			break;
+		case T_NullTest:
+			h = qflash_hash_int(h, (int32) ((NullTest *) node)->nulltesttype);
+			h = qflash_hash_int(h, (int32) ((NullTest *) node)->argisrow);
+			break;
+		case T_BooleanTest:
+			h = qflash_hash_int(h, (int32) ((BooleanTest *) node)->booltesttype);
+			break;
+		case T_CoerceToDomain:
+			h = qflash_hash_int(h, (int32) ((CoerceToDomain *) node)->resulttype);
+			break;
+		case T_CoerceToDomainValue:
+			h = qflash_hash_int(h, (int32) ((CoerceToDomainValue *) node)->typeId);
+			break;
+		case T_SetToDefault:
+			h = qflash_hash_int(h, (int32) ((SetToDefault *) node)->typeId);
+			break;
+		case T_CurrentOfExpr:
+			h = qflash_hash_int(h, (int32) ((CurrentOfExpr *) node)->cvarno);
+			h = qflash_hash_int(h, ((CurrentOfExpr *) node)->cursor_param);
+			if (((CurrentOfExpr *) node)->cursor_name != NULL)
+				h = qflash_hash_bytes(h, ((CurrentOfExpr *) node)->cursor_name, strlen(((CurrentOfExpr *) node)->cursor_name));
+			break;
+		case T_NextValueExpr:
+			h = qflash_hash_int(h, (int32) ((NextValueExpr *) node)->seqid);
+			break;
+		case T_TargetEntry:
+			h = qflash_hash_int(h, (int32) ((TargetEntry *) node)->resno);
+			h = qflash_hash_int(h, (int32) ((TargetEntry *) node)->resjunk);
+			break;
+		default:
+			break;
+	}
+
+	*hash = h;
+
+	if (expression_tree_walker(node, qflash_hash_expr_walker, (void *) hash))
+		return true;
+
+	// Closes the node, (a(b) c) and (a(b c)) hash apart
+	*hash = qflash_hash_int(*hash, -1);
+
+	return false;
+}
+
+/*
+ * Take a token from the backend and the global bucket. A backend over its own
+ * limit does not use up tokens of the others. The global limit needs the
+ * shared state and is not enforced without shared_preload_libraries.
+ */
+bool
+qflash_capture_allowed(void)
+{
+	uint64		now = 0;
+
+	if (qflash_max_captures_per_sec > 0 || qflash_backend_max_captures_per_sec > 0)
+		now = (uint64) GetCurrentTimestamp();
+
+	if (qflash_backend_max_captures_per_sec > 0
+		&& !qflash_bucket_take(&qflash_backend_capture_tat, qflash_backend_max_captures_per_sec, now))
+	{
+		qflash_backend_rate_limited++;
+		return false;
+	}
+
+	if (qflash_max_captures_per_sec > 0 && qflash_shared != NULL
+		&& !qflash_bucket_take(&qflash_shared->capture_tat, qflash_max_captures_per_sec, now))
+	{
+		pg_atomic_fetch_add_u64(&qflash_shared->rate_limited, 1);
+		return false;
+	}
+
+	qflash_backend_captured++;
+	if (qflash_shared != NULL)
+		pg_atomic_fetch_add_u64(&qflash_shared->captured, 1);
+
+	return true;
+}
+
+/*
+ * Token bucket holding qflash.capture_burst tokens, refilled at rate per
+ * second. It is kept as the time (usec) at which it would be full again, so
+ * that refill and take are a single compare-and-swap, without a lock.
+ */
+bool
+qflash_bucket_take(pg_atomic_uint64 *tat, double rate, uint64 now)
+{
+	uint64		interval	= (uint64) (1000000.0 / rate);
+	uint64		tolerance	= interval * qflash_capture_burst;
+	uint64		old_tat		= pg_atomic_read_u64(tat);
+
+	for (;;)
+	{
+		uint64		new_tat = Max(old_tat, now) + interval;
+
+		if (new_tat > now + tolerance)
+			return false;
+
+		if (pg_atomic_compare_exchange_u64(tat, &old_tat, new_tat))
+			return true;
+	}
+}
+
+/*
+ * Table of seen plan shapes, shared when preloaded, otherwise of this backend.
+ */
+HTAB *
+qflash_seen_plans_table(void)
+{
+	if (qflash_seen_plans != NULL)
+		return qflash_seen_plans;
+
+	if (qflash_local_seen_plans == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize		= sizeof(QFlashPlanKey);
+		ctl.entrysize	= sizeof(QFlashPlanKey);
+		qflash_local_seen_plans = hash_create("q-flash local seen plans", 256, &ctl, HASH_ELEM | HASH_BLOBS);
+	}
+
+	return qflash_local_seen_plans;
+}
+
+/*
+ * Whether the text of a plan shape is committed in the plan dictionary of a
+ * log relation, so that a capture can leave it out.
+ */
+bool
+qflash_plan_seen(Oid relid, uint64 plan_id)
+{
+	HTAB	   *table = qflash_seen_plans_table();
+	QFlashLogRel *logrel = get_log_rel(relid);
+	QFlashPlanKey key;
+	bool		seen;
+
+	if (logrel == NULL || (logrel->cxt == NULL && !build_log_layout(logrel))
+		|| !OidIsValid(logrel->dict_relids[QFLASH_DICT_PLANS]))
+		return false;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid	= MyDatabaseId;
+	key.relid	= logrel->dict_relids[QFLASH_DICT_PLANS];
+	key.plan_id	= plan_id;
+
+	if (qflash_shared != NULL)
+		LWLockAcquire(qflash_shared->plans_lock, LW_SHARED);
+
+	seen = (hash_search(table, &key, HASH_FIND, NULL) != NULL);
+
+	if (qflash_shared != NULL)
+		LWLockRelease(qflash_shared->plans_lock);
+
+	return seen;
+}
+
+/*
+ * Remember a plan text inserted into a plan dictionary until the inserting
+ * transaction commits.
+ */
+void
+qflash_plan_seen_pending(Oid relid, uint64 plan_id)
+{
+	QFlashPendingPlan *pending;
+
+	if (qflash_npending_plans == qflash_pending_plans_cap)
+	{
+		qflash_pending_plans_cap = qflash_pending_plans_cap ? qflash_pending_plans_cap * 2 : 16;
+		qflash_pending_plans = qflash_pending_plans
+			? repalloc(qflash_pending_plans, qflash_pending_plans_cap * sizeof(QFlashPendingPlan))
+			: MemoryContextAlloc(TopMemoryContext, qflash_pending_plans_cap * sizeof(QFlashPendingPlan));
+	}
+
+	pending = &qflash_pending_plans[qflash_npending_plans++];
+	memset(pending, 0, sizeof(QFlashPendingPlan));
+	pending->key.dbid		= MyDatabaseId;
+	pending->key.relid		= relid;
+	pending->key.plan_id	= plan_id;
+	pending->nest_level		= GetCurrentTransactionNestLevel();
+}
+
+/*
+ * The transaction committed, its plan texts are seen from now on. Shapes that
+ * do not fit into qflash.max_plans, or whose dictionary does not fit into
+ * QFLASH_MAX_PLAN_DICTS, keep being rendered.
+ */
+void
+qflash_plans_publish(void)
+{
+	HTAB	   *table;
+	QFlashPlanDicts *dicts;
+	int			i;
+	int			j;
+
+	if (qflash_npending_plans == 0) return;
+
+	table = qflash_seen_plans_table();
+	dicts = qflash_shared != NULL ? &qflash_shared->plan_dicts : &qflash_local_plan_dicts;
+
+	if (qflash_shared != NULL)
+		LWLockAcquire(qflash_shared->plans_lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < qflash_npending_plans; i++)
+	{
+		QFlashPlanKey *key = &qflash_pending_plans[i].key;
+
+		if (hash_get_num_entries(table) >= qflash_max_plans) break;
+
+		// The relcache callback forgets the entries of the listed dictionaries
+		for (j = 0; j < dicts->ndicts; j++)
+		{
+			if (dicts->dicts[j].dbid == key->dbid && dicts->dicts[j].relid == key->relid) break;
+		}
+		if (j == dicts->ndicts)
+		{
+			if (j == QFLASH_MAX_PLAN_DICTS) continue;
+
+			dicts->dicts[j].dbid	= key->dbid;
+			dicts->dicts[j].relid	= key->relid;
+			dicts->ndicts++;
+		}
+
+		hash_search(table, key, qflash_shared != NULL ? HASH_ENTER_NULL : HASH_ENTER, NULL);
+	}
+
+	if (qflash_shared != NULL)
+		LWLockRelease(qflash_shared->plans_lock);
+
+	qflash_npending_plans = 0;
+}
+
+/*
+ * A relation changed: when it is a plan dictionary with seen entries, it may
+ * have been truncated, dropped or had rows deleted, so its entries are
+ * forgotten and the plans rendered again. InvalidOid forgets the entries of
+ * all dictionaries of this database. Runs from the relcache callback, every
+ * backend gets it, the first one finds the entries. Statistics updates of a
+ * dictionary reset it as well, its plans are then rendered once more.
+ */
+void
+qflash_seen_plans_forget(Oid relid)
+{
+	HTAB	   *table = qflash_seen_plans != NULL ? qflash_seen_plans : qflash_local_seen_plans;
+	QFlashPlanDicts *dicts = qflash_shared != NULL ? &qflash_shared->plan_dicts : &qflash_local_plan_dicts;
+	HASH_SEQ_STATUS status;
+	QFlashPlanKey *entry;
+	bool		listed = false;
+	int			i;
+	int			n;
+
+	if (table == NULL) return;
+
+	// Most invalidations are for other relations, they do not need the exclusive lock
+	if (qflash_shared != NULL)
+		LWLockAcquire(qflash_shared->plans_lock, LW_SHARED);
+
+	for (i = 0; i < dicts->ndicts && !listed; i++)
+	{
+		listed = dicts->dicts[i].dbid == MyDatabaseId && (relid == InvalidOid || dicts->dicts[i].relid == relid);
+	}
+
+	if (qflash_shared != NULL)
+		LWLockRelease(qflash_shared->plans_lock);
+
+	if (!listed) return;
+
+	if (qflash_shared != NULL)
+		LWLockAcquire(qflash_shared->plans_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, table);
+	while ((entry = (QFlashPlanKey *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->dbid == MyDatabaseId && (relid == InvalidOid || entry->relid == relid))
+			hash_search(table, entry, HASH_REMOVE, NULL);
+	}
+
+	for (i = n = 0; i < dicts->ndicts; i++)
+	{
+		if (dicts->dicts[i].dbid != MyDatabaseId || (relid != InvalidOid && dicts->dicts[i].relid != relid))
+			dicts->dicts[n++] = dicts->dicts[i];
+	}
+	dicts->ndicts = n;
+
+	if (qflash_shared != NULL)
+		LWLockRelease(qflash_shared->plans_lock);
+}
+
+/*
+ * Statement trigger qflash_init puts on the dictionaries: rows deleted from
+ * them change nothing the relcache callbacks would see, so the delete sends
+ * an invalidation itself. Every backend forgets the dictionary's seen plans
+ * and the rows it wrote once it commits, this one right away.
+ */
+Datum
+qflash_plans_deleted(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "qflash_plans_deleted: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+	qflash_dict_known_forget(RelationGetRelid(trigdata->tg_relation));
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Capture counters, the global ones NULL without shared_preload_libraries.
+ */
+Datum
+qflash_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[8];
+	bool		nulls[8];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	memset(nulls, false, sizeof(nulls));
+	values[2] = Int64GetDatum((int64) qflash_backend_captured);
+	values[3] = Int64GetDatum((int64) qflash_backend_rate_limited);
+
+	if (qflash_shared != NULL)
+	{
+		values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&qflash_shared->captured));
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&qflash_shared->rate_limited));
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&qflash_shared->file_dropped));
+		values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&qflash_shared->xact_dropped));
+		values[7] = Int64GetDatum((int64) pg_atomic_read_u64(&qflash_shared->partition_skipped));
+
+		LWLockAcquire(qflash_shared->lock, LW_SHARED);
+		values[4] = Int64GetDatum((int64) qflash_shared->dropped);
+		LWLockRelease(qflash_shared->lock);
+	}
+	else
+		nulls[0] = nulls[1] = nulls[4] = nulls[5] = nulls[6] = nulls[7] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Size
+qflash_shmem_size(void)
+{
+	Size		size = qflash_shared_state_size();
+
+	size = add_size(size, hash_estimate_size(qflash_max_fingerprints, sizeof(QFlashFingerprint)));
+	size = add_size(size, hash_estimate_size(qflash_max_plans, sizeof(QFlashPlanKey)));
+
+	return size;
+}
+
+Size
+qflash_shared_state_size(void)
+{
+	return add_size(offsetof(QFlashSharedState, ring), (Size) qflash_ring_size * 1024);
+}
+
+static void
+qflash_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook) prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	qflash_shared = ShmemInitStruct("q-flash", qflash_shared_state_size(), &found);
+	if (!found)
+	{
+		qflash_shared->lock			= &(GetNamedLWLockTranche("q-flash"))[0].lock;
+		qflash_shared->file_lock	= &(GetNamedLWLockTranche("q-flash"))[1].lock;
+		qflash_shared->fingerprint_lock	= &(GetNamedLWLockTranche("q-flash"))[2].lock;
+		qflash_shared->plans_lock	= &(GetNamedLWLockTranche("q-flash"))[3].lock;
+		qflash_shared->file_started	= false;
+		qflash_shared->file_segno	= 0;
+		qflash_shared->file_offset	= 0;
+		qflash_shared->file_segment_size = 0;
+		qflash_shared->worker_latch	= NULL;
+		qflash_shared->worker_dbid	= InvalidOid;
+		qflash_shared->ring_size	= (uint64) qflash_ring_size * 1024;
+		qflash_shared->head			= 0;
+		qflash_shared->tail			= 0;
+		qflash_shared->dropped		= 0;
+		qflash_shared->nrotated		= 0;
+		qflash_shared->plan_dicts.ndicts = 0;
+		pg_atomic_init_u64(&qflash_shared->capture_tat, 0);
+		pg_atomic_init_u64(&qflash_shared->captured, 0);
+		pg_atomic_init_u64(&qflash_shared->rate_limited, 0);
+		pg_atomic_init_u64(&qflash_shared->file_dropped, 0);
+		pg_atomic_init_u64(&qflash_shared->xact_dropped, 0);
+		pg_atomic_init_u64(&qflash_shared->partition_skipped, 0);
+
+		qflash_tsc_calibrate();
+		qflash_shared->tsc_sec_per_tick = qflash_tsc_sec_per_tick;
+	}
+	else
+		qflash_tsc_sec_per_tick = qflash_shared->tsc_sec_per_tick;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize	= sizeof(uint64);
+	info.entrysize	= sizeof(QFlashFingerprint);
+	qflash_fingerprints = ShmemInitHash("q-flash fingerprints", qflash_max_fingerprints, qflash_max_fingerprints,
+		&info, HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize	= sizeof(QFlashPlanKey);
+	info.entrysize	= sizeof(QFlashPlanKey);
+	qflash_seen_plans = ShmemInitHash("q-flash seen plans", qflash_max_plans, qflash_max_plans,
+		&info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
 }
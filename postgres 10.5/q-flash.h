@@ -0,0 +1,737 @@
+/*
+ * q-flash.h
+ *		Types, settings and functions shared by the q-flash translation units
+ */
+#ifndef QFLASH_H
+#define QFLASH_H
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/heapam.h"
+#include "access/parallel.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/transam.h"
+#include "catalog/catalog.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits_fn.h"
+#include "commands/explain.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
+#include "nodes/nodeFuncs.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "optimizer/planner.h"
+#include "parser/parsetree.h"
+#include "parser/scanner.h"
+#include "parser/gram.h"
+#include "parser/parse_func.h"
+#include "parser/scansup.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "rewrite/rewriteHandler.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/json.h"
+#include "catalog/pg_type.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/namespace.h"
+#include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/regproc.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Where captured records are written
+typedef enum
+{
+	QFLASH_SINK_TABLE,		// synchronous insert in the capturing backend
+	QFLASH_SINK_XACT,		// buffered in the backend, bulk inserted at commit
+	QFLASH_SINK_RING,		// shared ring buffer drained by the flush worker
+	QFLASH_SINK_FILE		// appended to binary segment files
+} QFlashSink;
+
+// Open-addressing set of relation OIDs, InvalidOid marks free slots
+typedef struct QFlashOidSet
+{
+	Oid		   *slots;
+	uint32		mask;			// number of slots - 1, at least twice the members
+	int			nmembers;
+} QFlashOidSet;
+
+#define QFLASH_OID_HASH(oid)	((uint32) (oid) * 2654435761U)
+
+// Detail of the q-flash trace messages
+typedef enum
+{
+	QFLASH_TRACE_OFF,
+	QFLASH_TRACE_CAPTURE,	// captured and written records
+	QFLASH_TRACE_HOOKS		// also every executor hook call
+} QFlashTraceLevel;
+
+
+#ifndef unlikely
+#define unlikely(x) (x)
+#endif
+
+/*
+ * Trace messages are compiled in only with -DQFLASH_TRACE (make TRACE=1),
+ * and then cost a single branch while qflash.trace_level is off.
+ */
+#ifdef QFLASH_TRACE
+#define qflash_trace(level, ...) \
+	do { \
+		if (unlikely(qflash_trace_level >= (level))) \
+			elog(LOG, __VA_ARGS__); \
+	} while (0)
+#else
+#define qflash_trace(level, ...) ((void) 0)
+#endif
+
+// How records are put into the log relation
+typedef enum
+{
+	QFLASH_WRITER_HEAP,		// heap_insert and index inserts, no executor
+	QFLASH_WRITER_SPI		// saved INSERT plan executed through SPI
+} QFlashWriter;
+
+// EXPLAIN_FORMAT_* of captured plans, or the binary plan encoding
+#define QFLASH_FORMAT_BINARY	100		// beyond the EXPLAIN_FORMAT_* values
+
+// Smallest qflash.max_plan_bytes, room for the truncation markers
+#define QFLASH_PLAN_BYTES_MIN	64
+
+// Fewest bytes EXPLAIN prints for a plan node in text and in the structured
+// formats; nodes beyond what qflash.max_plan_bytes can hold are not rendered
+#define QFLASH_NODE_BYTES_TEXT		48
+#define QFLASH_NODE_BYTES_STRUCTURED	160
+
+// How statements are picked by qflash.sample_rate
+typedef enum
+{
+	QFLASH_SAMPLE_RANDOM,	// independently per statement
+	QFLASH_SAMPLE_HASH		// per qflash.log_hash, all statements of a request or none
+} QFlashSampleMode;
+
+// How much of a sampled statement is instrumented
+typedef enum
+{
+	QFLASH_INSTRUMENT_FULL,		// every node, timing and buffers
+	QFLASH_INSTRUMENT_ADAPTIVE	// total time only, every node for fingerprints known to be slow
+} QFlashInstrumentMode;
+
+// Clock of per-node timings
+typedef enum
+{
+	QFLASH_TIMING_SYSTEM,	// executor instrumentation, INSTR_TIME_SET_CURRENT
+	QFLASH_TIMING_TSC,		// calibrated time stamp counter
+	QFLASH_TIMING_COARSE	// CLOCK_MONOTONIC_COARSE
+} QFlashTimingSource;
+
+// Time spent in a plan node in clock ticks, summed over its loops
+typedef struct QFlashNodeTicks
+{
+	uint64		total;
+	uint64		startup;		// until the first tuple of each loop
+} QFlashNodeTicks;
+
+// Capture state of a running query, decided when it starts
+typedef struct QFlashQueryState
+{
+	QueryDesc  *queryDesc;
+	Oid			log_relid;		// log relation when the query started
+	uint64		fingerprint;	// zero unless instrumented adaptively or judged by its baseline
+	bool		full;			// every plan node instrumented
+	int			instrument_options;	// INSTRUMENT_* of the plan nodes
+	int			timing_source;	// QFLASH_TIMING_* of the node timings
+	QFlashNodeTicks *node_ticks;	// by plan_node_id, NULL when timed by the executor
+	int			nnodes;			// plan_node_id bound, once the nodes are wrapped
+	uint64	   *profile_samples;	// by plan_node_id, NULL when not profiled
+	uint64		profile_total;	// including samples outside of any node
+	int			profile_interval;	// usec
+	struct QFlashQueryState *next;
+	MemoryContextCallback cb;	// unlinks the state with es_query_cxt
+} QFlashQueryState;
+
+// Walking the plan for the profile report
+typedef struct QFlashProfileContext
+{
+	QFlashQueryState *state;
+	PlannedStmt *stmt;
+	ExplainState *es;
+	int			depth;
+} QFlashProfileContext;
+
+// Binary plan encoding of qflash.log_format = 'binary'
+#define QFLASH_PLAN_MAGIC		'Q'
+#define QFLASH_PLAN_VERSION		2		// node types by qflash_node_types id
+
+#define QFLASH_PLAN_ANALYZE		0x01	// nodes carry loops and rows
+#define QFLASH_PLAN_TIMING		0x02	// and startup and total time
+#define QFLASH_PLAN_BUFFERS		0x04	// and buffer counters
+#define QFLASH_PLAN_PROFILE		0x08	// and profile samples
+
+typedef struct QFlashPlanEncoder
+{
+	QFlashQueryState *state;
+	PlannedStmt *stmt;
+	int			flags;			// QFLASH_PLAN_*
+	StringInfoData nodes;		// encoded nodes, the OIDs go in front
+	Oid		   *rels;			// interned relation and index OIDs
+	int			nrels;
+	int			caprels;
+} QFlashPlanEncoder;
+
+typedef struct QFlashPlanDecoder
+{
+	const uint8 *data;
+	Size		len;
+	Size		off;			// next byte to read
+	int			flags;			// QFLASH_PLAN_*
+	Oid		   *rels;
+	int			nrels;
+	int			format;			// EXPLAIN_FORMAT_TEXT or EXPLAIN_FORMAT_JSON
+	StringInfo	str;
+} QFlashPlanDecoder;
+
+// One node of an encoded plan, actuals per loop
+typedef struct QFlashPlanNode
+{
+	int			id;				// pre-order position, from 1
+	int			parent_id;		// zero for the top node
+	const char *type;
+	uint64		nchildren;
+	Oid			relid;			// InvalidOid for none
+	Oid			indexid;		// InvalidOid for none
+	double		startup_cost;
+	double		total_cost;
+	double		plan_rows;
+	uint64		plan_width;
+	double		loops;
+	double		rows;
+	double		startup_time;	// msec
+	double		total_time;		// msec
+	uint64		buffers[6];		// shared hit, read, dirtied, written, temp read, written
+	uint64		samples;
+} QFlashPlanNode;
+
+// Nodes of an encoded plan collected for the <relname>_nodes table
+typedef struct QFlashPlanNodes
+{
+	QFlashPlanNode *nodes;
+	int			len;
+	int			cap;
+} QFlashPlanNodes;
+
+// Walking the plan for the per-node actuals of a record
+typedef struct QFlashNodeStats
+{
+	double	   *values;
+	int			len;
+	int			cap;
+} QFlashNodeStats;
+
+// How the capturing transaction ended, the aborted column
+typedef enum
+{
+	QFLASH_OUTCOME_COMMITTED,	// or written in that transaction, gone if it rolls back
+	QFLASH_OUTCOME_ABORTED,
+	QFLASH_OUTCOME_UNKNOWN		// no transaction id to look up, stored as NULL
+} QFlashOutcome;
+
+// Member lists of a plan cut short for rendering, restored afterwards
+typedef struct QFlashPlanPrune
+{
+	int			budget;			// nodes still to render
+	List	   *saved;			// QFlashPrunedList
+} QFlashPlanPrune;
+
+typedef struct QFlashPrunedList
+{
+	List	  **field;
+	List	   *list;			// before the cut
+} QFlashPrunedList;
+
+// One captured query, independent of the sink it goes to
+typedef struct QFlashRecord
+{
+	Oid			relid;			// log relation
+	Oid			userid;			// capturing role, the records are inserted as this role
+	TimestampTz	added;			// capture time
+	double		total_time;		// msec
+	const char *query;
+	int			query_len;
+	const char *plan;
+	int			plan_len;
+	bool		plan_binary;	// plan holds the binary encoding, not EXPLAIN text
+	bool		plan_varlena;	// VARHDRSZ writable bytes precede plan, used as a varlena in place
+	const char *hash;
+	int			hash_len;		// zero stores NULL
+	QFlashOutcome outcome;		// how the capturing transaction ended
+	TransactionId xid;			// capturing (sub)transaction, resolved by the flush worker, invalid when
+								// the outcome is known or nothing was written yet
+	uint64		plan_id;		// plan shape hash, zero without plan deduplication
+	uint64		rows;			// rows processed
+	uint64		query_id;		// query fingerprint, zero without fingerprinting
+	const double *node_stats;	// loops, rows and msec of every plan node, NULL without
+	int			nnode_stats;	// values, three per node
+	const char *nodes;			// binary plan encoding for the nodes table, NULL without, may be plan
+	int			nodes_len;
+	bool		nodes_varlena;	// VARHDRSZ writable bytes precede nodes
+} QFlashRecord;
+
+// Serialized record in the ring buffer and segment files, followed by node stats, query, plan, hash and nodes bytes
+typedef struct QFlashRecordHeader
+{
+	uint32		magic;			// QFLASH_RECORD_MAGIC, zero marks the end of a segment
+	uint32		len;			// MAXALIGN'ed length including this header
+	Oid			dbid;
+	Oid			relid;
+	Oid			userid;
+	TimestampTz	added;
+	double		total_time;
+	uint32		query_len;
+	uint32		plan_len;
+	uint32		hash_len;
+	uint32		nnode_stats;
+	uint32		nodes_len;		// zero when the nodes are the plan
+	bool		plan_binary;
+	bool		nodes_in_plan;
+	uint8		outcome;		// QFlashOutcome
+	TransactionId xid;
+	uint64		plan_id;
+	uint64		rows;
+	uint64		query_id;
+} QFlashRecordHeader;
+
+#define QFLASH_RECORD_MAGIC		0x51464C37	// "QFL7"
+
+// Failed flushes of the same ring contents before the worker drops them
+#define QFLASH_FLUSH_MAX_RETRIES	3
+
+// Segment files of the file sink, relative to the data directory
+#define QFLASH_SEGMENT_DIR		"pg_qflash"
+#define QFLASH_FILE_WARN_INTERVAL	60000	// msec between warnings of a backend about dropped records
+
+// Daily partitions created ahead of time, and how often the worker checks
+#define QFLASH_PARTITION_PREMAKE	2
+#define QFLASH_ROTATE_INTERVAL		3600000	// msec
+#define QFLASH_MAX_ROTATED_RELS		64		// partitioned log relations rotated besides the server's
+#define QFLASH_PARTITION_WARN_INTERVAL	60000	// msec between messages of a backend about skipped records
+
+typedef struct QFlashRotatedRel
+{
+	Oid			dbid;
+	Oid			relid;			// partitioned log relation records were written to
+} QFlashRotatedRel;
+
+// Dictionaries with entries in the seen plans table, checked by the relcache
+// callback without catalog access
+#define QFLASH_MAX_PLAN_DICTS	64
+
+typedef struct QFlashPlanDicts
+{
+	int			ndicts;
+	struct
+	{
+		Oid			dbid;
+		Oid			relid;
+	}			dicts[QFLASH_MAX_PLAN_DICTS];
+} QFlashPlanDicts;
+
+
+// Shared state, exists only when loaded from shared_preload_libraries
+typedef struct QFlashSharedState
+{
+	LWLock	   *lock;			// protects everything below
+	Latch	   *worker_latch;	// set after appending, NULL without running worker
+	Oid			worker_dbid;	// database the flush worker is connected to
+	uint64		ring_size;
+	uint64		head;			// next reserved position, never wraps
+	uint64		tail;			// next read position, never wraps, moved by the flush worker only
+	uint64		dropped;		// records rejected because the ring was full
+	LWLock	   *file_lock;		// protects the file sink position below
+	bool		file_started;	// segment number taken over from the directory
+	uint32		file_segno;		// segment being appended to
+	uint64		file_offset;	// next write position in that segment
+	uint64		file_segment_size;	// size of that segment
+	LWLock	   *fingerprint_lock;	// protects qflash_fingerprints
+	LWLock	   *plans_lock;		// protects qflash_seen_plans and plan_dicts
+	QFlashPlanDicts plan_dicts;	// dictionaries of the entries in qflash_seen_plans
+	pg_atomic_uint64 capture_tat;	// token bucket of qflash.max_captures_per_sec
+	pg_atomic_uint64 captured;		// records rendered by all backends
+	pg_atomic_uint64 rate_limited;	// captures refused by qflash.max_captures_per_sec
+	pg_atomic_uint64 file_dropped;	// records the file sink could not write
+	pg_atomic_uint64 xact_dropped;	// records the xact sink could neither write nor hand over
+	pg_atomic_uint64 partition_skipped;	// records of a day without partition
+	double		tsc_sec_per_tick;	// TSC calibration of the postmaster, zero without
+	int			nrotated;		// entries of rotated, under lock
+	QFlashRotatedRel rotated[QFLASH_MAX_ROTATED_RELS];	// log relations set by sessions, rotated by the worker
+	char		ring[FLEXIBLE_ARRAY_MEMBER];	// written outside the lock, see qflash_ring_append
+} QFlashSharedState;
+
+// What is known about the executions of a statement fingerprint
+typedef struct QFlashFingerprint
+{
+	uint64		fingerprint;	// hash key
+	slock_t		mutex;			// protects the baseline below, the entry lock only its existence
+	bool		slow;			// exceeded qflash.log_min_duration
+	uint64		calls;			// executions folded into the baseline
+	double		mean;			// exponentially weighted moving average of the total time, msec
+	double		var;			// exponentially weighted moving variance
+} QFlashFingerprint;
+
+// Plan shape whose text is committed in the plan dictionary of a log relation
+typedef struct QFlashPlanKey
+{
+	Oid			dbid;
+	Oid			relid;			// <relname>_plans dictionary
+	uint64		plan_id;
+} QFlashPlanKey;
+
+// Plan text inserted by the current transaction, seen once it commits
+typedef struct QFlashPendingPlan
+{
+	QFlashPlanKey key;
+	int			nest_level;		// subtransaction that inserted it
+} QFlashPendingPlan;
+
+// State of qflash_read_segments() between calls
+typedef struct QFlashSegmentScan
+{
+	uint32	   *segnos;			// existing segments, ascending
+	int			nsegnos;
+	int			next;			// index of the segment to map next
+	uint32		segno;			// mapped segment
+	char	   *map;
+	Size		map_len;
+	Size		off;			// next record in map
+} QFlashSegmentScan;
+
+// Log relation columns filled from a record, matched by name
+typedef enum
+{
+	QFLASH_COL_ADDED,
+	QFLASH_COL_QUERY,
+	QFLASH_COL_PLAN,
+	QFLASH_COL_TOTAL_TIME,
+	QFLASH_COL_HASH,
+	QFLASH_COL_ABORTED,
+	QFLASH_COL_PLAN_ID,
+	QFLASH_COL_ROWS,
+	QFLASH_COL_QUERY_ID,
+	QFLASH_COL_NODE_STATS,
+	QFLASH_COL_PLAN_BIN,
+	QFLASH_NCOLS
+} QFlashColumn;
+
+// Dictionary tables next to a log relation, one row per distinct key
+typedef enum
+{
+	QFLASH_DICT_PLANS,			// <relname>_plans, plan text per plan shape
+	QFLASH_DICT_QUERIES,		// <relname>_queries, normalized text per fingerprint
+	QFLASH_NDICTS
+} QFlashDict;
+
+// Table and key and value columns of each dictionary
+typedef struct QFlashDictInfo
+{
+	const char *suffix;
+	const char *key;			// BIGINT primary key
+	const char *value;			// TEXT
+} QFlashDictInfo;
+
+// Per node table of a log relation, <relname>_nodes. The first two columns
+// are per log row, the others are passed as arrays and unnested into rows.
+#define QFLASH_NODES_SUFFIX		"_nodes"
+
+typedef enum
+{
+	QFLASH_NODE_COL_LOG_ID,
+	QFLASH_NODE_COL_ADDED,
+	QFLASH_NODE_COL_NODE_ID,
+	QFLASH_NODE_COL_PARENT_ID,
+	QFLASH_NODE_COL_NODE_TYPE,
+	QFLASH_NODE_COL_RELATION,
+	QFLASH_NODE_COL_INDEX_RELATION,
+	QFLASH_NODE_COL_PLAN_ROWS,
+	QFLASH_NODE_COL_ACTUAL_ROWS,
+	QFLASH_NODE_COL_LOOPS,
+	QFLASH_NODE_COL_STARTUP_TIME,
+	QFLASH_NODE_COL_TOTAL_TIME,
+	QFLASH_NODE_COL_SHARED_HIT,
+	QFLASH_NODE_COL_SHARED_READ,
+	QFLASH_NODE_NCOLS
+} QFlashNodeColumn;
+
+// Dictionary rows this backend knows to exist
+typedef struct QFlashDictKey
+{
+	Oid			relid;			// dictionary relation
+	uint64		id;
+} QFlashDictKey;
+
+typedef struct QFlashDictEntry
+{
+	QFlashDictKey key;			// hash key
+	int			nest_level;		// subtransaction that inserted it
+} QFlashDictEntry;
+
+// 64-bit FNV-1a
+#define QFLASH_FNV_OFFSET	UINT64CONST(14695981039346656037)
+#define QFLASH_FNV_PRIME	UINT64CONST(1099511628211)
+
+// Column default evaluated by the heap writer
+typedef struct QFlashDefault
+{
+	AttrNumber	attnum;
+	Expr	   *expr;			// planned default expression
+} QFlashDefault;
+
+// Per log relation writer state, invalidated by relcache callback
+typedef struct QFlashLogRel
+{
+	Oid			relid;			// hash key
+	bool		valid;
+	SPIPlanPtr	plan;			// saved INSERT plan, spi writer
+	MemoryContext cxt;			// layout below, NULL until built
+	bool		heap_ok;		// plain table with the expected column types
+	AttrNumber	atts[QFLASH_NCOLS];	// InvalidAttrNumber for missing columns
+	Oid			added_type;		// timestamptz, timestamp or timetz
+	Oid			plan_type;		// text, or jsonb for JSON plans
+	List	   *defaults;		// QFlashDefault of all other columns, heap writer
+	Oid			dict_relids[QFLASH_NDICTS];	// InvalidOid for missing dictionaries
+	SPIPlanPtr	dict_plans[QFLASH_NDICTS];	// saved INSERT ... ON CONFLICT plans
+	AttrNumber	id_attnum;		// BIGINT id linking the nodes rows, InvalidAttrNumber without
+	Oid			nodes_relid;	// <relname>_nodes, InvalidOid when missing
+	SPIPlanPtr	nodes_plan;		// saved INSERT ... SELECT FROM unnest plan
+	bool		aborted_notnull;	// unknown outcomes are stored as not aborted
+} QFlashLogRel;
+
+// Settings and state of q-flash.c used by the other translation units
+extern char *qflash_log_rel_name;
+extern char *qflash_log_namespace_name;
+extern Oid qflash_log_rel_oid;
+extern bool qflash_log_rel_valid;
+extern int qflash_sink;
+extern char *qflash_database;
+extern int qflash_flush_naptime;
+extern int qflash_writer;
+extern int qflash_xact_batch_size;
+extern int qflash_segment_size;
+extern int qflash_max_segments;
+extern int qflash_retention;
+extern int qflash_trace_level;
+extern int qflash_log_format;
+extern QFlashOidSet qflash_excluded_rels;
+extern QFlashOidSet qflash_included_rels;
+extern bool qflash_relation_sets_complete;
+extern QFlashSharedState *qflash_shared;
+extern QFlashPendingPlan *qflash_pending_plans;
+extern int qflash_npending_plans;
+extern bool qflash_writing;
+
+// Dictionary tables, q-flash-sinks.c
+extern const QFlashDictInfo qflash_dicts[QFLASH_NDICTS];
+
+// count elements in array
+#define NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
+
+// export symbols on windows 
+PGDLLEXPORT void _PG_init();
+PGDLLEXPORT void _PG_fini();
+PGDLLEXPORT void qflash_worker_main(Datum main_arg);
+
+// symbols
+void _PG_init(void);
+void _PG_fini(void);
+
+void enabled_GucAssign(bool newval, void *extra);
+void log_rel_GucAssign(const char *newval, void *extra);
+bool log_namespace_GucCheck(char **newval, void **extra, GucSource source);
+bool log_relname_GucCheck(char **newval, void **extra, GucSource source);
+bool sink_GucCheck(int *newval, void **extra, GucSource source);
+bool tables_GucCheck(char **newval, void **extra, GucSource source);
+bool max_plan_bytes_GucCheck(int *newval, void **extra, GucSource source);
+bool qflash_log_rel_changeable(const char *name, const char *newval, GucSource source);
+
+
+bool set_qflash_namespace_oid(const char *namespace_name);
+bool set_qflash_relname_oid(const char *relname_name);
+Oid get_qflash_log_rel_oid(void);
+void qflash_build_relation_sets(void);
+bool qflash_resolve_tables(const char *tables, List **oids);
+List *qflash_table_name_list(const char *name);
+void qflash_oid_set_build(QFlashOidSet *set, List *oids);
+bool qflash_oid_set_contains(QFlashOidSet *set, Oid relid);
+bool qflash_relations_eligible(List *relationOids);
+
+bool qflash_enabled(QueryDesc *queryDesc);
+bool qflash_sampled(void);
+int qflash_instrument_options(void);
+double qflash_clock_sec_per_tick(int source);
+void qflash_tsc_calibrate(void);
+void qflash_node_ticks_init(QueryDesc *queryDesc, QFlashQueryState *state);
+bool qflash_max_node_id_walker(PlanState *planstate, int *max_id);
+bool qflash_wrap_node_walker(PlanState *planstate, void *context);
+bool qflash_multi_exec_timer_walker(PlanState *planstate, void *context);
+bool qflash_apply_ticks_walker(PlanState *planstate, QFlashQueryState *state);
+bool qflash_node_stats_walker(PlanState *planstate, QFlashNodeStats *stats);
+void qflash_varint_append(StringInfo str, uint64 value);
+uint64 qflash_varint_read(QFlashPlanDecoder *dec);
+uint64 qflash_plan_intern(QFlashPlanEncoder *enc, Oid relid);
+bool qflash_count_children_walker(PlanState *planstate, int *nchildren);
+void qflash_plan_encode(QueryDesc *queryDesc, QFlashQueryState *state, StringInfo buf);
+bool qflash_plan_encode_node(PlanState *planstate, QFlashPlanEncoder *enc);
+void qflash_plan_decoder_init(QFlashPlanDecoder *dec, bytea *plan);
+Oid qflash_plan_rel_ref(QFlashPlanDecoder *dec, uint64 ref);
+char *qflash_plan_rel_name(Oid relid);
+void qflash_plan_read_node(QFlashPlanDecoder *dec, QFlashPlanNode *node);
+void qflash_plan_decode_node(QFlashPlanDecoder *dec, int depth);
+void qflash_plan_collect_nodes(QFlashPlanDecoder *dec, int parent_id, QFlashPlanNodes *nodes);
+void qflash_wrap_nodes(QueryDesc *queryDesc, QFlashQueryState *state);
+void qflash_profile_start(QueryDesc *queryDesc, QFlashQueryState *state);
+void qflash_profile_stop(void);
+void qflash_profile_report(ExplainState *es, QueryDesc *queryDesc, QFlashQueryState *state);
+bool qflash_profile_report_walker(PlanState *planstate, QFlashProfileContext *context);
+char *qflash_node_label(Plan *plan, PlannedStmt *stmt);
+const char *qflash_node_type_name(NodeTag tag);
+int qflash_node_type_id(NodeTag tag);
+Oid qflash_node_relid(Plan *plan, PlannedStmt *stmt);
+Oid qflash_node_indexid(Plan *plan);
+QFlashQueryState *qflash_query_state_create(QueryDesc *queryDesc);
+QFlashQueryState *qflash_query_state_find(QueryDesc *queryDesc);
+void qflash_query_state_release(void *arg);
+uint64 qflash_statement_fingerprint(QueryDesc *queryDesc, const char *norm, int norm_len);
+uint64 qflash_statement_key(QueryDesc *queryDesc);
+QFlashFingerprint *qflash_fingerprint_entry(uint64 fingerprint, bool create);
+void qflash_fingerprint_lock(LWLockMode mode);
+void qflash_fingerprint_unlock(void);
+bool qflash_fingerprint_slow(uint64 fingerprint);
+void qflash_fingerprint_mark_slow(uint64 fingerprint);
+bool qflash_fingerprint_anomaly(uint64 fingerprint, double total_time);
+bool qflash_capture_allowed(void);
+bool qflash_bucket_take(pg_atomic_uint64 *tat, double rate, uint64 now);
+HTAB *qflash_seen_plans_table(void);
+bool qflash_plan_seen(Oid relid, uint64 plan_id);
+void qflash_plan_seen_pending(Oid relid, uint64 plan_id);
+void qflash_plans_publish(void);
+void qflash_seen_plans_forget(Oid relid);
+void qflash_capture(QueryDesc *queryDesc, QFlashQueryState *state);
+void qflash_plan_truncate(StringInfo str, int format, int nnodes);
+void qflash_plan_truncate_json(StringInfo str, int nnodes);
+bool qflash_count_nodes_walker(PlanState *planstate, int *nnodes);
+bool qflash_plan_prune_walker(PlanState *planstate, QFlashPlanPrune *prune);
+void qflash_plan_prune_members(List **plans, PlanState **planstates, QFlashPlanPrune *prune);
+void qflash_plan_prune_list(List **states, bool subplans, QFlashPlanPrune *prune);
+void qflash_plan_prune_cut(List **field, int n, QFlashPlanPrune *prune);
+void qflash_plan_prune_restore(QFlashPlanPrune *prune);
+void qflash_capture_store(QueryDesc *queryDesc, QFlashRecord *rec, QFlashQueryState *state, double total_time);
+uint64 qflash_hash_bytes(uint64 hash, const void *data, Size len);
+uint64 qflash_hash_int(uint64 hash, int32 value);
+uint64 qflash_plan_hash(PlannedStmt *stmt, int32 options);
+int32 qflash_plan_options(QFlashQueryState *state, int format);
+uint64 qflash_plan_hash_walk(uint64 hash, Plan *plan, PlannedStmt *stmt);
+uint64 qflash_hash_expr(uint64 hash, Node *expr);
+bool qflash_hash_expr_walker(Node *node, uint64 *hash);
+const char *qflash_statement_text(QueryDesc *queryDesc, int *len);
+char *qflash_normalize_query(const char *query, int query_len, int *norm_len);
+void qflash_store_record(QFlashRecord *rec);
+void log_InRelation(QFlashRecord *rec);
+void qflash_write_records(QFlashRecord *recs, int nrecs);
+bool qflash_log_rel_usable(Oid relid);
+int qflash_partition_filter(QFlashRecord *recs, int nrecs);
+bool qflash_insert_record(QFlashRecord *rec, int64 *log_id);
+bool qflash_heap_insert_records(QFlashRecord *recs, int nrecs, int64 *log_ids);
+void qflash_write_nodes(QFlashLogRel *logrel, QFlashRecord *rec, int64 log_id);
+Datum qflash_node_column_datum(QFlashPlanNode *node, int flags, int col, bool *isnull);
+SPIPlanPtr get_insert_nodes_plan(QFlashLogRel *logrel);
+HeapTuple qflash_form_tuple(QFlashLogRel *logrel, TupleDesc tupdesc, QFlashRecord *rec, List *defaults, ExprContext *econtext);
+void qflash_batch_append(QFlashRecord *rec);
+char *qflash_copy_bytes(const char *data, int len);
+Datum qflash_varlena_datum(const char *data, int len, bool in_place);
+void qflash_batch_flush(bool committing);
+void qflash_batch_write(bool committing);
+void qflash_batch_reset(void);
+void qflash_batch_handoff(void);
+void qflash_xact_callback(XactEvent event, void *arg);
+void qflash_subxact_callback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg);
+void qflash_dict_known_release(int nest_level, bool aborted);
+void qflash_dict_known_forget(Oid relid);
+char* generate_insert_log_query(QFlashLogRel *logrel);
+QFlashLogRel* get_log_rel(Oid relid);
+int qflash_plan_format(Oid relid);
+SPIPlanPtr get_insert_log_plan(QFlashLogRel *logrel);
+bool build_log_layout(QFlashLogRel *logrel);
+Datum qflash_column_datum(QFlashLogRel *logrel, QFlashRecord *rec, int col, bool *isnull);
+Datum qflash_node_stats_datum(QFlashRecord *rec);
+Datum qflash_plan_bin_datum(QFlashRecord *rec);
+void qflash_spi_connect(bool *spi_connected);
+void qflash_write_dicts(QFlashLogRel *logrel, QFlashRecord *recs, int nrecs, bool *spi_connected);
+bool qflash_dict_entry(QFlashRecord *rec, int dict, uint64 *id, const char **value, int *value_len, bool *in_place);
+SPIPlanPtr get_insert_dict_plan(QFlashLogRel *logrel, int dict);
+void qflash_relcache_callback(Datum arg, Oid relid);
+void qflash_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
+
+Size qflash_shmem_size(void);
+Size qflash_shared_state_size(void);
+bool qflash_ring_available(void);
+bool qflash_ring_append(QFlashRecord *rec);
+void qflash_ring_reject(void);
+void qflash_ring_copy_in(uint64 pos, const void *src, Size len);
+void qflash_ring_copy_out(uint64 pos, void *dst, Size len);
+void qflash_ring_flush(MemoryContext flush_cxt, bool final);
+bool qflash_record_resolve(QFlashRecordHeader *hdr);
+void qflash_ring_flush_run(QFlashRecord *recs, int nrecs);
+void qflash_record_header(QFlashRecord *rec, QFlashRecordHeader *hdr);
+void qflash_record_decode(QFlashRecordHeader *hdr, const char *data, QFlashRecord *rec);
+bool qflash_record_valid(QFlashRecordHeader *hdr, uint64 avail);
+
+bool qflash_file_append(QFlashRecord *rec);
+bool qflash_file_drop(const char *action, const char *path);
+uint32 qflash_file_last_segno(void);
+void qflash_segment_path(char *path, uint32 segno);
+int qflash_segment_list(uint32 **segnos);
+void qflash_segment_scan_release(void *arg);
+
+void qflash_rotate_partitions(Oid relid);
+void qflash_partition_name(char *name, const char *relname, int64 day);
+bool qflash_partition_create(Oid nspid, const char *nspname, const char *relname, const char *pkey, int64 day);
+void qflash_partitions_drop(Oid relid, const char *nspname, const char *relname, int64 today);
+void qflash_partition_bound(char *bound, int64 day);
+bool qflash_partition_day(const char *relname, const char *child_name, int64 *day);
+void qflash_execute_ddl(const char *query);
+bool qflash_worker_rotate(void);
+bool qflash_worker_rotate_rel(Oid relid);
+void qflash_rotated_rel_add(Oid relid);
+void qflash_rotated_rel_remove(Oid relid);
+
+#endif							/* QFLASH_H */
@@ -0,0 +1,28 @@
+--
+-- Plan and query texts stored once in the dictionaries, written again
+-- after their rows were deleted
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_dedup;
+SELECT qflash_init('qflash_dedup', 'qflash');
+CREATE TABLE qflash_dedup.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_dedup';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_dedup.t';
+SET qflash.plan_dedup = on;
+SET qflash.query_fingerprint = on;
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_dedup.t WHERE id > 1;
+SELECT count(*) FROM qflash_dedup.t WHERE id > 5;
+SELECT count(DISTINCT plan_id) AS plans, count(DISTINCT query_id) AS queries,
+  count(*) AS records, count(plan) AS plan_texts, count(node_stats) AS node_stats
+  FROM qflash_dedup.qflash;
+SELECT count(*) FROM qflash_dedup.qflash_plans;
+SELECT query LIKE 'SELECT count(*) FROM qflash_dedup.t WHERE id > $1%' AS normalized
+  FROM qflash_dedup.qflash_queries;
+DELETE FROM qflash_dedup.qflash_plans;
+DELETE FROM qflash_dedup.qflash_queries;
+SELECT count(*) FROM qflash_dedup.t WHERE id > 7;
+SELECT count(*) FROM qflash_dedup.qflash_plans;
+SELECT count(*) FROM qflash_dedup.qflash_queries;
+SET qflash.enabled = off;
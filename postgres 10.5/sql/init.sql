@@ -0,0 +1,37 @@
+--
+-- Functions of the module, created by hand as in the README
+--
+LOAD 'q-flash';
+CREATE FUNCTION qflash_init(TEXT, TEXT, BOOL DEFAULT false) RETURNS bool
+AS 'q-flash', 'qflash_init' LANGUAGE C STRICT;
+CREATE FUNCTION qflash_rotate(TEXT, TEXT) RETURNS bool
+AS 'q-flash', 'qflash_rotate' LANGUAGE C STRICT;
+CREATE FUNCTION qflash_decode_plan(bytea, text DEFAULT 'text') RETURNS text
+AS 'q-flash', 'qflash_decode_plan' LANGUAGE C STRICT STABLE;
+CREATE FUNCTION qflash_timing_resolution() RETURNS float8
+AS 'q-flash', 'qflash_timing_resolution' LANGUAGE C STRICT;
+CREATE FUNCTION qflash_read_segments(OUT segno integer, OUT added timestamptz,
+  OUT dbid oid, OUT relid oid, OUT total_time float8, OUT query text, OUT plan text,
+  OUT hash text, OUT aborted bool, OUT plan_id bigint, OUT rows bigint,
+  OUT query_id bigint, OUT node_stats float8[], OUT plan_bin bytea)
+RETURNS SETOF record AS 'q-flash', 'qflash_read_segments' LANGUAGE C STRICT;
+CREATE FUNCTION qflash_stats(OUT captured bigint, OUT rate_limited bigint,
+  OUT backend_captured bigint, OUT backend_rate_limited bigint, OUT ring_dropped bigint,
+  OUT file_dropped bigint, OUT xact_dropped bigint, OUT partition_skipped bigint)
+RETURNS record AS 'q-flash', 'qflash_stats' LANGUAGE C;
+-- Log relation with its dictionaries, node table and deletion triggers
+CREATE SCHEMA qflash_init;
+SELECT qflash_init('qflash_init', 'qflash');
+SELECT relname FROM pg_class
+  WHERE relnamespace = 'qflash_init'::regnamespace AND relkind = 'r' ORDER BY relname;
+SELECT tgname, tgrelid::regclass AS relation FROM pg_trigger
+  WHERE tgrelid IN ('qflash_init.qflash_plans'::regclass, 'qflash_init.qflash_queries'::regclass)
+  ORDER BY tgname;
+-- Clock of the per-node timings
+SELECT qflash_timing_resolution() > 0 AS resolution;
+SET qflash.timing_source = 'coarse';
+SELECT qflash_timing_resolution() > 0 AS resolution;
+SET qflash.timing_source = 'tsc';
+SELECT qflash_timing_resolution() > 0 AS resolution;
+-- Nothing captured yet by this backend
+SELECT backend_captured, backend_rate_limited FROM qflash_stats();
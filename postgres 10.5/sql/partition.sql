@@ -0,0 +1,30 @@
+--
+-- Daily partitions, created ahead of time and by qflash_rotate()
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_part;
+SELECT qflash_init('qflash_part', 'qflash', true);
+CREATE TABLE qflash_part.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_part';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_part.t';
+SELECT inhparent::regclass AS relation, count(*) AS partitions FROM pg_inherits
+  WHERE inhparent IN ('qflash_part.qflash'::regclass, 'qflash_part.qflash_nodes'::regclass)
+  GROUP BY 1 ORDER BY 1;
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_part.t;
+SELECT count(*) FROM qflash_part.qflash;
+-- Records of a day without partition are skipped
+DO $$
+BEGIN
+  EXECUTE format('DROP TABLE qflash_part.%I', 'qflash_p' || to_char(now() AT TIME ZONE 'UTC', 'YYYYMMDD'));
+END
+$$;
+SELECT count(*) FROM qflash_part.t;
+SELECT count(*) FROM qflash_part.qflash;
+SELECT partition_skipped IS NULL OR partition_skipped > 0 AS counted FROM qflash_stats();
+SELECT qflash_rotate('qflash_part', 'qflash');
+SELECT count(*) FROM pg_inherits WHERE inhparent = 'qflash_part.qflash'::regclass;
+SELECT count(*) FROM qflash_part.t;
+SELECT count(*) FROM qflash_part.qflash;
+SET qflash.enabled = off;
@@ -0,0 +1,50 @@
+--
+-- Plan formats, the binary encoding, the node table and plan size limits
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_plans;
+SELECT qflash_init('qflash_plans', 'qflash');
+CREATE TABLE qflash_plans.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_plans';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_plans.t';
+SET qflash.log_format = 'binary';
+SET qflash.log_nodes = on;
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_plans.t;
+SET qflash.enabled = off;
+SELECT plan IS NULL AS no_text, split_part(qflash_decode_plan(plan_bin), '  (', 1) AS top,
+  qflash_decode_plan(plan_bin, 'json')::jsonb #>> '{Plan,Plans,0,Node Type}' AS child
+  FROM qflash_plans.qflash;
+SELECT node_id, relation, node_type FROM qflash_plans.qflash_nodes ORDER BY node_id;
+SELECT qflash_decode_plan(plan_bin, 'yaml') FROM qflash_plans.qflash;
+SELECT qflash_decode_plan('\x51'::bytea);
+-- Text plans cut at qflash.max_plan_bytes keep their first lines
+SET qflash.log_format = 'text';
+SET qflash.log_nodes = off;
+SET qflash.max_plan_bytes = 64;
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_plans.t;
+SET qflash.enabled = off;
+SELECT length(plan) <= 64 AS fits, plan LIKE 'Aggregate%' AS prefix,
+  plan LIKE '%... (truncated, 2 plan nodes)' AS marked
+  FROM qflash_plans.qflash WHERE plan IS NOT NULL;
+-- JSON plans stay valid JSON when cut
+SET qflash.log_format = 'json';
+SET qflash.max_plan_bytes = 160;
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_plans.t;
+SET qflash.enabled = off;
+SELECT (plan::jsonb ->> 'Truncated')::bool AS truncated
+  FROM qflash_plans.qflash WHERE plan LIKE '{%';
+RESET qflash.max_plan_bytes;
+-- Log relations created for JSON plans index the node labels
+CREATE SCHEMA qflash_json;
+SELECT qflash_init('qflash_json', 'qflash');
+CREATE TABLE qflash_json.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_json';
+SET qflash.include_tables = 'qflash_json.t';
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_json.t;
+SET qflash.enabled = off;
+SELECT qflash_json.qflash_plan_nodes(plan) AS nodes FROM qflash_json.qflash;
@@ -0,0 +1,21 @@
+--
+-- File sink, records are appended to segment files. Without
+-- shared_preload_libraries they are inserted into the log relation.
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_file;
+SELECT qflash_init('qflash_file', 'qflash');
+CREATE TABLE qflash_file.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_file';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_file.t';
+SET qflash.sink = 'file';
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_file.t;
+SET qflash.enabled = off;
+SELECT (SELECT count(*) FROM qflash_file.qflash)
+  + (SELECT count(*) FROM qflash_read_segments() s
+     WHERE s.dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+       AND s.relid = 'qflash_file.qflash'::regclass
+       AND s.query LIKE 'SELECT count(*) FROM qflash_file.t%') AS captured;
+SELECT file_dropped IS NULL OR file_dropped = 0 AS written FROM qflash_stats();
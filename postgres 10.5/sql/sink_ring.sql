@@ -0,0 +1,27 @@
+--
+-- Ring sink, records are written by the flush worker of qflash.database.
+-- The worker runs only with shared_preload_libraries and never in the
+-- regression database, sink_ring_1.out has the output of a preloaded server.
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_ring;
+SELECT qflash_init('qflash_ring', 'qflash');
+CREATE TABLE qflash_ring.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_ring';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_ring.t';
+-- Roles other than superusers keep the log relation of the server setting
+CREATE ROLE regress_qflash;
+SET ROLE regress_qflash;
+SET qflash.sink = 'ring';
+RESET ROLE;
+DROP ROLE regress_qflash;
+SET qflash.sink = 'ring';
+SET qflash.enabled = on;
+-- Dropped and counted, never inserted by the backend
+SELECT count(*) FROM qflash_ring.t;
+-- Reported once a minute
+SELECT count(*) FROM qflash_ring.t;
+SELECT count(*) FROM qflash_ring.qflash;
+SELECT ring_dropped IS NULL OR ring_dropped >= 2 AS counted FROM qflash_stats();
+SET qflash.enabled = off;
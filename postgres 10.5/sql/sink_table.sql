@@ -0,0 +1,34 @@
+--
+-- Table sink, records are inserted by the capturing statement
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_table;
+SELECT qflash_init('qflash_table', 'qflash');
+CREATE TABLE qflash_table.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_table';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_table.t';
+SET qflash.log_hash = 'request-1';
+SET qflash.enabled = on;
+SELECT count(*) FROM qflash_table.t;
+SELECT query LIKE 'SELECT count(*) FROM qflash_table.t%' AS query, plan LIKE 'Aggregate%' AS plan,
+  total_time > 0 AS timed, rows, hash, aborted
+  FROM qflash_table.qflash;
+SELECT backend_captured, backend_rate_limited FROM qflash_stats();
+-- Statements on other tables and on the log relation are not captured
+SELECT count(*) FROM pg_class WHERE relname = 't' AND relnamespace = 'qflash_table'::regnamespace;
+SELECT count(*) FROM qflash_table.qflash;
+-- The record goes with the transaction that captured it
+BEGIN;
+SELECT count(*) FROM qflash_table.t;
+ROLLBACK;
+SELECT count(*) FROM qflash_table.qflash;
+-- Statements below qflash.log_min_duration are left out
+SET qflash.log_min_duration = 100000;
+SELECT count(*) FROM qflash_table.t;
+RESET qflash.log_min_duration;
+-- The spi writer inserts through a saved plan
+SET qflash.writer = 'spi';
+UPDATE qflash_table.t SET id = id WHERE id = 1;
+SELECT query LIKE 'UPDATE%' AS query, rows FROM qflash_table.qflash ORDER BY id;
+SET qflash.enabled = off;
@@ -0,0 +1,37 @@
+--
+-- Xact sink, records are buffered and inserted when the transaction commits
+--
+LOAD 'q-flash';
+CREATE SCHEMA qflash_xact;
+SELECT qflash_init('qflash_xact', 'qflash');
+CREATE TABLE qflash_xact.t AS SELECT g AS id FROM generate_series(1, 10) g;
+SET qflash.log_namespace_name = 'qflash_xact';
+SET qflash.log_relname = 'qflash';
+SET qflash.include_tables = 'qflash_xact.t';
+SET qflash.sink = 'xact';
+SET qflash.enabled = on;
+BEGIN;
+SELECT count(*) FROM qflash_xact.t;
+SELECT count(*) FROM qflash_xact.qflash;
+COMMIT;
+SELECT count(*) FROM qflash_xact.qflash;
+-- Statements of a rolled back subtransaction are marked aborted
+BEGIN;
+SAVEPOINT s;
+UPDATE qflash_xact.t SET id = id WHERE id = 1;
+ROLLBACK TO SAVEPOINT s;
+UPDATE qflash_xact.t SET id = id WHERE id = 2;
+COMMIT;
+SELECT query LIKE 'UPDATE%' AS query, aborted FROM qflash_xact.qflash ORDER BY id;
+-- Without the flush worker the records of a rolled back transaction are gone
+BEGIN;
+SELECT count(*) FROM qflash_xact.t;
+ROLLBACK;
+SELECT count(*) FROM qflash_xact.qflash;
+-- A full batch is written before the commit
+SET qflash.xact_batch_size = 1;
+BEGIN;
+SELECT count(*) FROM qflash_xact.t;
+SELECT count(*) FROM qflash_xact.qflash;
+COMMIT;
+SET qflash.enabled = off;
@@ -1,4 +1,6 @@
 #include "postgres.h"
+#include "access/xact.h"
+#include "catalog/pg_inherits_fn.h"
 #include "commands/explain.h"
 #include "executor/spi.h"
 #include "utils/guc.h"
@@ -7,7 +9,10 @@
 #include "catalog/namespace.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/datetime.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include <limits.h>
 
 PG_MODULE_MAGIC;
 
@@ -20,6 +25,48 @@ static char		*qflash_log_namespace_name	= "";
 static Oid		qflash_log_namespace_oid	= InvalidOid;
 static Oid		qflash_log_rel_oid			= InvalidOid;
 static bool		qflash_log_nested			= false;
+static int		qflash_retention			= 0;	// days of log partitions kept, 0 keeps all
+static int		qflash_trace_level			= 0;	// QFLASH_TRACE_*, only in builds with QFLASH_TRACE
+
+// Set while writing a capture, our own insert is never captured
+static bool		qflash_writing				= false;
+
+// Daily partitions created ahead of time by qflash_rotate
+#define QFLASH_PARTITION_PREMAKE	2
+
+// Detail of the q-flash trace messages
+typedef enum
+{
+	QFLASH_TRACE_OFF,
+	QFLASH_TRACE_CAPTURE,	// captured records
+	QFLASH_TRACE_HOOKS		// also every executor hook call
+} QFlashTraceLevel;
+
+static const struct config_enum_entry trace_level_options[] = {
+	{"off", QFLASH_TRACE_OFF, false},
+	{"capture", QFLASH_TRACE_CAPTURE, false},
+	{"hooks", QFLASH_TRACE_HOOKS, false},
+	{NULL, 0, false}
+};
+
+// 9.6 has no branch hints
+#ifndef unlikely
+#define unlikely(x) (x)
+#endif
+
+/*
+ * Trace messages are compiled in only with -DQFLASH_TRACE (make TRACE=1),
+ * and then cost a single branch while qflash.trace_level is off.
+ */
+#ifdef QFLASH_TRACE
+#define qflash_trace(level, ...) \
+	do { \
+		if (unlikely(qflash_trace_level >= (level))) \
+			elog(LOG, __VA_ARGS__); \
+	} while (0)
+#else
+#define qflash_trace(level, ...) ((void) 0)
+#endif
 
 // Current nesting depth of ExecutorRun calls
 static int  nesting_level		= 0;
@@ -59,13 +106,24 @@ bool qflash_enabled(QueryDesc *queryDesc);
 void log_InRelation(ExplainState *es, QueryDesc *queryDesc);
 char* generate_insert_log_query(void);
 
+void qflash_rotate_partitions(Oid relid);
+void qflash_partition_create(const char *nspname, Oid nspid, const char *relname, int64 day);
+void qflash_partitions_drop(Oid relid, const char *nspname, const char *relname, int64 today);
+void qflash_partition_name(char *name, const char *relname, int64 day);
+void qflash_partition_bound(char *bound, int64 day);
+bool qflash_partition_day(const char *relname, const char *child_name, int64 *day);
+int64 qflash_timestamp_day(TimestampTz ts);
+void qflash_execute(const char *query, int expected);
+
 PG_FUNCTION_INFO_V1(qflash_init);
+PG_FUNCTION_INFO_V1(qflash_rotate);
 
 Datum
 qflash_init(PG_FUNCTION_ARGS)
 {
 	text  *namespace_name	= PG_GETARG_TEXT_P(0);
 	text  *relname_name		= PG_GETARG_TEXT_P(1);
+	bool   partitioned		= PG_NARGS() > 2 ? PG_GETARG_BOOL(2) : false;
 	StringInfoData	ddl_query;
 	
 	initStringInfo(&ddl_query);
@@ -73,14 +131,14 @@ qflash_init(PG_FUNCTION_ARGS)
 		CREATE TABLE %s.%s\
 		(\
 			id BIGSERIAL NOT NULL,\
-			added TIME WITH TIME ZONE NOT NULL DEFAULT now(),\
+			added TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(),\
 			query TEXT,\
 			plan TEXT,\
 			total_time DOUBLE PRECISION,\
 			hash TEXT,\
 			CONSTRAINT qflash_pkey PRIMARY KEY(id)\
 		)\
-	", VARDATA(namespace_name), VARDATA(relname_name));
+	", text_to_cstring(namespace_name), text_to_cstring(relname_name));
 
 	if (SPI_connect() != SPI_OK_CONNECT)
 	{
@@ -93,6 +151,42 @@ qflash_init(PG_FUNCTION_ARGS)
 		elog(ERROR, "SPI_execute DDL failed");
 	}
 
+	if (partitioned)
+		qflash_rotate_partitions(get_relname_relid(text_to_cstring(relname_name),
+			get_namespace_oid(text_to_cstring(namespace_name), false)));
+
+	if (SPI_finish() != SPI_OK_FINISH)
+	{
+		elog(ERROR, "SPI_finish failed");
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Create partitions of a partitioned log relation ahead of time and drop the
+ * expired ones. Call it daily, e.g. from cron.
+ */
+Datum
+qflash_rotate(PG_FUNCTION_ARGS)
+{
+	char  *namespace_name	= text_to_cstring(PG_GETARG_TEXT_P(0));
+	char  *relname_name		= text_to_cstring(PG_GETARG_TEXT_P(1));
+	Oid		relid			= get_relname_relid(relname_name, get_namespace_oid(namespace_name, false));
+
+	if (!OidIsValid(relid))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_TABLE),
+			 errmsg("relation \"%s.%s\" does not exist", namespace_name, relname_name)));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+	{
+		elog(ERROR, "SPI_connect failed");
+		PG_RETURN_BOOL(false);
+	}
+
+	qflash_rotate_partitions(relid);
+
 	if (SPI_finish() != SPI_OK_FINISH)
 	{
 		elog(ERROR, "SPI_finish failed");
@@ -101,11 +195,157 @@ qflash_init(PG_FUNCTION_ARGS)
 	PG_RETURN_BOOL(true);
 }
 
+/*
+ * Partitioning by inheritance: the log relation has one child per UTC day
+ * named <relname>_pYYYYMMDD with a CHECK constraint on added, so
+ * constraint_exclusion skips the days a query does not ask for. Captures are
+ * written into the child of their day directly, rows of a day without child
+ * stay in the log relation itself. Create the children up to
+ * QFLASH_PARTITION_PREMAKE days ahead, drop those that ended more than
+ * qflash.retention days ago and delete the expired rows of the log relation.
+ * Caller is connected to SPI.
+ */
 void
-_PG_init(void)
+qflash_rotate_partitions(Oid relid)
+{
+	char	   *relname = get_rel_name(relid);
+	Oid			nspid;
+	char	   *nspname;
+	int64		today;
+	char		cutoff[16];
+	int			i;
+
+	if (relname == NULL) return;
+
+	nspid	= get_rel_namespace(relid);
+	nspname	= get_namespace_name(nspid);
+	today	= qflash_timestamp_day(GetCurrentTimestamp());
+
+	for (i = 0; i <= QFLASH_PARTITION_PREMAKE; i++)
+		qflash_partition_create(nspname, nspid, relname, today + i);
+
+	if (qflash_retention <= 0) return;
+
+	qflash_partitions_drop(relid, nspname, relname, today);
+
+	qflash_partition_bound(cutoff, today - qflash_retention);
+	qflash_execute(psprintf("DELETE FROM ONLY %s WHERE added < '%s 00:00:00+00'",
+		quote_qualified_identifier(nspname, relname), cutoff), SPI_OK_DELETE);
+}
+
+void
+qflash_partition_create(const char *nspname, Oid nspid, const char *relname, int64 day)
+{
+	char		part_name[NAMEDATALEN];
+	char		from[16];
+	char		to[16];
+
+	qflash_partition_name(part_name, relname, day);
+	if (OidIsValid(get_relname_relid(part_name, nspid))) return;
+
+	qflash_partition_bound(from, day);
+	qflash_partition_bound(to, day + 1);
+
+	qflash_execute(psprintf(
+		"CREATE TABLE IF NOT EXISTS %s (CONSTRAINT %s PRIMARY KEY (id), "
+		"CONSTRAINT %s CHECK (added >= '%s 00:00:00+00' AND added < '%s 00:00:00+00')) INHERITS (%s)",
+		quote_qualified_identifier(nspname, part_name), quote_identifier(psprintf("%s_pkey", part_name)),
+		quote_identifier(psprintf("%s_added_check", part_name)), from, to,
+		quote_qualified_identifier(nspname, relname)), SPI_OK_UTILITY);
+}
+
+/*
+ * Drop the children that ended more than qflash.retention days ago.
+ */
+void
+qflash_partitions_drop(Oid relid, const char *nspname, const char *relname, int64 today)
+{
+	List	   *children;
+	ListCell   *lc;
+
+	children = find_inheritance_children(relid, NoLock);
+	foreach(lc, children)
+	{
+		char	   *child_name = get_rel_name(lfirst_oid(lc));
+		int64		day;
+
+		if (child_name == NULL || !qflash_partition_day(relname, child_name, &day)) continue;
+
+		// Still has rows younger than the retention
+		if (day + 1 + qflash_retention > today) continue;
+
+		qflash_execute(psprintf("DROP TABLE IF EXISTS %s", quote_qualified_identifier(nspname, child_name)),
+			SPI_OK_UTILITY);
+	}
+}
+
+void
+qflash_partition_name(char *name, const char *relname, int64 day)
+{
+	int			year;
+	int			month;
+	int			mday;
+
+	j2date((int) (day + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+	snprintf(name, NAMEDATALEN, "%s_p%04d%02d%02d", relname, year, month, mday);
+}
+
+void
+qflash_partition_bound(char *bound, int64 day)
+{
+	int			year;
+	int			month;
+	int			mday;
+
+	j2date((int) (day + POSTGRES_EPOCH_JDATE), &year, &month, &mday);
+	snprintf(bound, 16, "%04d-%02d-%02d", year, month, mday);
+}
+
+/*
+ * Day of a partition from its name, false for relations not named by
+ * qflash_partition_name.
+ */
+bool
+qflash_partition_day(const char *relname, const char *child_name, int64 *day)
 {
-	elog(LOG, "Init started!");
+	Size		prefix_len = strlen(relname);
+	int			year;
+	int			month;
+	int			mday;
+
+	if (strncmp(child_name, relname, prefix_len) != 0 || strncmp(child_name + prefix_len, "_p", 2) != 0) return false;
+
+	child_name += prefix_len + 2;
+	if (strlen(child_name) != 8 || strspn(child_name, "0123456789") != 8) return false;
+	if (sscanf(child_name, "%4d%2d%2d", &year, &month, &mday) != 3) return false;
 
+	*day = date2j(year, month, mday) - POSTGRES_EPOCH_JDATE;
+	return true;
+}
+
+// UTC day since 2000-01-01 of a timestamp
+int64
+qflash_timestamp_day(TimestampTz ts)
+{
+#ifdef HAVE_INT64_TIMESTAMP
+	return ts / USECS_PER_DAY;
+#else
+	return (int64) (ts / SECS_PER_DAY);
+#endif
+}
+
+void
+qflash_execute(const char *query, int expected)
+{
+	if (SPI_execute(query, false, 0) != expected)
+	{
+		elog(ERROR, "SPI_execute failed for \"%s\"", query);
+	}
+}
+
+void
+_PG_init(void)
+{
 	/* Define custom GUC variables. */
 	DefineCustomBoolVariable("qflash.enabled",
 		"Is query flash enabled.",
@@ -137,6 +377,16 @@ _PG_init(void)
 		"Log nested statements.", NULL,
 		&qflash_log_nested, false, PGC_SUSET, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("qflash.retention",
+		"Days of log partitions kept by qflash_rotate.",
+		"Older partitions are dropped, zero keeps all.",
+		&qflash_retention, 0, 0, INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("qflash.trace_level",
+		"Log what q-flash does, in builds with QFLASH_TRACE only.",
+		"capture traces captured records, hooks also every executor hook call.",
+		&qflash_trace_level, QFLASH_TRACE_OFF, trace_level_options, PGC_SUSET, 0, NULL, NULL, NULL);
+
 	/* Install hooks. */
 	prev_ExecutorStart = ExecutorStart_hook;
 	ExecutorStart_hook = explain_ExecutorStart;
@@ -184,6 +434,7 @@ qflash_enabled(QueryDesc *queryDesc)
 {
 	return ( 
 		qflash_enabled_status
+		&& !qflash_writing
 		&& (nesting_level == 0 || qflash_log_nested)
 		&& get_qflash_log_rel_oid() != InvalidOid
 		&& (queryDesc->operation == CMD_SELECT || queryDesc->operation == CMD_UPDATE || queryDesc->operation == CMD_INSERT || queryDesc->operation == CMD_DELETE)
@@ -240,8 +491,8 @@ _PG_fini(void)
 static void
 explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-	elog(LOG, "Init explain_ExecutorStart");
-	
+	qflash_trace(QFLASH_TRACE_HOOKS, "q-flash: ExecutorStart");
+
 	if (qflash_enabled(queryDesc))
 	{
 		queryDesc->instrument_options |= INSTRUMENT_ALL;
@@ -258,8 +509,6 @@ explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL);
 		MemoryContextSwitchTo(oldcxt);
 	}
-
-	elog(DEBUG1, "End explain_ExecutorStart");
 }
 
 /*
@@ -314,7 +563,7 @@ explain_ExecutorEnd(QueryDesc *queryDesc)
 {
 	ExplainState *es;
 
-	elog(LOG, "Init explain_ExecutorEnd");
+	qflash_trace(QFLASH_TRACE_HOOKS, "q-flash: ExecutorEnd");
 
 	if (qflash_enabled(queryDesc))
 	{
@@ -358,8 +607,6 @@ explain_ExecutorEnd(QueryDesc *queryDesc)
 
 	if (prev_ExecutorEnd) prev_ExecutorEnd(queryDesc);
 	else standard_ExecutorEnd(queryDesc);
-	
-	elog(DEBUG1, "End explain_ExecutorEnd");
 }
 
 void
@@ -379,6 +626,9 @@ log_InRelation(ExplainState *es, QueryDesc *queryDesc)
 	const char* query_string = generate_insert_log_query();
 	if (!query_string) return;
 
+	qflash_trace(QFLASH_TRACE_CAPTURE, "q-flash: captured %.3f ms, plan of %d bytes",
+		queryDesc->totaltime->total * 1000.0, es->str->len);
+
 	if (nesting_spi_level < nesting_level)
 	{
 		SPI_push();
@@ -396,30 +646,54 @@ log_InRelation(ExplainState *es, QueryDesc *queryDesc)
 		return;
 	}
 	
-	spi_plan = SPI_prepare(query_string, NELEMS(arg_types), arg_types);
+	qflash_writing = true;
 
-	if (spi_plan == NULL)
+	PG_TRY();
 	{
-		elog(ERROR, "SPI_execute_plan failed for \"%s\" when log query \"%s\"", query_string, queryDesc->sourceText);
-	}
+		spi_plan = SPI_prepare(query_string, NELEMS(arg_types), arg_types);
+
+		if (spi_plan == NULL)
+		{
+			elog(ERROR, "SPI_execute_plan failed for \"%s\" when log query \"%s\"", query_string, queryDesc->sourceText);
+		}
 
-	spi_res_state = SPI_execute_plan(spi_plan, values, nulls, false, 1);
+		spi_res_state = SPI_execute_plan(spi_plan, values, nulls, false, 1);
 
-	if (spi_res_state <= 0)
+		if (spi_res_state <= 0)
+		{
+			elog(ERROR, "SPI_execute_plan failed for \"%s\" when log query \"%s\"", query_string, queryDesc->sourceText);
+		}
+
+		if (SPI_finish() != SPI_OK_FINISH)
+			elog(ERROR, "SPI_finish failed");
+	}
+	PG_CATCH();
 	{
-		elog(ERROR, "SPI_execute_plan failed for \"%s\" when log query \"%s\"", query_string, queryDesc->sourceText);
+		qflash_writing = false;
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	if (SPI_finish() != SPI_OK_FINISH)
-		elog(ERROR, "SPI_finish failed");
+	qflash_writing = false;
 }
 
 char*
 generate_insert_log_query()
 {
 	StringInfoData insert_log_query;
+	const char *relname = qflash_log_rel_name;
+	char		part_name[NAMEDATALEN];
+
+	// Rows of partitioned log relations go to the child of the day of now()
+	if (has_subclass(qflash_log_rel_oid))
+	{
+		qflash_partition_name(part_name, qflash_log_rel_name,
+			qflash_timestamp_day(GetCurrentTransactionStartTimestamp()));
+		if (OidIsValid(get_relname_relid(part_name, qflash_log_namespace_oid))) relname = part_name;
+	}
+
 	initStringInfo(&insert_log_query);
-	appendStringInfo(&insert_log_query, "INSERT INTO %s.%s (query, plan, total_time, hash) VALUES ($1, $2, $3, $4)", qflash_log_namespace_name, qflash_log_rel_name);
+	appendStringInfo(&insert_log_query, "INSERT INTO %s.%s (query, plan, total_time, hash) VALUES ($1, $2, $3, $4)", qflash_log_namespace_name, relname);
 
 	return insert_log_query.data;
 }
\ No newline at end of file